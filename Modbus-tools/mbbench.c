@@ -0,0 +1,699 @@
+/*****************************************************************
+ * Modbus throughput benchmark
+ *
+ * Runs mbm against mbs without any hardware and reports what the
+ * tools achieve: over a simulated serial bus (see mbsim) for every
+ * baudrate given, and over Modbus TCP on the loopback for "tcp".
+ * Every combination of baudrate, registers per request, number of
+ * slaves and request mix is run for a few seconds:
+ *
+ *   hold   - read holding registers (FC 0x03) of every slave
+ *   input  - read input registers (FC 0x04) of every slave
+ *   mixed  - both of every slave, in turn
+ *
+ * mbm polls all requests back to back (period 1us), so the bus is
+ * never idle. The results are taken from the statistics of mbm and
+ * mbs (see mbstats.c) and from the CPU time of both processes:
+ *
+ *   tx/s     transactions per second, failed ones are counted apart
+ *   p50/p99  round trip time of mbm, ms, from the histograms of all
+ *            slaves merged
+ *   wire     line time of request and response at the baudrate, ms
+ *   model    transactions per second if the bus carried nothing but
+ *            the frames and the t3.5 silence after every transaction
+ *   eff      tx/s of the model achieved
+ *   mbm/mbs  CPU time per transaction, us
+ *   bus      share of the time the simulated line was busy, from
+ *            the bytes carried by mbsim meanwhile
+ *
+ * The round trip time less the wire time is what the tools, the
+ * kernel and the simulator add. Over TCP there is no wire time.
+ *
+ * Author: Ondrej Wisniewski
+ *
+ * Build with this command:
+ * gcc mbbench.c mbcommon.c -o mbbench -lmodbus
+ *
+ * History:
+ * 14/10/2026: First release
+ * 14/10/2026: Quantiles from the merged histogram of all slaves
+ *
+ *****************************************************************/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <modbus/modbus.h>
+#include "mbcommon.h"
+#include "mbtcp.h"
+
+
+#define VERSION       "0.1"
+
+/* Debug mode */
+#define DEBUG         0
+
+/* Default sweep */
+#define RUN_TIME      3
+#define BAUDRATES     "9600,38400,115200,tcp"
+#define NUM_REGS      "1,16,125"
+#define NUM_SLAVES    "1,8"
+#define MIXES         "hold,mixed"
+
+#define MAX_LIST      16
+#define MAX_SLAVES    247
+#define MAX_BUCKETS   64     /* of a histogram in the statistics */
+#define TCP_PORT      15020
+
+/* Time allowed for a tool to start and to stop, ms */
+#define START_TIME    300
+#define STOP_TIME     5000
+
+/* Request mixes */
+#define MIX_HOLD      0
+#define MIX_INPUT     1
+#define MIX_MIXED     2
+
+static const char *mix_name[] = { "hold", "input", "mixed", NULL };
+
+/* Files of a run in the work directory */
+static const char *work_file[] = { "mbm.prom", "mbs.prom", "table", "regs", NULL };
+
+/* Benchmark point */
+typedef struct {
+   int baudrate;           /* 0 for Modbus TCP */
+   int num_reg;
+   int num_slaves;
+   int mix;
+} bench_t;
+
+/* Benchmark result */
+typedef struct {
+   double time;            /* s */
+   uint64_t requests;
+   uint64_t failures;
+   double p50;             /* us */
+   double p99;
+   double mbm_cpu;         /* s */
+   double mbs_cpu;
+   double bus_busy;        /* %, -1 if unknown */
+} result_t;
+
+static char work_dir[64];
+static const char *tool_dir = ".";
+static int run_time = RUN_TIME;
+static int window = 1;
+static int csv;
+
+
+uint64_t time_now(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
+
+
+int parse_list(const char *str, int *val, int max, const char *const *names)
+{
+   char buf[256];
+   char *p;
+   int n = 0;
+   int i;
+
+   snprintf(buf, sizeof(buf), "%s", str);
+   for (p=strtok(buf, ","); p != NULL; p=strtok(NULL, ","))
+   {
+      if (n == max)
+         return -1;
+      if (names != NULL)
+      {
+         /* Names are looked up, "tcp" as baudrate is 0 */
+         for (i=0; (names[i] != NULL) && (strcmp(p, names[i]) != 0); i++);
+         if (names[i] == NULL)
+            return -1;
+         val[n++] = i;
+      }
+      else if (strcmp(p, "tcp") == 0)
+         val[n++] = 0;
+      else if ((val[n++] = atoi(p)) <= 0)
+         return -1;
+   }
+
+   return n;
+}
+
+
+pid_t spawn(char *const argv[], int out_fd)
+{
+   pid_t pid;
+   int fd;
+
+   if (DEBUG)
+   {
+      int i;
+
+      printf("DBG: starting");
+      for (i=0; argv[i] != NULL; i++)
+         printf(" %s", argv[i]);
+      printf("\n");
+   }
+
+   pid = fork();
+   if (pid == 0)
+   {
+      /* Output goes to the pipe of the caller or nowhere */
+      fd = (out_fd != -1) ? out_fd : open("/dev/null", O_WRONLY);
+      dup2(fd, STDOUT_FILENO);
+      dup2(fd, STDERR_FILENO);
+      execv(argv[0], argv);
+      _exit(127);
+   }
+   if (pid == -1)
+      printf("Unable to start %s: %s\n", argv[0], strerror(errno));
+
+   return pid;
+}
+
+
+int stop_tool(pid_t pid, int sig, double *cpu)
+{
+   struct rusage ru;
+   uint64_t deadline = time_now() + STOP_TIME*1000;
+   int status;
+   pid_t rc;
+
+   if (pid <= 0)
+      return -1;
+
+   kill(pid, sig);
+   while (((rc = wait4(pid, &status, WNOHANG, &ru)) == 0) && (time_now() < deadline))
+      usleep(10000);
+   if (rc == 0)
+   {
+      printf("%d does not stop, killed\n", (int)pid);
+      kill(pid, SIGKILL);
+      wait4(pid, &status, 0, &ru);
+   }
+
+   if (cpu != NULL)
+      *cpu = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec/1e6 + ru.ru_stime.tv_sec + ru.ru_stime.tv_usec/1e6;
+
+   return 0;
+}
+
+
+pid_t start_bus(int baudrate, int *out_fd)
+{
+   char path[256], prefix[128], baud[16], line[256];
+   char *argv[] = { path, "-l", prefix, baud, NULL };
+   FILE *fp;
+   int fd[2];
+   pid_t pid;
+
+   snprintf(path, sizeof(path), "%s/mbsim", tool_dir);
+   snprintf(prefix, sizeof(prefix), "%s/port", work_dir);
+   snprintf(baud, sizeof(baud), "%d", baudrate);
+
+   if (pipe(fd) != 0)
+      return -1;
+   pid = spawn(argv, fd[1]);
+   close(fd[1]);
+   if (pid == -1)
+   {
+      close(fd[0]);
+      return -1;
+   }
+
+   /* The ports exist once the simulator is ready */
+   fp = fdopen(dup(fd[0]), "r");
+   while ((fp != NULL) && (fgets(line, sizeof(line), fp) != NULL))
+   {
+      if (strncmp(line, "ready", 5) == 0)
+      {
+         fclose(fp);
+         *out_fd = fd[0];
+         return pid;
+      }
+   }
+   if (fp != NULL)
+      fclose(fp);
+
+   printf("Bus simulator failed\n");
+   close(fd[0]);
+   stop_tool(pid, SIGTERM, NULL);
+   return -1;
+}
+
+
+int64_t stop_bus(pid_t pid, int out_fd)
+{
+   char buf[1024], *p;
+   unsigned long long bytes;
+   int64_t rc = -1;
+   int n, len = 0;
+
+   stop_tool(pid, SIGTERM, NULL);
+
+   /* Bytes carried, from the statistics printed on exit */
+   while ((len < (int)sizeof(buf)-1) && ((n = read(out_fd, &buf[len], sizeof(buf)-1-len)) > 0))
+      len += n;
+   buf[len] = '\0';
+   close(out_fd);
+   for (p=strtok(buf, "\n"); p != NULL; p=strtok(NULL, "\n"))
+   {
+      if (sscanf(p, "%llu bytes in", &bytes) == 1)
+         rc = bytes;
+   }
+
+   return rc;
+}
+
+
+int wait_port(int port)
+{
+   struct sockaddr_in addr;
+   uint64_t deadline = time_now() + START_TIME*1000;
+   int fd, rc;
+
+   memset(&addr, 0, sizeof(addr));
+   addr.sin_family = AF_INET;
+   addr.sin_port = htons(port);
+   addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+   /* The slave is up once it accepts connections */
+   do
+   {
+      fd = socket(AF_INET, SOCK_STREAM, 0);
+      rc = connect(fd, (struct sockaddr *)&addr, sizeof(addr));
+      close(fd);
+      if (rc == 0)
+         return 0;
+      usleep(10000);
+   } while (time_now() < deadline);
+
+   printf("Slave does not listen on port %d\n", port);
+   return -1;
+}
+
+
+int write_files(const bench_t *b)
+{
+   char name[128];
+   FILE *fp;
+   int s;
+
+   /* Registers for the largest requests, holding and input */
+   snprintf(name, sizeof(name), "%s/regs", work_dir);
+   fp = fopen(name, "w");
+   if (fp == NULL)
+      return -1;
+   fprintf(fp, "holding 0 %d\ninput 0 %d\n", MODBUS_MAX_READ_REGISTERS, MODBUS_MAX_READ_REGISTERS);
+   fclose(fp);
+
+   /* All requests due all the time, polled exactly as listed */
+   snprintf(name, sizeof(name), "%s/table", work_dir);
+   fp = fopen(name, "w");
+   if (fp == NULL)
+      return -1;
+   fprintf(fp, "coalesce * 0 0\n");
+   for (s=1; s<=b->num_slaves; s++)
+   {
+      if (b->mix != MIX_INPUT)
+         fprintf(fp, "%d 3 0 %d 1us\n", s, b->num_reg);
+      if (b->mix != MIX_HOLD)
+         fprintf(fp, "%d 4 0 %d 1us\n", s, b->num_reg);
+   }
+   fclose(fp);
+
+   return 0;
+}
+
+
+static double quantile(const double *le, const uint64_t *count, int num, double q)
+{
+   double rank, lower = 0;
+   uint64_t below = 0;
+   int i;
+
+   if ((num == 0) || (count[num-1] == 0))
+      return 0;
+
+   /* Linear within the bucket holding the sample of that rank, the
+      way Prometheus estimates quantiles from a histogram */
+   rank = q*count[num-1];
+   for (i=0; (i<num-1) && (count[i] < rank); i++)
+   {
+      lower = le[i];
+      below = count[i];
+   }
+   if ((i == num-1) || (count[i] == below))
+      return lower;
+
+   return lower + (le[i] - lower)*(rank - below)/(count[i] - below);
+}
+
+
+int read_stats(const char *name, result_t *r)
+{
+   double le[MAX_BUCKETS];
+   uint64_t count[MAX_BUCKETS];
+   char line[256];
+   const char *p;
+   FILE *fp;
+   double bound;
+   int num = 0;
+   int i;
+
+   fp = fopen(name, "r");
+   if (fp == NULL)
+   {
+      printf("No statistics in %s: %s\n", name, strerror(errno));
+      return -1;
+   }
+
+   r->requests = 0;
+   r->failures = 0;
+   while (fgets(line, sizeof(line), fp) != NULL)
+   {
+      if ((line[0] == '#') || (strstr(line, "slave=\"") == NULL))
+         continue;
+      p = strrchr(line, ' ');
+
+      if (strncmp(line, "mbm_requests_total", 18) == 0)
+         r->requests += strtoull(p, NULL, 10);
+      else if ((strncmp(line, "mbm_timeouts_total", 18) == 0) ||
+               (strncmp(line, "mbm_exceptions_total", 20) == 0) ||
+               (strncmp(line, "mbm_crc_errors_total", 20) == 0) ||
+               (strncmp(line, "mbm_errors_total", 16) == 0))
+         r->failures += strtoull(p, NULL, 10);
+      else if ((strncmp(line, "mbm_response_seconds_bucket", 27) == 0) &&
+               ((p = strstr(line, "le=\"")) != NULL))
+      {
+         /* The histograms of all slaves have the same bounds and
+            are merged by adding their counts, +Inf comes last */
+         bound = (strncmp(p + 4, "+Inf", 4) == 0) ? 1e300 : atof(p + 4)*1e6;
+         for (i=0; (i<num) && (le[i] != bound); i++);
+         if ((i == num) && (num < MAX_BUCKETS))
+         {
+            le[num] = bound;
+            count[num++] = 0;
+         }
+         if (i < num)
+            count[i] += strtoull(strrchr(line, ' '), NULL, 10);
+      }
+   }
+   fclose(fp);
+
+   /* Quantiles of all requests from the merged histogram, not from
+      the quantiles of the single slaves */
+   r->p50 = quantile(le, count, num, 0.5);
+   r->p99 = quantile(le, count, num, 0.99);
+
+   return 0;
+}
+
+
+int run_bench(const bench_t *b, result_t *r)
+{
+   char mbm_path[256], mbs_path[256], conn[192], slaves[16], window_str[16];
+   char mbm_stats[128], mbs_stats[128], table[128], regs[128];
+   char *mbs_argv[] = { mbs_path, "-m", mbs_stats, conn, slaves, regs, NULL };
+   char *mbm_argv[] = { mbm_path, "-m", mbm_stats, "-o", "bin", "-w", window_str, "s", conn, table, NULL };
+   pid_t bus = -1, mbs, mbm;
+   int bus_fd = -1;
+   uint64_t start;
+
+   snprintf(mbm_path, sizeof(mbm_path), "%s/mbm", tool_dir);
+   snprintf(mbs_path, sizeof(mbs_path), "%s/mbs", tool_dir);
+   snprintf(mbm_stats, sizeof(mbm_stats), "%s/mbm.prom", work_dir);
+   snprintf(mbs_stats, sizeof(mbs_stats), "%s/mbs.prom", work_dir);
+   snprintf(table, sizeof(table), "%s/table", work_dir);
+   snprintf(regs, sizeof(regs), "%s/regs", work_dir);
+   snprintf(slaves, sizeof(slaves), "1-%d", b->num_slaves);
+   snprintf(window_str, sizeof(window_str), "%d", window);
+   unlink(mbm_stats);
+   unlink(mbs_stats);
+   if (write_files(b) != 0)
+   {
+      printf("Unable to write to %s: %s\n", work_dir, strerror(errno));
+      return -1;
+   }
+
+   /* Slave on port 0 of the bus, master on port 1 */
+   if (b->baudrate > 0)
+   {
+      bus = start_bus(b->baudrate, &bus_fd);
+      if (bus == -1)
+         return -1;
+      snprintf(conn, sizeof(conn), "%s/port0:%d", work_dir, b->baudrate);
+   }
+   else
+      snprintf(conn, sizeof(conn), "tcp:127.0.0.1:%d", TCP_PORT);
+
+   mbs = spawn(mbs_argv, -1);
+   if (b->baudrate > 0)
+   {
+      usleep(START_TIME*1000);
+      snprintf(conn, sizeof(conn), "%s/port1:%d", work_dir, b->baudrate);
+   }
+   else if (wait_port(TCP_PORT) != 0)
+   {
+      stop_tool(mbs, SIGTERM, NULL);
+      return -1;
+   }
+
+   /* Statistics are written when the tools exit */
+   start = time_now();
+   mbm = spawn(mbm_argv, -1);
+   usleep(run_time*1000000);
+   stop_tool(mbm, SIGINT, &r->mbm_cpu);
+   r->time = (time_now() - start)/1e6;
+   stop_tool(mbs, SIGTERM, &r->mbs_cpu);
+
+   /* Line time of the bytes carried while mbm was running */
+   r->bus_busy = -1;
+   if (bus != -1)
+   {
+      int64_t bytes = stop_bus(bus, bus_fd);
+      mb_conn_t rtu;
+      mb_timing_t timing;
+
+      mb_init_rtu(&rtu, "", b->baudrate);
+      mb_rtu_timing(&rtu, &timing);
+      if (bytes >= 0)
+         r->bus_busy = 100.0 * bytes * timing.char_time / (r->time*1e6);
+   }
+
+   return read_stats(mbm_stats, r);
+}
+
+
+void print_header(void)
+{
+   if (csv)
+   {
+      printf("transport,baudrate,num_reg,num_slaves,mix,tx_s,failures,p50_ms,p99_ms,"
+             "wire_ms,model_tx_s,efficiency,mbm_cpu_us,mbs_cpu_us,bus_busy\n");
+      return;
+   }
+
+   printf("%-6s %6s %4s %6s %-5s %8s %6s %7s %7s %7s %8s %5s %7s %7s %5s\n",
+          "conn", "baud", "regs", "slaves", "mix", "tx/s", "failed", "p50", "p99",
+          "wire", "model", "eff", "mbm", "mbs", "bus");
+   printf("%-6s %6s %4s %6s %-5s %8s %6s %7s %7s %7s %8s %5s %7s %7s %5s\n",
+          "", "", "", "", "", "", "", "ms", "ms", "ms", "tx/s", "%", "us/tx", "us/tx", "%");
+}
+
+
+void print_result(const bench_t *b, const result_t *r)
+{
+   mb_conn_t conn;
+   mb_timing_t timing;
+   double wire = 0, model = 0;
+   double rate = r->requests / r->time;
+   uint64_t n = r->requests ? r->requests : 1;
+
+   /* Request 8 bytes, response 5 bytes and the registers */
+   if (b->baudrate > 0)
+   {
+      mb_init_rtu(&conn, "", b->baudrate);
+      mb_rtu_timing(&conn, &timing);
+      wire = (13 + 2*b->num_reg) * timing.char_time;
+      model = 1e6 / (wire + timing.t35);
+   }
+
+   if (csv)
+   {
+      printf("%s,%d,%d,%d,%s,%.1f,%llu,%.3f,%.3f,%.3f,%.1f,%.1f,%.1f,%.1f,%.1f\n",
+             b->baudrate ? "rtu" : "tcp", b->baudrate, b->num_reg, b->num_slaves, mix_name[b->mix],
+             rate, (unsigned long long)r->failures, r->p50/1000, r->p99/1000, wire/1000, model,
+             model ? 100*rate/model : 0, 1e6*r->mbm_cpu/n, 1e6*r->mbs_cpu/n, r->bus_busy);
+      fflush(stdout);
+      return;
+   }
+
+   printf("%-6s %6d %4d %6d %-5s %8.1f %6llu %7.3f %7.3f ", b->baudrate ? "rtu" : "tcp",
+          b->baudrate, b->num_reg, b->num_slaves, mix_name[b->mix], rate,
+          (unsigned long long)r->failures, r->p50/1000, r->p99/1000);
+   if (b->baudrate > 0)
+      printf("%7.3f %8.1f %5.1f ", wire/1000, model, 100*rate/model);
+   else
+      printf("%7s %8s %5s ", "-", "-", "-");
+   printf("%7.1f %7.1f ", 1e6*r->mbm_cpu/n, 1e6*r->mbs_cpu/n);
+   if (r->bus_busy >= 0)
+      printf("%5.1f\n", r->bus_busy);
+   else
+      printf("%5s\n", "-");
+   fflush(stdout);
+}
+
+
+int main(int argc, char* argv[])
+{
+   const char *baudrates = BAUDRATES;
+   const char *num_regs = NUM_REGS;
+   const char *num_slaves = NUM_SLAVES;
+   const char *mixes = MIXES;
+   int baudrate[MAX_LIST], num_reg[MAX_LIST], slaves[MAX_LIST], mix[MAX_LIST];
+   int nb, nr, ns, nm;
+   int ib, ir, is, im;
+   char tool_path[256];
+   char name[128];
+   char *p;
+   bench_t b;
+   result_t r;
+   int i, rc=0;
+
+
+   /**************************************************************
+    * Parse input parameters
+    **************************************************************/
+
+   /* The tools are looked for next to this one */
+   snprintf(tool_path, sizeof(tool_path), "%s", argv[0]);
+   if ((p = strrchr(tool_path, '/')) != NULL)
+   {
+      *p = '\0';
+      tool_dir = tool_path;
+   }
+
+   while ((i = getopt(argc, argv, "b:r:s:x:t:w:p:c")) != -1)
+   {
+      switch (i)
+      {
+         case 'b': baudrates = optarg; break;
+         case 'r': num_regs = optarg; break;
+         case 's': num_slaves = optarg; break;
+         case 'x': mixes = optarg; break;
+         case 't': run_time = atoi(optarg); break;
+         case 'w': window = atoi(optarg); break;
+         case 'p': tool_dir = optarg; break;
+         case 'c': csv = 1; break;
+         default:  argc = 0;
+      }
+   }
+
+   nb = parse_list(baudrates, baudrate, MAX_LIST, NULL);
+   nr = parse_list(num_regs, num_reg, MAX_LIST, NULL);
+   ns = parse_list(num_slaves, slaves, MAX_LIST, NULL);
+   nm = parse_list(mixes, mix, MAX_LIST, mix_name);
+
+   if ((argc == 0) || (optind < argc))
+   {
+      printf("Modbus throughput benchmark, ver %s (using libmodbus %s)\n", VERSION, LIBMODBUS_VERSION_STRING);
+      printf("usage: mbbench [-b <baudrate>|tcp[,...]] [-r <num_reg>[,...]] [-s <num_slaves>[,...]]\n");
+      printf("               [-x <mix>[,...]] [-t <seconds>] [-w <window>] [-p <tool_dir>] [-c]\n\n");
+      printf("   baudrate:   simulated serial bus, or tcp for the loopback, default %s\n", BAUDRATES);
+      printf("   num_reg:    registers per request, default %s\n", NUM_REGS);
+      printf("   num_slaves: slaves polled, default %s\n", NUM_SLAVES);
+      printf("   mix:        hold, input or mixed, default %s\n", MIXES);
+      printf("   seconds:    run time of every combination, default %d\n", RUN_TIME);
+      printf("   window:     Modbus TCP requests in flight, default 1\n");
+      printf("   tool_dir:   directory of mbm, mbs and mbsim, default the one of mbbench\n");
+      printf("   -c:         CSV output\n");
+      return 0;
+   }
+
+   if ((nb < 1) || (nr < 1) || (ns < 1) || (nm < 1) || (run_time < 1) ||
+       (window < 1) || (window > MBTCP_MAX_WINDOW))
+   {
+      printf("Invalid benchmark parameters\n");
+      return -1;
+   }
+   for (i=0; i<nr; i++)
+   {
+      if (num_reg[i] > MODBUS_MAX_READ_REGISTERS)
+      {
+         printf("Invalid number of registers %d (max %d)\n", num_reg[i], MODBUS_MAX_READ_REGISTERS);
+         return -1;
+      }
+   }
+   for (i=0; i<ns; i++)
+   {
+      if (slaves[i] > MAX_SLAVES)
+      {
+         printf("Invalid number of slaves %d (max %d)\n", slaves[i], MAX_SLAVES);
+         return -1;
+      }
+   }
+
+   snprintf(work_dir, sizeof(work_dir), "/tmp/mbbench.XXXXXX");
+   if (mkdtemp(work_dir) == NULL)
+   {
+      printf("Unable to create a work directory: %s\n", strerror(errno));
+      return -1;
+   }
+
+
+   /**************************************************************
+    * Run all combinations
+    **************************************************************/
+
+   signal(SIGPIPE, SIG_IGN);
+   print_header();
+   for (ib=0; ib<nb; ib++)
+      for (ir=0; ir<nr; ir++)
+         for (is=0; is<ns; is++)
+            for (im=0; im<nm; im++)
+            {
+               b.baudrate = baudrate[ib];
+               b.num_reg = num_reg[ir];
+               b.num_slaves = slaves[is];
+               b.mix = mix[im];
+               memset(&r, 0, sizeof(r));
+               if (run_bench(&b, &r) != 0)
+               {
+                  rc = -1;
+                  continue;
+               }
+               print_result(&b, &r);
+            }
+
+
+   /**************************************************************
+    * Clean up end exit
+    **************************************************************/
+
+   for (i=0; work_file[i] != NULL; i++)
+   {
+      snprintf(name, sizeof(name), "%s/%s", work_dir, work_file[i]);
+      unlink(name);
+   }
+   rmdir(work_dir);
+
+   return rc;
+}
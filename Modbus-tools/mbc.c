@@ -0,0 +1,221 @@
+/*****************************************************************
+ * Modbus master client of the mbm daemon
+ *
+ * Sends one read or write request to a running "mbm d" over its
+ * command socket and prints the result like the one-shot modes of
+ * mbm. The daemon keeps the connection open, so the call takes the
+ * time of the transaction on the bus plus a local socket round trip.
+ *
+ * Author: Ondrej Wisniewski
+ *
+ * Build with this command:
+ * gcc mbc.c -o mbc -lmodbus
+ *
+ * History:
+ * 14/10/2026: First release
+ *
+ *****************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <modbus/modbus.h>
+#include "mbd.h"
+
+
+#define VERSION       "0.1"
+
+/* Debug mode */
+#define DEBUG         0
+
+
+void usage(void)
+{
+   printf("Modbus master client, ver %s\n", VERSION);
+   printf("usage: mbc [-s <socket>] r|R <slave_addr> <start_addr> <num_reg>\n");
+   printf("       mbc [-s <socket>] w|W <slave_addr> <start_addr> <reg_val> [<reg_val> ...]\n\n");
+   printf("socket: command socket of the daemon started with \"mbm d\", default %s\n\n", MBD_SOCKET);
+   printf("mode:  r - Modbus function code 0x03 (read holding registers)\n");
+   printf("       R - Modbus function code 0x04 (read input registers)\n");
+   printf("       w - Modbus function code 0x06 (preset single register)\n");
+   printf("       W - Modbus function code 0x10 (preset multiple registers)\n");
+}
+
+
+int connect_daemon(const char *path)
+{
+   struct sockaddr_un addr;
+   int fd;
+
+   if (strlen(path) >= sizeof(addr.sun_path))
+   {
+      printf("Socket path too long: %s\n", path);
+      return -1;
+   }
+   memset(&addr, 0, sizeof(addr));
+   addr.sun_family = AF_UNIX;
+   strcpy(addr.sun_path, path);
+
+   fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+   if ((fd == -1) || (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0))
+   {
+      printf("Unable to connect to %s: %s\n", path, strerror(errno));
+      if (fd != -1)
+         close(fd);
+      return -1;
+   }
+
+   return fd;
+}
+
+
+int transact(int fd, const mbd_msg_t *req, int length, mbd_msg_t *rsp)
+{
+   int rc;
+
+   if (send(fd, req, length, MSG_NOSIGNAL) != length)
+   {
+      printf("Unable to send request: %s\n", strerror(errno));
+      return -1;
+   }
+
+   rc = recv(fd, rsp, sizeof(*rsp), 0);
+   if ((rc < (int)sizeof(mbd_hdr_t)) || (rsp->hdr.id != req->hdr.id))
+   {
+      printf("No response from the daemon: %s\n", (rc == -1) ? strerror(errno) : "connection closed");
+      return -1;
+   }
+
+   if (DEBUG)
+      printf("DBG: response of %d bytes, err %d\n", rc, rsp->hdr.err);
+
+   if ((rsp->hdr.err == 0) && (rc < MBD_MSG_SIZE(rsp->hdr.num_reg)) &&
+       ((req->hdr.fc == MODBUS_FC_READ_HOLDING_REGISTERS) ||
+        (req->hdr.fc == MODBUS_FC_READ_INPUT_REGISTERS)))
+   {
+      printf("Short response from the daemon\n");
+      return -1;
+   }
+
+   return 0;
+}
+
+
+int main(int argc, char* argv[])
+{
+   const char *path = MBD_SOCKET;
+   mbd_msg_t req, rsp;
+   int fd, length;
+   char mode;
+   int i, k;
+
+
+   /* Options come before the mode */
+   while ((i = getopt(argc, argv, "+s:")) != -1)
+   {
+      if (i == 's')
+         path = optarg;
+      else
+      {
+         usage();
+         return -1;
+      }
+   }
+
+   if (argc - optind < 4)
+   {
+      usage();
+      return 0;
+   }
+
+   /**************************************************************
+    * Parse input parameters
+    **************************************************************/
+
+   i = optind;
+   mode = argv[i++][0];
+   memset(&req.hdr, 0, sizeof(req.hdr));
+   req.hdr.id = (uint16_t)getpid();
+   req.hdr.slave_addr = atoi(argv[i++]);
+   req.hdr.start_addr = atoi(argv[i++]);
+   switch (mode)
+   {
+      case 'r':
+      case 'R':
+         req.hdr.fc = (mode == 'r') ? MODBUS_FC_READ_HOLDING_REGISTERS : MODBUS_FC_READ_INPUT_REGISTERS;
+         req.hdr.num_reg = atoi(argv[i++]);
+         if (req.hdr.num_reg > MODBUS_MAX_READ_REGISTERS) req.hdr.num_reg = MODBUS_MAX_READ_REGISTERS;
+         length = MBD_MSG_SIZE(0);
+      break;
+
+      case 'w':
+         req.hdr.fc = MODBUS_FC_WRITE_SINGLE_REGISTER;
+         req.hdr.num_reg = 1;
+         req.reg[0] = (uint16_t)strtol(argv[i++], NULL, 0);
+         length = MBD_MSG_SIZE(1);
+      break;
+
+      case 'W':
+         req.hdr.fc = MODBUS_FC_WRITE_MULTIPLE_REGISTERS;
+         for (k=0; (k<MODBUS_MAX_WRITE_REGISTERS) && (i<argc); k++, i++)
+            req.reg[k] = (uint16_t)strtol(argv[i], NULL, 0);
+         req.hdr.num_reg = k;
+         length = MBD_MSG_SIZE(k);
+      break;
+
+      default:
+         printf("Invalid mode: %c\n", mode);
+         return -1;
+   }
+
+
+   /**************************************************************
+    * Send the request to the daemon
+    **************************************************************/
+
+   fd = connect_daemon(path);
+   if (fd == -1)
+      return -1;
+   k = transact(fd, &req, length, &rsp);
+   close(fd);
+   if (k != 0)
+      return -1;
+
+   if (rsp.hdr.err != 0)
+   {
+      switch (mode)
+      {
+         case 'r':
+         case 'R':
+            printf("Unable to read %s registers: %s\n", (mode == 'r') ? "holding" : "input",
+                   modbus_strerror(rsp.hdr.err));
+         break;
+
+         case 'w':
+            printf("Unable to write single register: %s\n", modbus_strerror(rsp.hdr.err));
+         break;
+
+         default:
+            printf("Unable to write multiple registers: %s\n", modbus_strerror(rsp.hdr.err));
+      }
+      return -1;
+   }
+
+   /* Print the registers read or written */
+   if (mode == 'w')
+      printf("reg %d: 0x%04X (%d)\n", req.hdr.start_addr, req.reg[0], req.reg[0]);
+   else
+   {
+      for (k=0; k<req.hdr.num_reg; k++)
+      {
+         uint16_t val = (mode == 'W') ? req.reg[k] : rsp.reg[k];
+         printf("%d: reg %d: 0x%04X (%d)\n", k, req.hdr.start_addr+k, val, val);
+      }
+   }
+
+   return 0;
+}
@@ -0,0 +1,250 @@
+/*****************************************************************
+ * Register cache of the Modbus master daemon
+ *
+ * Keeps the registers read by the daemon for the TTL of their
+ * address, so repeated reads of slow-moving values, like the
+ * temperature and humidity of a sensor, are served from memory
+ * instead of the bus. A read is a hit only if all its registers
+ * are cached and not expired, otherwise the whole range is read
+ * from the bus and cached again.
+ *
+ * The TTLs come from a cache file, one rule per line, the first
+ * rule matching a register applies:
+ *
+ *   <slave_addr>|* <fc>|* <first_addr>[-<last_addr>] <ttl>[us|ms|s]
+ *
+ * The TTL is in ms unless a unit is given, registers without a rule
+ * or with TTL 0 are not cached. Writes invalidate the holding and
+ * the input registers of their range, many devices map both to the
+ * same values.
+ *
+ * Registers are kept in a static hash table with open addressing.
+ * A register is stored in one of MB_CACHE_PROBES slots after its
+ * hash slot, taking a free or expired one, or else the one which
+ * expires first.
+ *
+ * Author: Ondrej Wisniewski
+ *
+ * History:
+ * 14/10/2026: First release
+ *
+ *****************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <modbus/modbus.h>
+#include "mbpoll.h"
+#include "mbcache.h"
+
+
+/* Maximum line length of the cache file */
+#define MAX_LINE      256
+
+mb_cache_stats_t mb_cache_stats;
+
+static mb_cache_entry_t cache[MB_CACHE_SIZE];
+static mb_cache_rule_t rule[MB_CACHE_MAX_RULES];
+static int num_rules;
+
+
+int mb_cache_load(const char *filename)
+{
+   FILE *fp;
+   char line[MAX_LINE];
+   char slave[8], fc[8], range[32], ttl_str[32];
+   mb_cache_rule_t *r;
+   int line_num = 0;
+   int rc = 0;
+   char *p, *end;
+
+   fp = fopen(filename, "r");
+   if (fp == NULL)
+   {
+      printf("Unable to open cache file %s: %s\n", filename, strerror(errno));
+      return -1;
+   }
+
+   num_rules = 0;
+   while ((rc == 0) && (fgets(line, sizeof(line), fp) != NULL))
+   {
+      line_num++;
+
+      /* Strip comments */
+      if ((p = strchr(line, '#')) != NULL)
+         *p = '\0';
+      if (line[strspn(line, " \t\r\n")] == '\0')
+         continue;
+
+      if (num_rules == MB_CACHE_MAX_RULES)
+      {
+         printf("%s:%d: too many rules (max %d)\n", filename, line_num, MB_CACHE_MAX_RULES);
+         rc = -1;
+         break;
+      }
+
+      r = &rule[num_rules];
+      r->first_addr = -1;
+      if (sscanf(line, "%7s %7s %31s %31s", slave, fc, range, ttl_str) == 4)
+      {
+         r->slave_addr = (strcmp(slave, "*") == 0) ? -1 : atoi(slave);
+         r->fc = (strcmp(fc, "*") == 0) ? 0 : (int)strtol(fc, NULL, 0);
+         r->first_addr = r->last_addr = strtol(range, &end, 0);
+         if ((end > range) && (*end == '-'))
+         {
+            p = end + 1;
+            r->last_addr = strtol(p, &end, 0);
+            if (end == p)
+               end = range;
+         }
+         if ((end == range) || (*end != '\0'))
+            r->first_addr = -1;
+      }
+
+      if ((r->first_addr < 0) || (r->slave_addr < -1) || (r->slave_addr > POLL_MAX_SLAVE) ||
+          ((r->fc != 0) && (r->fc != MODBUS_FC_READ_HOLDING_REGISTERS) &&
+           (r->fc != MODBUS_FC_READ_INPUT_REGISTERS)) ||
+          (r->last_addr > 0xFFFF) || (r->first_addr > r->last_addr) ||
+          (poll_parse_period(ttl_str, 1000, &r->ttl) != 0))
+      {
+         printf("%s:%d: expected <slave>|* <fc>|* <first_addr>[-<last_addr>] <ttl_ms>\n",
+                filename, line_num);
+         rc = -1;
+         break;
+      }
+      num_rules++;
+   }
+
+   fclose(fp);
+   return rc;
+}
+
+
+uint64_t mb_cache_ttl(int slave_addr, int fc, int addr)
+{
+   const mb_cache_rule_t *r;
+   int i;
+
+   for (i=0, r=rule; i<num_rules; i++, r++)
+   {
+      if (((r->slave_addr == -1) || (r->slave_addr == slave_addr)) &&
+          ((r->fc == 0) || (r->fc == fc)) &&
+          (addr >= r->first_addr) && (addr <= r->last_addr))
+         return r->ttl;
+   }
+
+   return 0;
+}
+
+
+static inline uint32_t make_key(int slave_addr, int fc, int addr)
+{
+   /* Never 0, which marks a free slot */
+   return (1U << 31) | ((uint32_t)slave_addr << 17) |
+          ((fc == MODBUS_FC_READ_INPUT_REGISTERS) ? (1U << 16) : 0) | (uint32_t)addr;
+}
+
+
+static inline unsigned int home_slot(uint32_t key)
+{
+   /* Multiplicative hash, the high bits are mixed best */
+   return (key * 2654435761U) >> 16;
+}
+
+
+static mb_cache_entry_t* find(uint32_t key)
+{
+   unsigned int slot = home_slot(key);
+   int i;
+
+   /* No early stop at a free slot, entries are freed anywhere */
+   for (i=0; i<MB_CACHE_PROBES; i++, slot++)
+   {
+      if (cache[slot % MB_CACHE_SIZE].key == key)
+         return &cache[slot % MB_CACHE_SIZE];
+   }
+
+   return NULL;
+}
+
+
+int mb_cache_get(int slave_addr, int fc, int addr, int num, uint16_t *regs, uint64_t now)
+{
+   const mb_cache_entry_t *e;
+   int i;
+
+   if (num_rules == 0)
+      return -1;
+
+   for (i=0; i<num; i++)
+   {
+      e = find(make_key(slave_addr, fc, addr+i));
+      if ((e == NULL) || (e->expires <= now))
+         return -1;
+      regs[i] = e->value;
+   }
+
+   return 0;
+}
+
+
+void mb_cache_put(int slave_addr, int fc, int addr, int num, const uint16_t *regs, uint64_t now)
+{
+   mb_cache_entry_t *e, *victim;
+   unsigned int slot;
+   uint32_t key;
+   uint64_t ttl;
+   int i, k;
+
+   for (i=0; i<num; i++)
+   {
+      ttl = mb_cache_ttl(slave_addr, fc, addr+i);
+      if (ttl == 0)
+         continue;
+
+      key = make_key(slave_addr, fc, addr+i);
+      e = find(key);
+      if (e == NULL)
+      {
+         /* A free or expired slot, or the one expiring first */
+         slot = home_slot(key);
+         victim = &cache[slot % MB_CACHE_SIZE];
+         for (k=0; k<MB_CACHE_PROBES; k++, slot++)
+         {
+            e = &cache[slot % MB_CACHE_SIZE];
+            if ((e->key == 0) || (e->expires <= now))
+            {
+               victim = e;
+               break;
+            }
+            if (e->expires < victim->expires)
+               victim = e;
+         }
+         if ((victim->key != 0) && (victim->expires > now))
+            mb_cache_stats.evictions++;
+         e = victim;
+         e->key = key;
+      }
+      e->value = regs[i];
+      e->expires = now + ttl;
+   }
+}
+
+
+void mb_cache_invalidate(int slave_addr, int addr, int num)
+{
+   mb_cache_entry_t *e;
+   int i;
+
+   if (num_rules == 0)
+      return;
+
+   for (i=0; i<num; i++)
+   {
+      if ((e = find(make_key(slave_addr, MODBUS_FC_READ_HOLDING_REGISTERS, addr+i))) != NULL)
+         e->key = 0;
+      if ((e = find(make_key(slave_addr, MODBUS_FC_READ_INPUT_REGISTERS, addr+i))) != NULL)
+         e->key = 0;
+   }
+}
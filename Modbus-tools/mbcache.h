@@ -0,0 +1,59 @@
+/*****************************************************************
+ * Register cache of the Modbus master daemon
+ *
+ * Author: Ondrej Wisniewski
+ *
+ * History:
+ * 14/10/2026: First release
+ *
+ *****************************************************************/
+
+#ifndef MBCACHE_H
+#define MBCACHE_H
+
+#include <stdint.h>
+
+
+/* Cached registers, a power of two */
+#define MB_CACHE_SIZE     4096
+
+/* Slots searched for a register, see mbcache.c */
+#define MB_CACHE_PROBES   8
+
+/* TTL rules of a cache file */
+#define MB_CACHE_MAX_RULES  64
+
+/* Cached register */
+typedef struct {
+   uint32_t key;           /* slave, fc and address, 0 if free */
+   uint16_t value;
+   uint64_t expires;       /* monotonic clock in us */
+} mb_cache_entry_t;
+
+/* TTL of a register range */
+typedef struct {
+   int slave_addr;         /* -1 for all slaves */
+   int fc;                 /* 0x03 or 0x04, 0 for both */
+   int first_addr;
+   int last_addr;
+   uint64_t ttl;           /* us, 0 is not cached */
+} mb_cache_rule_t;
+
+/* Cache counters */
+typedef struct {
+   uint64_t hits;          /* reads served from the cache */
+   uint64_t misses;        /* reads sent to the bus */
+   uint64_t coalesced;     /* reads served by the bus read of another one */
+   uint64_t evictions;     /* registers dropped before they expired */
+} mb_cache_stats_t;
+
+extern mb_cache_stats_t mb_cache_stats;
+
+
+int mb_cache_load(const char *filename);
+uint64_t mb_cache_ttl(int slave_addr, int fc, int addr);
+int mb_cache_get(int slave_addr, int fc, int addr, int num, uint16_t *regs, uint64_t now);
+void mb_cache_put(int slave_addr, int fc, int addr, int num, const uint16_t *regs, uint64_t now);
+void mb_cache_invalidate(int slave_addr, int addr, int num);
+
+#endif
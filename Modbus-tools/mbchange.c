@@ -0,0 +1,170 @@
+/*****************************************************************
+ * Report by exception of the Modbus master polling scheduler
+ *
+ * A stage between the poll results and the output which passes a
+ * result on only if it differs from the last one reported for the
+ * job: a register changed by more than the deadband, the poll status
+ * changed (a slave failed or came back), or the heartbeat interval
+ * has passed since the last report, rounded to the nearest poll.
+ * Unchanged results are dropped, so the output carries the changes
+ * and a periodic sign of life.
+ *
+ * The deadband is in raw register counts and applies to each
+ * register, changes are taken modulo 2^16, so a signed value going
+ * from 0 to -1 is a change of 1. Jobs of a device profile are
+ * compared by their decoded values instead, the deadband is then in
+ * the units of the fields, e.g. 0.5 for half a degree, and a value
+ * which turns up or stops being a number is a change. Registers and
+ * values are compared with those last reported, so a slow drift is
+ * reported once it adds up to more than the deadband. A reported
+ * result always has all registers of the job.
+ *
+ * The unchanged case, which is the common one, costs one memcmp()
+ * of the job registers against the last report, done by glibc with
+ * word or vector compares. Registers are only looked at one by one
+ * if the block differs and a deadband is set, profile jobs are only
+ * decoded if the block differs.
+ *
+ * The filter runs in the output thread, the state of every job is
+ * kept in a static table indexed by the job id. The time of dropped
+ * results is passed to an idle function, e.g. mb_out_tick(), so a
+ * buffered output is not held back until the next change.
+ *
+ * Author: Ondrej Wisniewski
+ *
+ * History:
+ * 14/10/2026: First release
+ * 14/10/2026: Deadband of profile jobs on the decoded values
+ *
+ *****************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <modbus/modbus.h>
+#include "mbpoll.h"
+#include "mbchange.h"
+
+
+/* Last result reported for a job */
+typedef struct {
+   int valid;
+   int status;             /* 0 or errno of the failed poll */
+   uint64_t time;          /* wall clock time of the report in us */
+   uint16_t reg[MODBUS_MAX_READ_REGISTERS];
+   double value[MB_PROFILE_MAX_FIELDS];  /* decoded, of profile jobs */
+} report_t;
+
+static report_t last[POLL_MAX_JOBS];
+
+static poll_output_t next_output;
+static mb_change_idle_t idle_output;
+static double change_deadband;
+static uint64_t change_heartbeat;
+
+
+void mb_change_init(poll_output_t output, mb_change_idle_t idle, double deadband, uint64_t heartbeat)
+{
+   next_output = output;
+   idle_output = idle;
+   change_deadband = deadband;
+   change_heartbeat = heartbeat;
+   memset(last, 0, sizeof(last));
+}
+
+
+static int changed(const uint16_t *reg, const uint16_t *prev, int num)
+{
+   int i, diff;
+
+   if (memcmp(reg, prev, num*sizeof(uint16_t)) == 0)
+      return 0;
+   if (change_deadband == 0)
+      return 1;
+
+   for (i=0; i<num; i++)
+   {
+      diff = (int16_t)(uint16_t)(reg[i] - prev[i]);
+      if (abs(diff) > change_deadband)
+         return 1;
+   }
+
+   return 0;
+}
+
+
+static int values_changed(const mb_decoder_t *dec, const double *value, const double *prev)
+{
+   int i;
+
+   for (i=0; i<dec->num_steps; i++)
+   {
+      if (isnan(value[i]) || isnan(prev[i]))
+      {
+         if (isnan(value[i]) != isnan(prev[i]))
+            return 1;
+      }
+      else if (fabs(value[i] - prev[i]) > change_deadband)
+         return 1;
+   }
+
+   return 0;
+}
+
+
+void mb_change_job(const poll_job_t *job, int rc)
+{
+   report_t *r = &last[job->id];
+   int status = (rc == job->num_reg) ? 0 : errno;
+   double value[MB_PROFILE_MAX_FIELDS];
+   int decoded = 0;
+   int report;
+
+   if (!r->valid || (status != r->status))
+      report = 1;
+   else if ((change_heartbeat > 0) && (job->time + job->period/2 - r->time >= change_heartbeat))
+      report = 1;
+   else if (status != 0)
+      report = 0;
+   else if (job->decoder != NULL)
+   {
+      /* Fields are compared in their units, registers between the
+         fields don't count */
+      report = 0;
+      if (memcmp(job->tab_reg, r->reg, job->num_reg*sizeof(uint16_t)) != 0)
+      {
+         mb_decode(job->decoder, job->tab_reg, value);
+         decoded = 1;
+         report = values_changed(job->decoder, value, r->value);
+      }
+   }
+   else
+      report = changed(job->tab_reg, r->reg, job->num_reg);
+
+   if (!report)
+   {
+      if (idle_output != NULL)
+         idle_output(job->time);
+      return;
+   }
+
+   r->valid = 1;
+   r->status = status;
+   r->time = job->time;
+   if (status == 0)
+   {
+      memcpy(r->reg, job->tab_reg, job->num_reg*sizeof(uint16_t));
+      if (job->decoder != NULL)
+      {
+         if (!decoded)
+            mb_decode(job->decoder, job->tab_reg, value);
+         memcpy(r->value, value, job->decoder->num_steps*sizeof(double));
+      }
+   }
+
+   /* The output takes the error of a failed poll from errno */
+   errno = status;
+   next_output(job, rc);
+}
@@ -0,0 +1,26 @@
+/*****************************************************************
+ * Report by exception of the Modbus master polling scheduler
+ *
+ * Author: Ondrej Wisniewski
+ *
+ * History:
+ * 14/10/2026: First release
+ * 14/10/2026: Deadband of profile jobs on the decoded values
+ *
+ *****************************************************************/
+
+#ifndef MBCHANGE_H
+#define MBCHANGE_H
+
+#include <stdint.h>
+#include "mbpoll.h"
+
+
+/* Called with the poll time of results which are not reported */
+typedef void (*mb_change_idle_t)(uint64_t time);
+
+
+void mb_change_init(poll_output_t output, mb_change_idle_t idle, double deadband, uint64_t heartbeat);
+void mb_change_job(const poll_job_t *job, int rc);
+
+#endif
@@ -0,0 +1,562 @@
+/*****************************************************************
+ * Common functions of the Modbus tools
+ *
+ * Connection setup shared by all tools. A connection is given
+ * on the command line either as
+ *
+ *   [<device>:]<baudrate>
+ *
+ * which selects Modbus RTU on the serial device, by default the
+ * serial port of the tool, or as
+ *
+ *   tcp:<host>[:<port>]
+ *
+ * which selects Modbus TCP (default port 502). A slave listens
+ * on <host>, an empty host listens on all interfaces. The host is
+ * a name, an IPv4 address or an IPv6 address in brackets, e.g.
+ * tcp:[fe80::1%eth0]:502, since the port follows a colon.
+ *
+ * The RTU timing follows the baudrate and frame format instead of
+ * fixed delays: a character takes 1 start bit, the data bits, the
+ * parity bit if any and the stop bits. Up to 19200 baud the gap
+ * within a frame is at most 1.5 and the silence between frames at
+ * least 3.5 characters, above 19200 baud they are fixed to 750 us
+ * and 1750 us. A gap longer than t1.5 ends a frame, the receiver
+ * waits MB_OS_LATENCY longer for its own scheduling. The RTS line is
+ * raised MB_RTS_DELAY before the first start bit and dropped as long
+ * after the last stop bit. mb_rtu_calibrate() searches the shortest
+ * delay at which a slave answers every request, from t3.5 down to
+ * MB_RTS_DELAY, for transceivers which need longer to turn around,
+ * and measures the response turnaround of the slave.
+ *
+ * Messages which can repeat at the rate of the bus, like receive
+ * errors in a noisy line, are logged through a mb_log_limit_t: at
+ * most MB_LOG_BURST of them per MB_LOG_INTERVAL, the rest is only
+ * counted and summed up in one message at the end of the interval,
+ * so an error storm costs a counter increment per error instead of
+ * a syslog() call. The summary is written by the next message or by
+ * mb_log_limit_flush(), which a server loop calls when it wakes up.
+ *
+ * The thread doing the bus I/O can run under SCHED_FIFO, pinned to a
+ * CPU, so a reply or poll is not delayed by other work of the host.
+ * mb_rt_lock() locks all memory of the process, present and future,
+ * and keeps malloc() from giving memory back, so the buffers and
+ * register maps allocated before never fault again. mb_rt_thread()
+ * sets up the calling thread only and faults in MB_RT_STACK bytes of
+ * its stack, which is the part the I/O path grows into.
+ *
+ * Author: Ondrej Wisniewski
+ *
+ * History:
+ * 14/10/2026: First release
+ * 14/10/2026: Serial device given at runtime
+ * 14/10/2026: RTU timing profile from baudrate and frame format
+ * 14/10/2026: Rate limited logging
+ * 14/10/2026: Real-time scheduling and memory locking of the I/O thread
+ * 14/10/2026: RTS delay calibrated downwards, frame end after t1.5
+ * 14/10/2026: IPv6 addresses in brackets
+ *
+ *****************************************************************/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sched.h>
+#include <malloc.h>
+#include <sys/mman.h>
+#include "mbcommon.h"
+
+
+/* Log to syslog instead of stdout */
+static int use_syslog = 0;
+
+
+void mb_log_syslog(int enable)
+{
+   use_syslog = enable;
+}
+
+
+void mb_log(int priority, const char *format, ...)
+{
+   va_list ap;
+
+   va_start(ap, format);
+   if (use_syslog)
+      vsyslog(LOG_DAEMON | priority, format, ap);
+   else
+      vprintf(format, ap);
+   va_end(ap);
+}
+
+
+static uint64_t now_us(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
+
+
+void mb_log_limited(mb_log_limit_t *limit, int priority, const char *format, ...)
+{
+   va_list ap;
+
+   mb_log_limit_flush(limit);
+   if (limit->logged == MB_LOG_BURST)
+   {
+      limit->suppressed++;
+      return;
+   }
+   if (limit->logged++ == 0)
+      limit->start = now_us();
+   limit->priority = priority;
+
+   va_start(ap, format);
+   if (use_syslog)
+      vsyslog(LOG_DAEMON | priority, format, ap);
+   else
+      vprintf(format, ap);
+   va_end(ap);
+}
+
+
+void mb_log_limit_flush(mb_log_limit_t *limit)
+{
+   uint64_t now;
+
+   /* Nothing logged in the current interval, no clock read */
+   if (limit->logged == 0)
+      return;
+
+   now = now_us();
+   if (now - limit->start < MB_LOG_INTERVAL)
+      return;
+
+   if (limit->suppressed > 0)
+      mb_log(limit->priority, "%d more %s in the last %d s\n", limit->suppressed, limit->what,
+             (int)((now - limit->start + 500000) / 1000000));
+   limit->logged = 0;
+   limit->suppressed = 0;
+}
+
+
+void mb_init_rtu(mb_conn_t *conn, const char *device, int baudrate)
+{
+   memset(conn, 0, sizeof(*conn));
+   conn->transport = MB_TRANSPORT_RTU;
+   snprintf(conn->device, sizeof(conn->device), "%s", device);
+   conn->baudrate  = baudrate;
+   conn->parity    = 'N';
+   conn->data_bit  = 8;
+   conn->stop_bit  = 1;
+}
+
+
+uint16_t mb_crc16(const uint8_t *buf, int length)
+{
+   uint16_t crc = 0xFFFF;
+   int i;
+
+   while (length--)
+   {
+      crc ^= *buf++;
+      for (i=0; i<8; i++)
+         crc = (crc & 1) ? (crc >> 1) ^ 0xA001 : (crc >> 1);
+   }
+
+   /* Transmitted low byte first */
+   return crc;
+}
+
+
+int mb_parse_conn(const char *str, const char *device, mb_conn_t *conn)
+{
+   memset(conn, 0, sizeof(*conn));
+
+   if (strncmp(str, "tcp:", 4) == 0)
+   {
+      const char *host = str+4;
+      const char *port;
+      int len;
+
+      /* An IPv6 address is in brackets, the port follows them */
+      if (*host == '[')
+      {
+         port = strchr(++host, ']');
+         if (port == NULL)
+            return -1;
+         len = port++ - host;
+         if ((*port != ':') && (*port != '\0'))
+            return -1;
+         if (*port == '\0')
+            port = NULL;
+      }
+      else
+      {
+         port = strchr(host, ':');
+         len = port ? (int)(port - host) : (int)strlen(host);
+         if ((port != NULL) && (strchr(port+1, ':') != NULL))
+            return -1;
+      }
+
+      if (len >= (int)sizeof(conn->host))
+         return -1;
+
+      conn->transport = MB_TRANSPORT_TCP;
+      memcpy(conn->host, host, len);
+      conn->host[len] = '\0';
+      conn->port = port ? atoi(port+1) : MODBUS_TCP_DEFAULT_PORT;
+      if ((conn->port < 1) || (conn->port > 65535))
+         return -1;
+   }
+   else
+   {
+      const char *baudrate = strrchr(str, ':');
+
+      /* Device names contain no colon, baudrate follows the last one */
+      if (baudrate != NULL)
+      {
+         if ((baudrate == str) || (baudrate - str >= (int)sizeof(conn->device)))
+            return -1;
+         mb_init_rtu(conn, "", atoi(baudrate+1));
+         memcpy(conn->device, str, baudrate - str);
+         conn->device[baudrate - str] = '\0';
+      }
+      else if (device != NULL)
+         mb_init_rtu(conn, device, atoi(str));
+      else
+         return -1;
+      if (conn->baudrate <= 0)
+         return -1;
+   }
+
+   return 0;
+}
+
+
+void mb_rtu_timing(const mb_conn_t *conn, mb_timing_t *timing)
+{
+   int bits = 1 + conn->data_bit + ((conn->parity == 'N') ? 0 : 1) + conn->stop_bit;
+
+   memset(timing, 0, sizeof(*timing));
+   timing->char_time = (bits*1000000 + conn->baudrate - 1) / conn->baudrate;
+   if (conn->baudrate > MB_FIXED_TIMING_BAUDRATE)
+   {
+      timing->t15 = MB_FIXED_T15;
+      timing->t35 = MB_FIXED_T35;
+   }
+   else
+   {
+      timing->t15 = (3*timing->char_time + 1) / 2;
+      timing->t35 = (7*timing->char_time + 1) / 2;
+   }
+
+   timing->byte_timeout = timing->t15 + MB_OS_LATENCY;
+   timing->rts_delay = (conn->rts_delay > 0) ? conn->rts_delay : MB_RTS_DELAY;
+   timing->turnaround = conn->turnaround;
+}
+
+
+static int calibrate_step(modbus_t *mb, const mb_timing_t *timing, uint64_t *time)
+{
+   uint16_t reg;
+   uint64_t start;
+   int i, rc;
+
+   /* Any answer counts, the slave may have no register 0 */
+   *time = 0;
+   for (i=0; i<MB_CALIBRATE_TRIES; i++)
+   {
+      start = now_us();
+      rc = modbus_read_registers(mb, 0, 1, &reg);
+      if ((rc != 1) && ((errno <= MODBUS_ENOBASE) || (errno >= MODBUS_ENOBASE + MODBUS_EXCEPTION_MAX)))
+         return -1;
+      *time += now_us() - start;
+
+      /* Keep the bus silent between the frames */
+      usleep(timing->t35);
+   }
+   *time /= MB_CALIBRATE_TRIES;
+
+   return 0;
+}
+
+
+static int calibrate_delay(modbus_t *mb, const mb_conn_t *conn, int rts, int rts_delay,
+                           const mb_timing_t *timing, uint64_t *time)
+{
+   if (rts && (modbus_rtu_set_rts_delay(mb, rts_delay) == -1))
+   {
+      mb_log(LOG_ERR, "Setting RTS delay failed: %s\n", modbus_strerror(errno));
+      return -1;
+   }
+   modbus_flush(mb);
+   if (calibrate_step(mb, timing, time) == 0)
+      return 0;
+
+   if (conn->debug)
+      printf("RTS delay %dus failed: %s\n", rts_delay, modbus_strerror(errno));
+   return -1;
+}
+
+
+int mb_rtu_calibrate(modbus_t *mb, const mb_conn_t *conn, int slave_addr, mb_timing_t *timing)
+{
+   uint64_t time, hi_time;
+   int rts = (strstr(conn->device, "USB") == NULL);
+   int lo, hi, mid;
+
+   mb_rtu_timing(conn, timing);
+   modbus_set_slave(mb, slave_addr);
+   modbus_set_response_timeout(mb, 0, MB_CALIBRATE_TIMEOUT);
+
+   /* The slave must answer at the longest delay, a delay beyond t3.5
+      would overlap its response. USB adapters switch the direction
+      themselves, they are only timed */
+   hi = rts ? timing->t35 : timing->rts_delay;
+   if (calibrate_delay(mb, conn, rts, hi, timing, &hi_time) != 0)
+   {
+      mb_log(LOG_ERR, "Calibration failed, slave %d does not answer: %s\n", 
+             slave_addr, modbus_strerror(errno));
+      if (rts)
+         modbus_rtu_set_rts_delay(mb, timing->rts_delay);
+      modbus_set_response_timeout(mb, MB_RSP_TIMEOUT, 0);
+      return -1;
+   }
+
+   /* Then the shortest delay at which it answers every request, down
+      to MB_RTS_DELAY, within MB_RTS_DELAY */
+   if (rts)
+   {
+      lo = MB_RTS_DELAY;
+      if (calibrate_delay(mb, conn, rts, lo, timing, &time) == 0)
+      {
+         hi = lo;
+         hi_time = time;
+      }
+      while (hi - lo > MB_RTS_DELAY)
+      {
+         mid = (lo + hi) / 2;
+         if (calibrate_delay(mb, conn, rts, mid, timing, &time) == 0)
+         {
+            hi = mid;
+            hi_time = time;
+         }
+         else
+            lo = mid;
+      }
+      modbus_rtu_set_rts_delay(mb, hi);
+   }
+   timing->rts_delay = hi;
+
+   modbus_set_response_timeout(mb, MB_RSP_TIMEOUT, 0);
+
+   /* Request (8 bytes) and response (7 bytes) take part of the time */
+   timing->turnaround = (int)hi_time - 15*timing->char_time - (rts ? 2*timing->rts_delay : 0);
+   if (timing->turnaround < 0)
+      timing->turnaround = 0;
+
+   return 0;
+}
+
+
+static int setup_rtu(modbus_t *mb, const mb_conn_t *conn)
+{
+   mb_timing_t timing;
+
+   /* A gap of t1.5 ends the response frame */
+   mb_rtu_timing(conn, &timing);
+   modbus_set_byte_timeout(mb, 0, timing.byte_timeout);
+
+   if (strstr(conn->device, "USB") != NULL)
+      return 0;
+
+   /* Enable RS485 direction control via RTS line */
+   if (modbus_rtu_set_rts(mb, MODBUS_RTU_RTS_DOWN) == -1)
+   {
+      mb_log(LOG_ERR, "Setting RTS mode failed: %s\n", modbus_strerror(errno));
+      return -1;
+   }
+
+   /* Set RTS control delay (before and after transmission) */
+   if (modbus_rtu_set_rts_delay(mb, timing.rts_delay) == -1)
+   {
+      mb_log(LOG_ERR, "Setting RTS delay failed: %s\n", modbus_strerror(errno));
+      return -1;
+   }
+   if (conn->debug)
+      printf("RTS delay is %dus, character %dus, t1.5 %dus, t3.5 %dus\n", modbus_rtu_get_rts_delay(mb),
+             timing.char_time, timing.t15, timing.t35);
+
+   return 0;
+}
+
+
+static modbus_t* new_context(const mb_conn_t *conn, int slave_addr)
+{
+   char service[8];
+   modbus_t *mb;
+
+   /* Create Modbus context, the protocol independent TCP back end
+      takes IPv6 and host names as well */
+   snprintf(service, sizeof(service), "%d", conn->port);
+   if (conn->transport == MB_TRANSPORT_TCP)
+      mb = modbus_new_tcp_pi(conn->host[0] ? conn->host : NULL, service);
+   else
+      mb = modbus_new_rtu(conn->device, conn->baudrate, conn->parity,
+                          conn->data_bit, conn->stop_bit);
+   if (mb == NULL)
+   {
+      mb_log(LOG_ERR, "Unable to create the libmodbus context\n");
+      return NULL;
+   }
+
+   /* Set debug mode */
+   if (conn->debug)
+      modbus_set_debug(mb, TRUE);
+
+   /* Set slave address (unit identifier for TCP) */
+   modbus_set_slave(mb, slave_addr);
+
+   return mb;
+}
+
+
+modbus_t* mb_connect(const mb_conn_t *conn, int slave_addr)
+{
+   modbus_t *mb;
+
+   mb = new_context(conn, slave_addr);
+   if (mb == NULL)
+      return NULL;
+
+   /* Connect to serial port or server */
+   if (conn->debug)
+      printf("Connecting to slave addr %d\n", slave_addr);
+   if (modbus_connect(mb) == -1)
+   {
+      mb_log(LOG_ERR, "Connection failed: %s\n", modbus_strerror(errno));
+      modbus_free(mb);
+      return NULL;
+   }
+
+   /* Set Modbus timeouts */
+   modbus_set_response_timeout(mb, MB_RSP_TIMEOUT, 0);
+   modbus_set_byte_timeout(mb, 0, 0);     // not used
+
+   if ((conn->transport == MB_TRANSPORT_RTU) && (setup_rtu(mb, conn) != 0))
+   {
+      modbus_close(mb);
+      modbus_free(mb);
+      return NULL;
+   }
+
+   return mb;
+}
+
+
+modbus_t* mb_listen(const mb_conn_t *conn, int slave_addr, int *server_socket)
+{
+   modbus_t *mb;
+
+   *server_socket = -1;
+
+   /* The serial line needs the same setup as for a master */
+   if (conn->transport == MB_TRANSPORT_RTU)
+      return mb_connect(conn, slave_addr);
+
+   mb = new_context(conn, slave_addr);
+   if (mb == NULL)
+      return NULL;
+
+   *server_socket = modbus_tcp_pi_listen(mb, MB_TCP_BACKLOG);
+   if (*server_socket == -1)
+   {
+      mb_log(LOG_ERR, "Listening on port %d failed: %s\n", conn->port, modbus_strerror(errno));
+      modbus_free(mb);
+      return NULL;
+   }
+
+   /* Set Modbus timeouts */
+   modbus_set_response_timeout(mb, MB_RSP_TIMEOUT, 0);
+   modbus_set_byte_timeout(mb, 0, 0);     // not used
+
+   return mb;
+}
+
+
+int mb_rt_lock(void)
+{
+   /* Freed memory stays mapped and locked, large blocks come from
+      the locked heap instead of new mappings, and threads share it
+      instead of locking an arena of 64 MB each */
+   mallopt(M_TRIM_THRESHOLD, -1);
+   mallopt(M_MMAP_MAX, 0);
+   mallopt(M_ARENA_MAX, 1);
+
+   if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0)
+   {
+      mb_log(LOG_ERR, "Locking the memory failed: %s\n", strerror(errno));
+      return -1;
+   }
+
+   return 0;
+}
+
+
+static void prefault_stack(void)
+{
+   uint8_t stack[MB_RT_STACK];
+   volatile uint8_t *p = stack;
+   int i;
+
+   for (i=0; i<MB_RT_STACK; i+=sysconf(_SC_PAGESIZE))
+      p[i] = 0;
+}
+
+
+int mb_rt_thread(int priority, int cpu)
+{
+   struct sched_param param;
+   cpu_set_t set;
+
+   /* With pid 0 both apply to the calling thread only */
+   if (cpu >= CPU_SETSIZE)
+   {
+      mb_log(LOG_ERR, "Pinning to CPU %d failed: %s\n", cpu, strerror(EINVAL));
+      return -1;
+   }
+   if (cpu >= 0)
+   {
+      CPU_ZERO(&set);
+      CPU_SET(cpu, &set);
+      if (sched_setaffinity(0, sizeof(set), &set) != 0)
+      {
+         mb_log(LOG_ERR, "Pinning to CPU %d failed: %s\n", cpu, strerror(errno));
+         return -1;
+      }
+   }
+
+   if (priority > 0)
+   {
+      memset(&param, 0, sizeof(param));
+      param.sched_priority = priority;
+      if (sched_setscheduler(0, SCHED_FIFO, &param) != 0)
+      {
+         mb_log(LOG_ERR, "Setting SCHED_FIFO priority %d failed: %s\n", priority, strerror(errno));
+         return -1;
+      }
+      prefault_stack();
+   }
+
+   return 0;
+}
+
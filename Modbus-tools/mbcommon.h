@@ -0,0 +1,116 @@
+/*****************************************************************
+ * Common functions of the Modbus tools
+ *
+ * Author: Ondrej Wisniewski
+ *
+ * History:
+ * 14/10/2026: First release
+ * 14/10/2026: Serial device given at runtime
+ * 14/10/2026: Rate limited logging
+ * 14/10/2026: Real-time scheduling and memory locking of the I/O thread
+ * 14/10/2026: RTS delay calibrated downwards, frame end after t1.5
+ *
+ *****************************************************************/
+
+#ifndef MBCOMMON_H
+#define MBCOMMON_H
+
+#include <stdint.h>
+#include <syslog.h>
+#include <modbus/modbus.h>
+
+
+/* RTS control delay in us (before and after transmission), also
+   the least delay tried by the calibration */
+#define MB_RTS_DELAY     10
+
+/* Allowance in us for the scheduling of the receiving thread, added
+   to t1.5 for the gap which ends a frame */
+#define MB_OS_LATENCY    1000
+
+/* Above this baudrate the frame timing is fixed (us) */
+#define MB_FIXED_TIMING_BAUDRATE  19200
+#define MB_FIXED_T15     750
+#define MB_FIXED_T35     1750
+
+/* Transactions per calibration step and their response timeout in us */
+#define MB_CALIBRATE_TRIES    8
+#define MB_CALIBRATE_TIMEOUT  200000
+
+/* Response timeout in s */
+#define MB_RSP_TIMEOUT   2
+
+/* Pending connections queued by a TCP slave */
+#define MB_TCP_BACKLOG   32
+
+/* Rate limited messages, logged per interval (us) */
+#define MB_LOG_BURST     5
+#define MB_LOG_INTERVAL  10000000
+
+/* Stack of a real-time thread faulted in up front, and the range of
+   its SCHED_FIFO priority */
+#define MB_RT_STACK          (256*1024)
+#define MB_RT_MAX_PRIORITY   99
+
+/* Transport types */
+#define MB_TRANSPORT_RTU 0
+#define MB_TRANSPORT_TCP 1
+
+/* Connection settings */
+typedef struct {
+   int transport;
+   int debug;
+   /* RTU serial line */
+   char device[64];
+   int baudrate;
+   char parity;
+   int data_bit;
+   int stop_bit;
+   int rts_delay;          /* us, 0 takes it from the timing profile */
+   int turnaround;         /* us, slave response delay, 0 if unknown */
+   /* TCP */
+   char host[64];
+   int port;
+} mb_conn_t;
+
+/* RTU timing profile of a serial line, all times in us */
+typedef struct {
+   int char_time;          /* one character incl. start, parity and stop bits */
+   int t15;                /* longest gap between the characters of a frame */
+   int t35;                /* shortest silence between two frames */
+   int rts_delay;          /* RTS turnaround before and after transmission */
+   int turnaround;         /* slave response delay, measured by calibration */
+   int byte_timeout;       /* gap after which a frame has ended, t1.5 plus
+                              MB_OS_LATENCY */
+} mb_timing_t;
+
+/* Rate limit of a recurring message, see mb_log_limited() */
+typedef struct {
+   const char *what;       /* in the summary, e.g. "receive failures" */
+   int priority;           /* of the last message */
+   int logged;             /* in the current interval */
+   int suppressed;
+   uint64_t start;         /* of the interval, monotonic time in us */
+} mb_log_limit_t;
+
+
+void mb_log_syslog(int enable);
+void mb_log(int priority, const char *format, ...)
+     __attribute__((format(printf, 2, 3)));
+void mb_log_limited(mb_log_limit_t *limit, int priority, const char *format, ...)
+     __attribute__((format(printf, 3, 4)));
+void mb_log_limit_flush(mb_log_limit_t *limit);
+
+uint16_t mb_crc16(const uint8_t *buf, int length);
+
+void mb_init_rtu(mb_conn_t *conn, const char *device, int baudrate);
+int mb_parse_conn(const char *str, const char *device, mb_conn_t *conn);
+void mb_rtu_timing(const mb_conn_t *conn, mb_timing_t *timing);
+int mb_rtu_calibrate(modbus_t *mb, const mb_conn_t *conn, int slave_addr, mb_timing_t *timing);
+modbus_t* mb_connect(const mb_conn_t *conn, int slave_addr);
+modbus_t* mb_listen(const mb_conn_t *conn, int slave_addr, int *server_socket);
+
+int mb_rt_lock(void);
+int mb_rt_thread(int priority, int cpu);
+
+#endif
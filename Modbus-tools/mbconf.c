@@ -0,0 +1,496 @@
+/*****************************************************************
+ * Batch configuration tool
+ *
+ * This tool applies the slave address and baudrate changes of
+ * many devices listed in a manifest over one serial port, instead
+ * of one thconf or relconf run per device. The devices are
+ * handled grouped by baudrate, so the port is set up once per
+ * baudrate and not once per device. Every change is verified by
+ * reading from the device with its new settings; a failed device
+ * is reported and the tool goes on with the next one.
+ *
+ * Manifest format, one device per line:
+ *
+ *   # type   addr  baudrate  new_addr  new_baudrate
+ *     th     1     9600      12        19200
+ *     th     2     9600      13        19200
+ *     relay  255   9600      5         9600
+ *
+ * th     T/H sensor PKTH100B, see thconf. Baudrates 1200..19200.
+ *        The change is verified at the new address and baudrate,
+ *        after the changes at all old baudrates are done.
+ * relay  BQTEK relay card in "Settings Mode" at address 255, see
+ *        relconf. Only one card can be in this mode on the bus, so
+ *        a manifest has one relay line at most.
+ *        The configuration registers are read back right after
+ *        writing them.
+ *
+ * Every device must be the only one at its old and at its new
+ * address and baudrate, over all lines. A device can not take the
+ * old settings of another one, e.g. a swap or a chain of address
+ * changes, since both would answer the change of the other one;
+ * such manifests are rejected, the changes must be split into two
+ * runs through a free address.
+ *
+ * Author: Ondrej Wisniewski
+ *
+ * Build with this command:
+ * gcc mbconf.c mbcommon.c mbraw.c -o mbconf -lmodbus
+ *
+ * History:
+ * 14/10/2026 - initial release
+ * 14/10/2026 - raw frames and response checks with mbraw
+ * 14/10/2026 - reject address conflicts and more than one relay card
+ *
+ * Copyright 2026
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Telegea.  If not, see http://www.gnu.org/licenses/.
+ *
+ *****************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <modbus/modbus.h>
+#include "mbcommon.h"
+#include "mbraw.h"
+
+
+#define VERSION       "0.2"
+
+/* Debug mode */
+#define DEBUG         0
+
+#define SERIAL_PORT     "/dev/ttyAMA0"
+#define MAX_DEVICES     512
+#define MAX_LINE        256
+
+/* Time given to the devices to take over new settings in us */
+#define SETTLE_TIME     100000
+
+/* Device types */
+#define TYPE_TH         0
+#define TYPE_RELAY      1
+
+/* Relay card configuration registers, see relconf */
+#define RELAY_REG_ADDR  1
+#define RELAY_REG_BAUD  2
+
+/* Device states */
+#define STATE_PENDING   0     /* change not sent yet */
+#define STATE_CHANGED   1     /* change acknowledged, not verified yet */
+#define STATE_OK        2
+#define STATE_FAILED    3
+
+/* Manifest entry */
+typedef struct {
+    int line;
+    int type;
+    int addr;
+    int baudrate;
+    int new_addr;
+    int new_baudrate;
+    int state;
+    const char *error;
+} device_t;
+
+static device_t device[MAX_DEVICES];
+static int num_devices;
+
+
+int relay_baudrate_valid(int baudrate)
+{
+    return (baudrate == 2400) || (baudrate == 4800) || (baudrate == 9600) ||
+           (baudrate == 19200) || (baudrate == 38400);
+}
+
+
+int check_conflicts(const char *filename)
+{
+    device_t *a, *b;
+    int relay = -1;
+    int rc = 0;
+    int i, j;
+
+    for (i=0; i<num_devices; i++)
+    {
+        a = &device[i];
+        if (a->type == TYPE_RELAY)
+        {
+            if (relay != -1)
+            {
+                printf("%s:%d: only one relay card can be in settings mode, see line %d\n",
+                       filename, a->line, relay);
+                rc = -1;
+            }
+            else
+                relay = a->line;
+        }
+
+        for (j=0; j<i; j++)
+        {
+            b = &device[j];
+            if ((a->addr == b->addr) && (a->baudrate == b->baudrate))
+                printf("%s:%d: addr %d at %d baud is already used by line %d\n",
+                       filename, a->line, a->addr, a->baudrate, b->line);
+            else if ((a->new_addr == b->new_addr) && (a->new_baudrate == b->new_baudrate))
+                printf("%s:%d: new addr %d at %d baud is already used by line %d\n",
+                       filename, a->line, a->new_addr, a->new_baudrate, b->line);
+            else if (((a->new_addr == b->addr) && (a->new_baudrate == b->baudrate)) ||
+                     ((b->new_addr == a->addr) && (b->new_baudrate == a->baudrate)))
+                printf("%s:%d: address change conflicts with line %d, change through a free address in two runs\n",
+                       filename, a->line, b->line);
+            else
+                continue;
+            rc = -1;
+        }
+    }
+
+    return rc;
+}
+
+
+int load_manifest(const char *filename)
+{
+    FILE *fp;
+    char line[MAX_LINE];
+    char type[16];
+    device_t *dev;
+    int n = 0;
+    int rc = 0;
+
+    fp = fopen(filename, "r");
+    if (fp == NULL)
+    {
+        printf("Unable to open manifest %s: %s\n", filename, strerror(errno));
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), fp) != NULL)
+    {
+        n++;
+        if (line[strspn(line, " \t")] == '#')
+            continue;
+        if (sscanf(line, "%15s", type) != 1)
+            continue;
+
+        if (num_devices == MAX_DEVICES)
+        {
+            printf("%s:%d: too many devices (max %d)\n", filename, n, MAX_DEVICES);
+            rc = -1;
+            break;
+        }
+
+        dev = &device[num_devices];
+        memset(dev, 0, sizeof(*dev));
+        dev->line = n;
+        if (sscanf(line, "%15s %d %d %d %d", type, &dev->addr, &dev->baudrate,
+                   &dev->new_addr, &dev->new_baudrate) != 5)
+        {
+            printf("%s:%d: invalid line\n", filename, n);
+            rc = -1;
+            continue;
+        }
+
+        if (strcmp(type, "th") == 0)
+        {
+            dev->type = TYPE_TH;
+            if ((dev->addr < 1) || (dev->addr > 247) || (dev->new_addr < 1) || (dev->new_addr > 247) ||
+                !mb_raw_th_baudrate(dev->baudrate) || !mb_raw_th_baudrate(dev->new_baudrate))
+            {
+                printf("%s:%d: invalid T/H sensor settings\n", filename, n);
+                rc = -1;
+                continue;
+            }
+        }
+        else if (strcmp(type, "relay") == 0)
+        {
+            dev->type = TYPE_RELAY;
+            if ((dev->addr != MB_RAW_RELAY_ADDR) || (dev->new_addr < 1) || (dev->new_addr > 254) ||
+                !relay_baudrate_valid(dev->baudrate) || !relay_baudrate_valid(dev->new_baudrate))
+            {
+                printf("%s:%d: invalid relay card settings, cards are configured at address %d\n",
+                       filename, n, MB_RAW_RELAY_ADDR);
+                rc = -1;
+                continue;
+            }
+        }
+        else
+        {
+            printf("%s:%d: unknown device type %s\n", filename, n, type);
+            rc = -1;
+            continue;
+        }
+
+        num_devices++;
+    }
+
+    fclose(fp);
+    if (rc == 0)
+        rc = check_conflicts(filename);
+    return rc;
+}
+
+
+void fail(device_t *dev, const char *error)
+{
+    dev->state = STATE_FAILED;
+    dev->error = error;
+    printf("   line %d: addr %d: %s: %s\n", dev->line, dev->addr, error, modbus_strerror(errno));
+}
+
+
+void change_th(modbus_t *mb, device_t *dev)
+{
+    uint8_t req[MB_RAW_REQ_SIZE];
+    uint8_t rsp[MB_RAW_RSP_SIZE];
+    mb_frame_t frame;
+    int req_length;
+
+    req_length = mb_raw_th_settings(req, dev->addr, dev->new_addr, dev->new_baudrate);
+    if (mb_raw_transact(mb, req, req_length, rsp, &frame) != 0)
+    {
+        fail(dev, "change not acknowledged");
+        return;
+    }
+
+    dev->state = STATE_CHANGED;
+    printf("   line %d: addr %d: changed to addr %d at %d baud\n", dev->line, dev->addr,
+           dev->new_addr, dev->new_baudrate);
+}
+
+
+void verify_th(modbus_t *mb, device_t *dev)
+{
+    uint16_t reg;
+
+    /* Any answer at the new settings will do, exceptions included */
+    modbus_set_slave(mb, dev->new_addr);
+    if ((modbus_read_registers(mb, 0, 1, &reg) != 1) &&
+        ((errno <= MODBUS_ENOBASE) || (errno >= MODBUS_ENOBASE + MODBUS_EXCEPTION_MAX)))
+    {
+        fail(dev, "no answer at the new settings");
+        return;
+    }
+
+    dev->state = STATE_OK;
+    printf("   line %d: addr %d: verified\n", dev->line, dev->new_addr);
+}
+
+
+int relay_request(modbus_t *mb, int fc, int reg_addr, int reg_val)
+{
+    uint8_t req[MB_RAW_REQ_SIZE];
+    uint8_t rsp[MB_RAW_RSP_SIZE];
+    mb_frame_t frame;
+    int req_length;
+
+    if (fc == MODBUS_FC_READ_HOLDING_REGISTERS)
+        req_length = mb_raw_relay_read(req, reg_addr);
+    else
+        req_length = mb_raw_relay_write(req, reg_addr, reg_val);
+    if (mb_raw_transact(mb, req, req_length, rsp, &frame) != 0)
+        return -1;
+
+    /* Register value read, or written as echoed */
+    return (fc == MODBUS_FC_READ_HOLDING_REGISTERS) ? mb_frame_reg(&frame, 0) : mb_frame_u16(&frame, 4);
+}
+
+
+void change_relay(modbus_t *mb, device_t *dev)
+{
+    if ((relay_request(mb, MODBUS_FC_WRITE_SINGLE_REGISTER, RELAY_REG_ADDR, dev->new_addr) == -1) ||
+        ((dev->new_baudrate != dev->baudrate) &&
+         (relay_request(mb, MODBUS_FC_WRITE_SINGLE_REGISTER, RELAY_REG_BAUD, dev->new_baudrate) == -1)))
+    {
+        fail(dev, "change not acknowledged");
+        return;
+    }
+
+    /* Still in settings mode, read the registers back */
+    if ((relay_request(mb, MODBUS_FC_READ_HOLDING_REGISTERS, RELAY_REG_ADDR, 1) != dev->new_addr) ||
+        ((dev->new_baudrate != dev->baudrate) &&
+         (relay_request(mb, MODBUS_FC_READ_HOLDING_REGISTERS, RELAY_REG_BAUD, 1) != dev->new_baudrate)))
+    {
+        fail(dev, "read back differs");
+        return;
+    }
+
+    dev->state = STATE_OK;
+    printf("   line %d: relay card set to addr %d at %d baud, verified\n", dev->line,
+           dev->new_addr, dev->new_baudrate);
+}
+
+
+int has_work(int baudrate)
+{
+    int i;
+
+    for (i=0; i<num_devices; i++)
+    {
+        if (((device[i].state == STATE_PENDING) && (device[i].baudrate == baudrate)) ||
+            ((device[i].state == STATE_CHANGED) && (device[i].new_baudrate == baudrate)))
+            return 1;
+    }
+
+    return 0;
+}
+
+
+void run_baudrate(const char *device_name, int baudrate)
+{
+    modbus_t *mb;
+    mb_conn_t conn;
+    device_t *dev;
+    int settle = 1;
+    int i;
+
+    printf("At %d baud:\n", baudrate);
+
+    /* The slave address stays unset, so raw responses of any device are taken */
+    mb_init_rtu(&conn, device_name, baudrate);
+    conn.debug = DEBUG;
+    mb = mb_connect(&conn, MB_RAW_RELAY_ADDR);
+    if (mb == NULL)
+    {
+        for (i=0; i<num_devices; i++)
+        {
+            dev = &device[i];
+            if ((dev->state == STATE_PENDING) && (dev->baudrate == baudrate))
+                fail(dev, "serial port");
+            if ((dev->state == STATE_CHANGED) && (dev->new_baudrate == baudrate))
+                fail(dev, "serial port");
+        }
+        return;
+    }
+
+    /* Raw requests first, verification reads set the slave address */
+    for (i=0; i<num_devices; i++)
+    {
+        dev = &device[i];
+        if ((dev->state != STATE_PENDING) || (dev->baudrate != baudrate))
+            continue;
+        if (dev->type == TYPE_TH)
+            change_th(mb, dev);
+        else
+            change_relay(mb, dev);
+    }
+
+    for (i=0; i<num_devices; i++)
+    {
+        dev = &device[i];
+        if ((dev->state != STATE_CHANGED) || (dev->new_baudrate != baudrate))
+            continue;
+        if (settle)
+        {
+            usleep(SETTLE_TIME);
+            settle = 0;
+        }
+        verify_th(mb, dev);
+    }
+
+    modbus_close(mb);
+    modbus_free(mb);
+}
+
+
+int main(int argc, char* argv[])
+{
+    const char *device_name = SERIAL_PORT;
+    int baudrate[MAX_DEVICES*2];
+    int num_baudrates = 0;
+    int failed = 0;
+    int opt, i, k, pass;
+
+
+    /**************************************************************
+     * Parse input parameters
+     **************************************************************/
+
+    while ((opt = getopt(argc, argv, "d:")) != -1)
+    {
+        if (opt == 'd')
+            device_name = optarg;
+        else
+            argc = 0;
+    }
+
+    if (argc - optind < 1)
+    {
+        printf("Batch configuration tool, ver %s (using libmodbus %s)\n\n", VERSION, LIBMODBUS_VERSION_STRING);
+        printf("usage: mbconf [-d <device>] <manifest>\n");
+        printf("   device:   serial port, default %s\n", SERIAL_PORT);
+        printf("   manifest: one device per line:\n");
+        printf("             th|relay <addr> <baudrate> <new_addr> <new_baudrate>\n");
+        return 0;
+    }
+
+    if (load_manifest(argv[optind]) != 0)
+        return -1;
+
+
+    /**************************************************************
+     * Apply all changes, grouped by baudrate
+     **************************************************************/
+
+    /* Distinct baudrates in ascending order */
+    for (i=0; i<num_devices; i++)
+    {
+        int br[2] = { device[i].baudrate, device[i].new_baudrate };
+        int j;
+
+        for (j=0; j<2; j++)
+        {
+            for (k=0; (k<num_baudrates) && (baudrate[k] < br[j]); k++);
+            if ((k < num_baudrates) && (baudrate[k] == br[j]))
+                continue;
+            memmove(&baudrate[k+1], &baudrate[k], (num_baudrates-k)*sizeof(int));
+            baudrate[k] = br[j];
+            num_baudrates++;
+        }
+    }
+
+    /* The second pass verifies devices moved to a baudrate which had
+       already been handled */
+    for (pass=0; pass<2; pass++)
+    {
+        for (k=0; k<num_baudrates; k++)
+        {
+            if (has_work(baudrate[k]))
+                run_baudrate(device_name, baudrate[k]);
+        }
+    }
+
+
+    /**************************************************************
+     * Report
+     **************************************************************/
+
+    for (i=0; i<num_devices; i++)
+    {
+        if (device[i].state != STATE_OK)
+        {
+            if (failed++ == 0)
+                printf("\nFailed:\n");
+            printf("   line %d: %s addr %d at %d baud: %s\n", device[i].line,
+                   (device[i].type == TYPE_TH) ? "th" : "relay", device[i].addr,
+                   device[i].baudrate, device[i].error ? device[i].error : "not done");
+        }
+    }
+    printf("\n%d of %d device(s) configured\n", num_devices - failed, num_devices);
+
+    return failed ? -1 : 0;
+}
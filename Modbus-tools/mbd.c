@@ -0,0 +1,620 @@
+/*****************************************************************
+ * Modbus master daemon, command socket protocol and server
+ *
+ * Keeps the connection of mbm open and serves requests of local
+ * clients (see mbc) over a unix socket, so a read or write costs one
+ * round trip over the socket instead of a process start, connection
+ * setup and termios reconfiguration per call.
+ *
+ * The socket is of type SOCK_SEQPACKET, every request and response
+ * is one datagram of MBD_MSG_SIZE() bytes: the header and only the
+ * registers of a write request or read response, see mbd.h. A
+ * client may send further requests before the responses arrive,
+ * they are served in order and answered with the id of the request,
+ * queued writes (see below) may be answered after later requests.
+ *
+ * The bus is shared fairly: requests are taken round robin, one
+ * per client and round, so a client sending a burst of requests
+ * delays the others by one transaction at most.
+ *
+ * Reads go through the register cache (see mbcache.c) and only its
+ * misses go to the bus. The result of a bus read also answers the
+ * reads of other clients taken in the same round which lie within
+ * its range, unless a write to the slave comes before them, so
+ * concurrent misses cost one transaction. Writes invalidate the
+ * cached registers of their range.
+ *
+ * With a write latency set, writes are not sent at once but queued
+ * for at most that time. A later write to a queued register replaces
+ * its value, and the queue is flushed as frames of adjacent registers
+ * per slave, FC 0x10 for two or more registers, FC 0x06 for a single
+ * one, so a burst of single register writes, e.g. to the relays of
+ * a card, costs one frame. The writes of a slave then reach the bus
+ * in address order. Every queued request is answered with the result
+ * of the frames carrying its registers. A read of a queued register
+ * flushes the queue first, so a client always reads what it wrote.
+ *
+ * Author: Ondrej Wisniewski
+ *
+ * History:
+ * 14/10/2026: First release
+ * 14/10/2026: Read-through register cache
+ * 14/10/2026: Write queue merging writes to adjacent registers
+ *
+ *****************************************************************/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "mbcommon.h"
+#include "mbpoll.h"
+#include "mbstats.h"
+#include "mbcache.h"
+#include "mbd.h"
+
+
+/* Debug mode */
+#define DEBUG         0
+
+/* Longest wait for requests in ms, a stop request taken by another
+   thread of the process is seen then */
+#define IDLE_TIMEOUT  1000
+
+/* Request taken from a client in the current round */
+typedef struct {
+   int client;             /* index into client */
+   int length;
+   int done;               /* answered */
+   mbd_msg_t req;
+} pending_t;
+
+/* Register write waiting in the queue */
+typedef struct {
+   int slave_addr;
+   int addr;
+   uint16_t value;
+   int err;                /* result of the frame which carried it */
+} queued_reg_t;
+
+/* Write request waiting for the queue to be flushed */
+typedef struct {
+   int fd;                 /* client, -1 once it has gone */
+   mbd_hdr_t hdr;
+} waiter_t;
+
+static int client[MBD_MAX_CLIENTS];
+static int num_clients;
+static pending_t pending[MBD_MAX_CLIENTS];
+static int num_pending;
+static volatile int stopped;
+
+static queued_reg_t queue[MBD_MAX_QUEUED];
+static int num_queued;
+static waiter_t waiter[MBD_MAX_WAITERS];
+static int num_waiters;
+static uint64_t write_latency;     /* us, 0 sends writes at once */
+static uint64_t flush_time;        /* when the queue is due (monotonic clock) */
+static uint64_t writes_queued;
+static uint64_t frames_sent;
+
+/* Statistics slot of every slave address, taken when first used */
+static mb_stats_slave_t *stats[POLL_MAX_SLAVE+1];
+
+
+static int open_socket(const char *path)
+{
+   struct sockaddr_un addr;
+   int fd;
+
+   if (strlen(path) >= sizeof(addr.sun_path))
+   {
+      mb_log(LOG_ERR, "Socket path too long: %s\n", path);
+      return -1;
+   }
+   memset(&addr, 0, sizeof(addr));
+   addr.sun_family = AF_UNIX;
+   strcpy(addr.sun_path, path);
+
+   /* A socket left over by a daemon which was killed */
+   unlink(path);
+
+   fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+   if ((fd == -1) || (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) ||
+       (listen(fd, MBD_MAX_CLIENTS) != 0))
+   {
+      mb_log(LOG_ERR, "Unable to open command socket %s: %s\n", path, strerror(errno));
+      if (fd != -1)
+         close(fd);
+      return -1;
+   }
+
+   return fd;
+}
+
+
+static void accept_client(int server)
+{
+   int fd;
+
+   fd = accept4(server, NULL, NULL, SOCK_CLOEXEC);
+   if (fd == -1)
+      return;
+
+   if (num_clients == MBD_MAX_CLIENTS)
+   {
+      mb_log(LOG_WARNING, "Too many clients, connection refused\n");
+      close(fd);
+      return;
+   }
+   client[num_clients++] = fd;
+
+   if (DEBUG)
+      printf("DBG: client %d connected\n", fd);
+}
+
+
+static int check_request(const mbd_msg_t *req, int length)
+{
+   if (length < (int)sizeof(mbd_hdr_t))
+      return -1;
+
+   switch (req->hdr.fc)
+   {
+      case MODBUS_FC_READ_HOLDING_REGISTERS:
+      case MODBUS_FC_READ_INPUT_REGISTERS:
+         if ((req->hdr.num_reg < 1) || (req->hdr.num_reg > MODBUS_MAX_READ_REGISTERS))
+            return -1;
+         return (length == MBD_MSG_SIZE(0)) ? 0 : -1;
+
+      case MODBUS_FC_WRITE_SINGLE_REGISTER:
+         return ((req->hdr.num_reg == 1) && (length == MBD_MSG_SIZE(1))) ? 0 : -1;
+
+      case MODBUS_FC_WRITE_MULTIPLE_REGISTERS:
+         if ((req->hdr.num_reg < 1) || (req->hdr.num_reg > MODBUS_MAX_WRITE_REGISTERS))
+            return -1;
+         return (length == MBD_MSG_SIZE(req->hdr.num_reg)) ? 0 : -1;
+
+      default:
+         return -1;
+   }
+}
+
+
+static int transact(modbus_t *mb, const mbd_msg_t *req, mbd_msg_t *rsp)
+{
+   const mbd_hdr_t *hdr = &req->hdr;
+   mb_stats_slave_t *s;
+   uint64_t start;
+   int rc, err;
+
+   rsp->hdr = *hdr;
+   if (modbus_set_slave(mb, hdr->slave_addr) != 0)
+   {
+      rsp->hdr.err = errno;
+      return MBD_MSG_SIZE(0);
+   }
+
+   start = poll_time_now();
+   switch (hdr->fc)
+   {
+      case MODBUS_FC_READ_HOLDING_REGISTERS:
+         rc = modbus_read_registers(mb, hdr->start_addr, hdr->num_reg, rsp->reg);
+      break;
+
+      case MODBUS_FC_READ_INPUT_REGISTERS:
+         rc = modbus_read_input_registers(mb, hdr->start_addr, hdr->num_reg, rsp->reg);
+      break;
+
+      case MODBUS_FC_WRITE_SINGLE_REGISTER:
+         rc = modbus_write_register(mb, hdr->start_addr, req->reg[0]);
+      break;
+
+      default:
+         rc = modbus_write_registers(mb, hdr->start_addr, hdr->num_reg, req->reg);
+   }
+   err = (rc == hdr->num_reg) ? 0 : ((rc == -1) ? errno : EMBBADDATA);
+
+   s = stats[hdr->slave_addr];
+   if (s == NULL)
+      s = stats[hdr->slave_addr] = mb_stats_slave(0, hdr->slave_addr);
+   mb_stats_record(s, poll_time_now() - start, err);
+
+   /* A Modbus TCP gateway may have closed the connection */
+   if ((err == EPIPE) || (err == ECONNRESET) || (err == EBADF) || (err == ENOTCONN))
+   {
+      modbus_close(mb);
+      if (modbus_connect(mb) != 0)
+         mb_log(LOG_ERR, "Reconnection failed: %s\n", modbus_strerror(errno));
+   }
+
+   rsp->hdr.err = err;
+   if ((err == 0) && ((hdr->fc == MODBUS_FC_READ_HOLDING_REGISTERS) ||
+                      (hdr->fc == MODBUS_FC_READ_INPUT_REGISTERS)))
+      return MBD_MSG_SIZE(hdr->num_reg);
+
+   return MBD_MSG_SIZE(0);
+}
+
+
+static void close_client(int c)
+{
+   int i;
+
+   if (DEBUG)
+      printf("DBG: client %d disconnected\n", client[c]);
+
+   /* Queued writes of the client are still sent, unanswered */
+   for (i=0; i<num_waiters; i++)
+   {
+      if (waiter[i].fd == client[c])
+         waiter[i].fd = -1;
+   }
+   close(client[c]);
+   client[c] = -1;
+}
+
+
+static int take_request(int c)
+{
+   pending_t *p = &pending[num_pending];
+   int length;
+
+   length = recv(client[c], &p->req, sizeof(p->req), MSG_DONTWAIT);
+   if (length == -1)
+      return ((errno == EAGAIN) || (errno == EINTR)) ? 0 : -1;
+   if (length == 0)
+      return -1;
+
+   p->client = c;
+   p->length = length;
+   p->done = 0;
+   num_pending++;
+
+   return 0;
+}
+
+
+static void reply(pending_t *p, const mbd_msg_t *rsp, int length)
+{
+   if (DEBUG)
+      printf("DBG: client %d: fc %d slave %d addr %d num %d: %s\n", client[p->client], 
+             p->req.hdr.fc, p->req.hdr.slave_addr, p->req.hdr.start_addr, p->req.hdr.num_reg,
+             rsp->hdr.err ? modbus_strerror(rsp->hdr.err) : "ok");
+
+   /* A client which does not read its responses is dropped */
+   if (send(client[p->client], rsp, length, MSG_DONTWAIT | MSG_NOSIGNAL) != length)
+      close_client(p->client);
+   p->done = 1;
+}
+
+
+static int compare_queued(const void *a, const void *b)
+{
+   const queued_reg_t *x = a, *y = b;
+
+   if (x->slave_addr != y->slave_addr)
+      return x->slave_addr - y->slave_addr;
+   return x->addr - y->addr;
+}
+
+
+static queued_reg_t* find_queued(int slave_addr, int addr)
+{
+   int i;
+
+   for (i=0; i<num_queued; i++)
+   {
+      if ((queue[i].slave_addr == slave_addr) && (queue[i].addr == addr))
+         return &queue[i];
+   }
+
+   return NULL;
+}
+
+
+static void flush_writes(modbus_t *mb)
+{
+   mbd_msg_t req, rsp;
+   queued_reg_t *q;
+   int i, k, n, c;
+
+   /* Runs of adjacent registers of a slave, one frame each */
+   qsort(queue, num_queued, sizeof(queue[0]), compare_queued);
+   for (i=0; i<num_queued; i+=n)
+   {
+      for (n=1; (i+n < num_queued) && (n < MODBUS_MAX_WRITE_REGISTERS) &&
+                (queue[i+n].slave_addr == queue[i].slave_addr) &&
+                (queue[i+n].addr == queue[i].addr + n); n++);
+
+      memset(&req.hdr, 0, sizeof(req.hdr));
+      req.hdr.fc = (n == 1) ? MODBUS_FC_WRITE_SINGLE_REGISTER : MODBUS_FC_WRITE_MULTIPLE_REGISTERS;
+      req.hdr.slave_addr = queue[i].slave_addr;
+      req.hdr.start_addr = queue[i].addr;
+      req.hdr.num_reg = n;
+      for (k=0; k<n; k++)
+         req.reg[k] = queue[i+k].value;
+
+      transact(mb, &req, &rsp);
+      mb_cache_invalidate(req.hdr.slave_addr, req.hdr.start_addr, n);
+      for (k=0; k<n; k++)
+         queue[i+k].err = rsp.hdr.err;
+      frames_sent++;
+
+      if (DEBUG)
+         printf("DBG: flushed slave %d addr %d num %d: %s\n", req.hdr.slave_addr,
+                req.hdr.start_addr, n, rsp.hdr.err ? modbus_strerror(rsp.hdr.err) : "ok");
+   }
+
+   /* Every request gets the first failure of its registers */
+   for (i=0; i<num_waiters; i++)
+   {
+      if (waiter[i].fd == -1)
+         continue;
+      rsp.hdr = waiter[i].hdr;
+      rsp.hdr.err = 0;
+      for (k=0; (k<rsp.hdr.num_reg) && (rsp.hdr.err == 0); k++)
+      {
+         q = find_queued(rsp.hdr.slave_addr, rsp.hdr.start_addr+k);
+         rsp.hdr.err = (q != NULL) ? q->err : EINVAL;
+      }
+      if (send(waiter[i].fd, &rsp, MBD_MSG_SIZE(0), MSG_DONTWAIT | MSG_NOSIGNAL) != MBD_MSG_SIZE(0))
+      {
+         for (c=0; (c<num_clients) && (client[c] != waiter[i].fd); c++);
+         if (c < num_clients)
+            close_client(c);
+      }
+   }
+
+   num_queued = 0;
+   num_waiters = 0;
+}
+
+
+static void queue_write(modbus_t *mb, pending_t *p)
+{
+   const mbd_hdr_t *hdr = &p->req.hdr;
+   queued_reg_t *q;
+   int i;
+
+   if ((num_waiters == MBD_MAX_WAITERS) || (num_queued + hdr->num_reg > MBD_MAX_QUEUED))
+      flush_writes(mb);
+   if (num_waiters == 0)
+      flush_time = poll_time_now() + write_latency;
+
+   /* The latest value of a register is sent */
+   for (i=0; i<hdr->num_reg; i++)
+   {
+      q = find_queued(hdr->slave_addr, hdr->start_addr+i);
+      if (q == NULL)
+      {
+         q = &queue[num_queued++];
+         q->slave_addr = hdr->slave_addr;
+         q->addr = hdr->start_addr+i;
+      }
+      q->value = p->req.reg[i];
+   }
+
+   waiter[num_waiters].fd = client[p->client];
+   waiter[num_waiters].hdr = *hdr;
+   num_waiters++;
+   writes_queued++;
+   p->done = 1;
+}
+
+
+static int is_queued(int slave_addr, int addr, int num)
+{
+   int i;
+
+   for (i=0; i<num_queued; i++)
+   {
+      if ((queue[i].slave_addr == slave_addr) && (queue[i].addr >= addr) &&
+          (queue[i].addr < addr + num))
+         return 1;
+   }
+
+   return 0;
+}
+
+
+static int is_read(int fc)
+{
+   return (fc == MODBUS_FC_READ_HOLDING_REGISTERS) || (fc == MODBUS_FC_READ_INPUT_REGISTERS);
+}
+
+
+static void serve_request(modbus_t *mb, int n)
+{
+   pending_t *p = &pending[n];
+   const mbd_hdr_t *hdr = &p->req.hdr;
+   const mbd_hdr_t *other;
+   mbd_msg_t rsp, shared;
+   uint64_t now;
+   int length;
+
+   if (check_request(&p->req, p->length) != 0)
+   {
+      memset(&rsp.hdr, 0, sizeof(rsp.hdr));
+      if (p->length >= (int)sizeof(mbd_hdr_t))
+         rsp.hdr = *hdr;
+      rsp.hdr.err = EINVAL;
+      reply(p, &rsp, MBD_MSG_SIZE(0));
+      return;
+   }
+
+   if (!is_read(hdr->fc) && (write_latency > 0))
+   {
+      queue_write(mb, p);
+      return;
+   }
+
+   if (!is_read(hdr->fc))
+   {
+      /* Whatever the outcome, the registers may have changed */
+      length = transact(mb, &p->req, &rsp);
+      mb_cache_invalidate(hdr->slave_addr, hdr->start_addr, hdr->num_reg);
+      reply(p, &rsp, length);
+      return;
+   }
+
+   /* Reads of registers still in the write queue see their value */
+   if ((num_queued > 0) && is_queued(hdr->slave_addr, hdr->start_addr, hdr->num_reg))
+      flush_writes(mb);
+
+   rsp.hdr = *hdr;
+   rsp.hdr.err = 0;
+   if (mb_cache_get(hdr->slave_addr, hdr->fc, hdr->start_addr, hdr->num_reg, rsp.reg, 
+                    poll_time_now()) == 0)
+   {
+      mb_cache_stats.hits++;
+      reply(p, &rsp, MBD_MSG_SIZE(hdr->num_reg));
+      return;
+   }
+
+   mb_cache_stats.misses++;
+   length = transact(mb, &p->req, &rsp);
+   now = poll_time_now();
+   if (rsp.hdr.err == 0)
+      mb_cache_put(hdr->slave_addr, hdr->fc, hdr->start_addr, hdr->num_reg, rsp.reg, now);
+   reply(p, &rsp, length);
+
+   /* Later reads of this round within the range get the same result,
+      also a failure, up to a write to the slave */
+   for (n++; n<num_pending; n++)
+   {
+      other = &pending[n].req.hdr;
+      if (pending[n].done || (check_request(&pending[n].req, pending[n].length) != 0) ||
+          (other->slave_addr != hdr->slave_addr))
+         continue;
+      if (!is_read(other->fc))
+         break;
+      if ((other->fc != hdr->fc) || (other->start_addr < hdr->start_addr) ||
+          (other->start_addr + other->num_reg > hdr->start_addr + hdr->num_reg))
+         continue;
+
+      shared.hdr = *other;
+      shared.hdr.err = rsp.hdr.err;
+      memcpy(shared.reg, &rsp.reg[other->start_addr - hdr->start_addr], 
+             other->num_reg*sizeof(uint16_t));
+      reply(&pending[n], &shared, (shared.hdr.err == 0) ? MBD_MSG_SIZE(other->num_reg) : MBD_MSG_SIZE(0));
+      mb_cache_stats.coalesced++;
+   }
+}
+
+
+int mbd_run(modbus_t *mb, const char *path, uint64_t latency)
+{
+   struct pollfd pfd[MBD_MAX_CLIENTS+1];
+   struct timespec ts;
+   uint64_t now, wait;
+   int server;
+   int first = 0;
+   int i, k, n, rc=0;
+
+   server = open_socket(path);
+   if (server == -1)
+      return -1;
+
+   mb_log(LOG_INFO, "Serving requests on %s\n", path);
+   write_latency = latency;
+
+   while (!stopped)
+   {
+      pfd[0].fd = server;
+      pfd[0].events = POLLIN;
+      for (i=0; i<num_clients; i++)
+      {
+         pfd[i+1].fd = client[i];
+         pfd[i+1].events = POLLIN;
+      }
+
+      /* Wake up for the write queue when it is due */
+      wait = IDLE_TIMEOUT*1000ULL;
+      if (num_waiters > 0)
+      {
+         now = poll_time_now();
+         if (flush_time <= now)
+            wait = 0;
+         else if (flush_time - now < wait)
+            wait = flush_time - now;
+      }
+      ts.tv_sec = wait/1000000;
+      ts.tv_nsec = (wait%1000000)*1000;
+
+      n = ppoll(pfd, num_clients+1, &ts, NULL);
+      if (n == -1)
+      {
+         if (errno == EINTR)
+            continue;
+         mb_log(LOG_ERR, "ppoll() failed: %s\n", strerror(errno));
+         rc = -1;
+         break;
+      }
+
+      /* One request of every client with one pending, starting
+         with the client after the first one of the last round */
+      num_pending = 0;
+      for (k=0; k<num_clients; k++)
+      {
+         i = (first + k) % num_clients;
+         if (pfd[i+1].revents == 0)
+            continue;
+         if (((pfd[i+1].revents & POLLIN) == 0) || (take_request(i) != 0))
+            close_client(i);
+      }
+      if (num_clients > 0)
+         first = (first + 1) % num_clients;
+
+      /* In this order, reads of the same registers are coalesced */
+      for (i=0; i<num_pending; i++)
+      {
+         if (!pending[i].done)
+            serve_request(mb, i);
+      }
+      if ((num_waiters > 0) && (poll_time_now() >= flush_time))
+         flush_writes(mb);
+
+      /* Drop the closed clients, the order of the others is kept */
+      for (i=0, k=0; i<num_clients; i++)
+      {
+         if (client[i] != -1)
+            client[k++] = client[i];
+      }
+      num_clients = k;
+
+      if (pfd[0].revents & POLLIN)
+         accept_client(server);
+   }
+
+   if (num_waiters > 0)
+      flush_writes(mb);
+   if (writes_queued > 0)
+      mb_log(LOG_INFO, "Write queue: %llu writes in %llu frames\n",
+             (unsigned long long)writes_queued, (unsigned long long)frames_sent);
+   if (mb_cache_stats.hits + mb_cache_stats.coalesced > 0)
+      mb_log(LOG_INFO, "Cache: %llu hits, %llu misses, %llu coalesced, %llu evictions\n",
+             (unsigned long long)mb_cache_stats.hits, (unsigned long long)mb_cache_stats.misses,
+             (unsigned long long)mb_cache_stats.coalesced, (unsigned long long)mb_cache_stats.evictions);
+
+   for (i=0; i<num_clients; i++)
+      close(client[i]);
+   num_clients = 0;
+   close(server);
+   unlink(path);
+
+   return rc;
+}
+
+
+void mbd_stop(void)
+{
+   stopped = 1;
+}
@@ -0,0 +1,57 @@
+/*****************************************************************
+ * Modbus master daemon, command socket protocol and server
+ *
+ * Author: Ondrej Wisniewski
+ *
+ * History:
+ * 14/10/2026: First release
+ * 14/10/2026: Write queue
+ *
+ *****************************************************************/
+
+#ifndef MBD_H
+#define MBD_H
+
+#include <stdint.h>
+#include <modbus/modbus.h>
+#include "mbcommon.h"
+
+
+/* Default command socket */
+#define MBD_SOCKET        "/tmp/mbm.sock"
+
+/* Clients connected at the same time */
+#define MBD_MAX_CLIENTS   32
+
+/* Registers and requests waiting in the write queue */
+#define MBD_MAX_QUEUED    256
+#define MBD_MAX_WAITERS   64
+
+/* Registers of a message, reads and writes */
+#define MBD_MAX_REGS      MODBUS_MAX_READ_REGISTERS
+
+/* Message header, in host byte order over the local socket. A
+   request is answered with the same header, err set and for reads
+   followed by the registers */
+typedef struct {
+   uint16_t id;            /* chosen by the client, echoed in the response */
+   uint8_t fc;             /* 0x03, 0x04, 0x06 or 0x10 */
+   uint8_t slave_addr;
+   uint16_t start_addr;
+   uint16_t num_reg;
+   int32_t err;            /* response: 0 or errno value */
+} mbd_hdr_t;
+
+/* Request or response message, one datagram of the socket */
+typedef struct {
+   mbd_hdr_t hdr;
+   uint16_t reg[MBD_MAX_REGS];
+} mbd_msg_t;
+
+#define MBD_MSG_SIZE(num_reg)  ((int)(sizeof(mbd_hdr_t) + (num_reg)*sizeof(uint16_t)))
+
+
+int mbd_run(modbus_t *mb, const char *path, uint64_t latency);
+void mbd_stop(void);
+
+#endif
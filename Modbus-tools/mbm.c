@@ -4,11 +4,29 @@
  * Author: Ondrej Wisniewski
  * 
  * Build with this command:
- * gcc mbm.c -o mbm -lmodbus
+ * gcc mbm.c mbpoll.c mbtcp.c mbout.c mbqueue.c mbstats.c mbd.c mbcache.c mbchange.c mbprofile.c mbcommon.c -o mbm -lmodbus -lpthread
  * 
  * History:
  * 03/12/2015: First release
  * 13/04/2017: Add handling of Modbus function codes 0x03 and 0x06
+ * 14/10/2026: Add poll table scheduler mode
+ * 14/10/2026: Coalesce neighbouring poll jobs into one request
+ * 14/10/2026: Sub-second poll periods with absolute deadlines
+ * 14/10/2026: Add Modbus TCP transport
+ * 14/10/2026: Write up to 123 registers with mode W
+ * 14/10/2026: Buffered CSV, JSON and binary record output
+ * 14/10/2026: Record output to a memory mapped ring file
+ * 14/10/2026: Pipelined polling of Modbus TCP gateways in mode s
+ * 14/10/2026: Serial device given at runtime
+ * 14/10/2026: Poll several serial buses in parallel in mode s
+ * 14/10/2026: Calibrate the RTS turnaround against a slave
+ * 14/10/2026: Per-slave statistics, written on SIGUSR1
+ * 14/10/2026: Daemon mode serving clients on a command socket
+ * 14/10/2026: Register cache with per-register TTL in daemon mode
+ * 14/10/2026: Report by exception of polled values
+ * 14/10/2026: Write queue with a latency bound in daemon mode
+ * 14/10/2026: Real-time scheduling, CPU pinning and locked memory
+ * 14/10/2026: Decoded values of device profiles in mode s
  * 
  *****************************************************************/
 
@@ -17,46 +35,447 @@
 #include <string.h>
 #include <errno.h>
 #include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
 #include <modbus/modbus.h>
+#include "mbcommon.h"
+#include "mbpoll.h"
+#include "mbout.h"
+#include "mbqueue.h"
+#include "mbstats.h"
+#include "mbd.h"
+#include "mbcache.h"
+#include "mbchange.h"
 
 
-#define VERSION       "0.2"
+#define VERSION       "0.13"
 
 /* Debug mode */
 #define DEBUG         0
 
 /* Serial port settings */
 #define SERIAL_PORT   "/dev/ttyAMA0"
-#define BAUDRATE      9600
-#define RTS_DELAY     10
 
-/* Register map settings */
-#define MAX_REG       32
+/* Consumer sleep while the result queue is empty (us) */
+#define QUEUE_IDLE    1000
+
+/* Poll table used in scheduler mode */
+static poll_table_t poll_table;
+
+/* Polling worker, one per serial bus and one for all Modbus TCP gateways */
+typedef struct {
+   pthread_t thread;
+   int gateway;            /* serial bus index, -1 for the Modbus TCP gateways */
+   int rc;
+   int done;
+   poll_table_t table;     /* jobs of this worker */
+} worker_t;
+
+static worker_t *worker[POLL_MAX_GATEWAYS+1];
+static int num_workers;
+static volatile sig_atomic_t stop_requested;
+
+/* Real-time setup of the threads doing the bus I/O, 0 and -1 if none */
+static int rt_priority;
+static int rt_cpu=-1;
+
+
+void usage(void)
+{
+   printf("Modbus RTU/TCP master, ver %s (using libmodbus %s)\n", VERSION, LIBMODBUS_VERSION_STRING);
+   printf("usage: mbm [-c <calib_addr>] [-e <deadband>[:<heartbeat>]] [-m <stats_file>] [-o <format>] r|R <conn> <slave_addr> <start_addr> <num_reg> [<poll_period>[us|ms|s]]\n");
+   printf("       mbm [-c <calib_addr>] w|W <conn> <slave_addr> <start_addr> <reg_val> [<reg_val> ...]\n");
+   printf("       mbm [-c <calib_addr>] [-e <deadband>[:<heartbeat>]] [-m <stats_file>] [-o <format>] [-w <window>]\n");
+   printf("           s <conn> <poll_table>\n");
+   printf("       mbm [-b <latency>] [-c <calib_addr>] [-m <stats_file>] [-t <cache_file>] d <conn> [<socket>]\n");
+   printf("       all modes also take [-a <cpu>] [-r <rt_prio>]\n\n");
+   printf("conn:  [<device>:]<baudrate>   - Modbus RTU on <device> (default %s)\n", SERIAL_PORT);
+   printf("       tcp:<host>[:<port>]     - Modbus TCP, an IPv6 <host> in brackets\n\n");
+   printf("mode:  r - Modbus function code 0x03 (read holding registers)\n");
+   printf("       R - Modbus function code 0x04 (read input registers)\n");
+   printf("       w - Modbus function code 0x06 (preset single register)\n");
+   printf("       W - Modbus function code 0x10 (preset multiple registers)\n");
+   printf("       s - poll all jobs of a poll table file, one job per line:\n");
+   printf("           <slave_addr> <fc> <start_addr> <num_reg> <period_ms>[us|ms|s]\n");
+   printf("           coalesce <slave_addr>|* <max_gap> <max_num>\n");
+   printf("           gateway tcp:<host>[:<port>] [<window>]  - poll the following jobs there\n");
+   printf("           bus <device>:<baudrate>  - poll the following jobs on this serial bus\n");
+   printf("           device <slave_addr> <profile> <period_ms>  - poll the fields of a device\n");
+   printf("           profile, output as values; built in are pkth100b and sdm120, else a\n");
+   printf("           profile file, one field per line:\n");
+   printf("           <name> <fc> <addr> u16|s16|u32|s32|f32[:<order>] [<scale> [<offset>]] [<unit>]\n");
+   printf("           Every serial bus is polled by its own thread and all gateways by\n");
+   printf("           another one, the results are queued to a single output\n");
+   printf("       d - daemon, serve the read and write requests of mbc clients on\n");
+   printf("           <socket> (default %s) over the connection kept open\n\n", MBD_SOCKET);
+   printf("latency: queue the writes of mode d for up to <latency>[us|ms|s] (default ms),\n");
+   printf("         writes to adjacent registers of a slave are sent as one frame and\n");
+   printf("         repeated writes of a register as its latest value, default is\n");
+   printf("         to send every write at once\n\n");
+   printf("calib_addr: calibrate the RTS turnaround of the Modbus RTU connection against\n");
+   printf("            this slave first, default is the timing profile of the baudrate\n\n");
+   printf("deadband:  report polled registers by exception, a result is output only if a\n");
+   printf("           register changed by more than <deadband> counts since the last\n");
+   printf("           report of the job, the poll status changed, or <heartbeat>[us|ms|s]\n");
+   printf("           (default s, 0 is none) has passed, default is every result; device\n");
+   printf("           jobs compare their decoded values, <deadband> is in their units\n\n");
+   printf("stats_file: on SIGUSR1 and at exit write the request counts and round trip\n");
+   printf("            times of every slave in Prometheus text format there,\n");
+   printf("            default is stderr on SIGUSR1 only; single transactions\n");
+   printf("            write them at exit only\n\n");
+   printf("cache_file: cache the registers read in mode d, one TTL rule per line:\n");
+   printf("            <slave_addr>|* <fc>|* <first_addr>[-<last_addr>] <ttl_ms>[us|ms|s]\n");
+   printf("            the first matching rule applies, default is no caching\n\n");
+   printf("rt_prio: do the bus I/O under SCHED_FIFO with this priority (1-%d), with all\n", MB_RT_MAX_PRIORITY);
+   printf("         memory locked, in mode s in every poll worker but not the output\n");
+   printf("cpu:     do the bus I/O on this CPU only\n\n");
+   printf("window: Modbus TCP requests kept in flight in mode s (default 1, max %d)\n\n", MBTCP_MAX_WINDOW);
+   printf("format: text - one line per register (default)\n");
+   printf("        csv  - <time>,<bus>,<slave>,<fc>,<start_addr>,<num_reg>,<status>,<reg>...\n");
+   printf("        json - one object per line with time, bus, slave, fc, addr and regs\n");
+   printf("        bin  - fixed size records of %d bytes\n", (int)sizeof(mb_out_rec_t));
+   printf("        ring:<file>[:<num_recs>] - binary records in a ring file of fixed size,\n");
+   printf("             default %d records\n\n", MB_RING_RECS);
+}
+
+
+void print_regs(const poll_job_t *job, int rc)
+{
+   int i;
+   
+   if (rc != job->num_reg)
+   {
+      printf("Unable to read %s registers: %s\n", 
+             (job->fc == MODBUS_FC_READ_HOLDING_REGISTERS) ? "holding" : "input", 
+             modbus_strerror(errno));
+      return;
+   }
+   
+   /* Print received register values */
+   for (i=0; i<job->num_reg; i++)
+      printf("%d: reg %d: 0x%04X (%d)\n", i, job->start_addr+i, job->tab_reg[i], job->tab_reg[i]);
+}
+
+
+void print_job(const poll_job_t *job, int rc)
+{
+   char bus[24] = "";
+   int i;
+   
+   /* Jobs of bus and gateway lines are tagged with their index */
+   if (job->gateway > 0)
+      snprintf(bus, sizeof(bus), "bus %d: ", job->gateway);
+   
+   if (rc != job->num_reg)
+   {
+      printf("%sslave %d: Unable to read %s registers: %s\n", bus, job->slave_addr, 
+             (job->fc == MODBUS_FC_READ_HOLDING_REGISTERS) ? "holding" : "input", 
+             modbus_strerror(errno));
+      return;
+   }
+   
+   /* Print the decoded values of a device, or else the registers */
+   if (job->decoder != NULL)
+   {
+      double value[MB_PROFILE_MAX_FIELDS];
+
+      mb_decode(job->decoder, job->tab_reg, value);
+      for (i=0; i<job->decoder->num_steps; i++)
+         printf("%sslave %d: %s: %.*g%s%s\n", bus, job->slave_addr, job->decoder->field[i]->name,
+                mb_profile_digits(job->decoder->field[i]), value[i], 
+                job->decoder->field[i]->unit[0] ? " " : "", job->decoder->field[i]->unit);
+      return;
+   }
+   for (i=0; i<job->num_reg; i++)
+      printf("%sslave %d: reg %d: 0x%04X (%d)\n", bus, job->slave_addr, job->start_addr+i, 
+             job->tab_reg[i], job->tab_reg[i]);
+}
+
+
+int run_jobs(int gateway, poll_table_t *table, poll_output_t output)
+{
+   modbus_t *mb;
+   int rc;
+   
+   if (gateway < 0)
+      return poll_run_tcp(table, output);
+   
+   /* The slave address is set per request */
+   mb = mb_connect(&table->gateway[gateway].conn, table->job[0].slave_addr);
+   if (mb == NULL)
+      return -1;
+   rc = poll_run(mb, table, output);
+   modbus_close(mb);
+   modbus_free(mb);
+   
+   return rc;
+}
+
+
+void* run_worker(void *arg)
+{
+   worker_t *w = arg;
+   
+   if (mb_rt_thread(rt_priority, rt_cpu) != 0)
+      w->rc = -1;
+   else
+      w->rc = run_jobs(w->gateway, &w->table, mb_queue_push);
+   __atomic_store_n(&w->done, 1, __ATOMIC_RELEASE);
+   
+   return NULL;
+}
+
+
+int add_worker(int gateway)
+{
+   worker_t *w;
+   
+   w = malloc(sizeof(worker_t));
+   if (w == NULL)
+   {
+      printf("Unable to allocate poll worker: %s\n", strerror(errno));
+      return -1;
+   }
+   w->gateway = gateway;
+   w->rc = 0;
+   w->done = 0;
+   poll_table_select(&w->table, &poll_table, gateway);
+   if (w->table.num_jobs == 0)
+   {
+      free(w);
+      return 0;
+   }
+   worker[num_workers++] = w;
+   
+   return 0;
+}
+
+
+int poll_buses(poll_output_t output)
+{
+   int i, rc=0;
+   int stopping=0;
+   
+   /* One worker per serial bus with jobs, one for all gateways */
+   num_workers = 0;
+   for (i=0; i<poll_table.num_gateways; i++)
+   {
+      if ((poll_table.gateway[i].conn.transport != MB_TRANSPORT_TCP) && (add_worker(i) != 0))
+         return -1;
+   }
+   if (add_worker(-1) != 0)
+      return -1;
+   
+   /* A single worker runs in this thread without the queue */
+   if (num_workers == 1)
+   {
+      if (mb_rt_thread(rt_priority, rt_cpu) != 0)
+         rc = -1;
+      else
+         rc = run_jobs(worker[0]->gateway, &worker[0]->table, output);
+      free(worker[0]);
+      return rc;
+   }
+   
+   mb_queue_init();
+   for (i=0; i<num_workers; i++)
+   {
+      if (pthread_create(&worker[i]->thread, NULL, run_worker, worker[i]) != 0)
+      {
+         printf("Unable to start poll worker\n");
+         poll_stop();
+         num_workers = i;
+         rc = -1;
+         break;
+      }
+   }
+   
+   /* Output all results until every worker has finished */
+   while (1)
+   {
+      while (mb_queue_pop(output));
+      
+      for (i=0; (i<num_workers) && __atomic_load_n(&worker[i]->done, __ATOMIC_ACQUIRE); i++);
+      if (i == num_workers)
+      {
+         /* Results pushed before the last worker finished */
+         while (mb_queue_pop(output));
+         break;
+      }
+      
+      /* The signal may have hit this thread only, wake up the sleeping workers */
+      if (stop_requested && !stopping)
+      {
+         for (i=0; i<num_workers; i++)
+            pthread_kill(worker[i]->thread, SIGINT);
+         stopping = 1;
+      }
+      
+      poll_sleep_until(poll_time_now() + QUEUE_IDLE);
+   }
+   
+   for (i=0; i<num_workers; i++)
+   {
+      pthread_join(worker[i]->thread, NULL);
+      if (worker[i]->rc != 0)
+         rc = -1;
+      free(worker[i]);
+   }
+   
+   return rc;
+}
+
+
+int calibrate(mb_conn_t *conn, int slave_addr)
+{
+   mb_timing_t timing;
+   modbus_t *mb;
+   int rc;
+   
+   if (conn->transport != MB_TRANSPORT_RTU)
+   {
+      printf("Calibration needs a Modbus RTU connection\n");
+      return -1;
+   }
+   
+   mb = mb_connect(conn, slave_addr);
+   if (mb == NULL)
+      return -1;
+   rc = mb_rtu_calibrate(mb, conn, slave_addr, &timing);
+   modbus_close(mb);
+   modbus_free(mb);
+   if (rc != 0)
+      return -1;
+   
+   /* Not on stdout, which may carry records */
+   fprintf(stderr, "slave %d: RTS delay %dus, response turnaround %dus, t3.5 %dus\n", 
+           slave_addr, timing.rts_delay, timing.turnaround, timing.t35);
+   conn->rts_delay = timing.rts_delay;
+   conn->turnaround = timing.turnaround;
+   
+   return 0;
+}
+
+
+void stop(int sig)
+{
+   (void)sig;
+   stop_requested = 1;
+   poll_stop();
+   mbd_stop();
+}
 
 
 int main(int argc, char* argv[])
 {
    modbus_t *mb;
-   uint16_t tab_reg[MAX_REG]={0};
+   uint16_t tab_reg[MODBUS_MAX_WRITE_REGISTERS]={0};
    uint16_t reg_val;
    int i, k, rc=0;
    char mode;
-   int baudrate=BAUDRATE;
-   int slave_addr;
-   int start_addr;
+   mb_conn_t conn;
+   int slave_addr=1;
+   int start_addr=0;
    int num_reg=1;
-   int poll_period=0;
+   uint64_t poll_period=0;
+   int format=MB_OUT_TEXT;
+   int window=1;
+   int calib_addr=0;
+   const char *stats_file=NULL;
+   const char *socket_path=MBD_SOCKET;
+   double deadband=-1;
+   uint64_t heartbeat=0;
+   uint64_t write_latency=0;
+   poll_output_t output;
+   char *end;
+   struct sigaction sa;
    
    
-   if (argc < 6)
+   /* Options come before the mode */
+   while ((i = getopt(argc, argv, "+a:b:c:e:m:o:r:t:w:")) != -1)
+   {
+      switch (i)
+      {
+         case 'a':
+            rt_cpu = atoi(optarg);
+            if (rt_cpu < 0)
+            {
+               printf("Invalid CPU: %s\n", optarg);
+               return -1;
+            }
+         break;
+         
+         case 'b':
+            if (poll_parse_period(optarg, 1000, &write_latency) != 0)
+            {
+               printf("Invalid write latency: %s\n", optarg);
+               return -1;
+            }
+         break;
+         
+         case 'c':
+            calib_addr = atoi(optarg);
+            if ((calib_addr < 1) || (calib_addr > POLL_MAX_SLAVE))
+            {
+               printf("Invalid calibration slave address: %s\n", optarg);
+               return -1;
+            }
+         break;
+         
+         case 'e':
+            deadband = strtod(optarg, &end);
+            if ((end == optarg) || !(deadband >= 0) || (deadband > 0xFFFF) ||
+                ((*end == ':') && (poll_parse_period(end+1, 1000000, &heartbeat) != 0)) ||
+                ((*end != ':') && (*end != '\0')))
+            {
+               printf("Invalid deadband: %s\n", optarg);
+               return -1;
+            }
+         break;
+         
+         case 'm':
+            stats_file = optarg;
+         break;
+         
+         case 'o':
+            format = mb_out_open(optarg, STDOUT_FILENO);
+            if (format < 0)
+               return -1;
+         break;
+         
+         case 'r':
+            rt_priority = atoi(optarg);
+            if ((rt_priority < 1) || (rt_priority > MB_RT_MAX_PRIORITY))
+            {
+               printf("Invalid real-time priority: %s\n", optarg);
+               return -1;
+            }
+         break;
+         
+         case 't':
+            if (mb_cache_load(optarg) != 0)
+               return -1;
+         break;
+         
+         case 'w':
+            window = atoi(optarg);
+            if ((window < 1) || (window > MBTCP_MAX_WINDOW))
+            {
+               printf("Invalid window: %s\n", optarg);
+               return -1;
+            }
+         break;
+         
+         default:
+            usage();
+            return -1;
+      }
+   }
+   
+   if ((argc - optind < 2) || ((argc - optind < 3) && (argv[optind][0] != 'd')) ||
+       ((argc - optind < 5) && (argv[optind][0] != 's') && (argv[optind][0] != 'd')))
    {
-      printf("Modbus RTU master, ver %s (using libmodbus %s)\n", VERSION, LIBMODBUS_VERSION_STRING);
-      printf("usage: mbm r|R <baudrate> <slave_addr> <start_addr> <num_reg> [<poll_period>]\n");
-      printf("       mbm w|W <baudrate> <slave_addr> <start_addr> <reg_val> [<reg_val> ...]\n\n");
-      printf("mode:  r - Modbus function code 0x03 (read holding registers)\n");
-      printf("       R - Modbus function code 0x04 (read input registers)\n");
-      printf("       w - Modbus function code 0x06 (preset single register)\n");
-      printf("       W - Modbus function code 0x10 (preset multiple registers)\n\n");
+      usage();
       return 0;
    }
 
@@ -64,18 +483,58 @@ int main(int argc, char* argv[])
     * Parse input parameters
     **************************************************************/
    
-   i = 1;
+   i = optind;
    mode = argv[i++][0];
-   baudrate   = atoi(argv[i++]);
-   slave_addr = atoi(argv[i++]);
-   start_addr = atoi(argv[i++]);
+   if (mb_parse_conn(argv[i++], SERIAL_PORT, &conn) != 0)
+   {
+      printf("Invalid connection: %s\n", argv[i-1]);
+      return -1;
+   }
+   conn.debug = DEBUG;
+   if ((calib_addr > 0) && (calibrate(&conn, calib_addr) != 0))
+      return -1;
+   if (mode == 's')
+   {
+      if (poll_table_load(&poll_table, argv[i++]) != 0)
+         return -1;
+      
+      /* Gateway 0 is the connection given on the command line */
+      if ((conn.transport == MB_TRANSPORT_TCP) && (conn.host[0] == '\0'))
+         strcpy(conn.host, "0.0.0.0");
+      poll_table.gateway[0].conn = conn;
+      poll_table.gateway[0].window = window;
+   }
+   else if (mode == 'd')
+   {
+      if (argc > i)
+         socket_path = argv[i++];
+   }
+   else
+   {
+      slave_addr = atoi(argv[i++]);
+      start_addr = atoi(argv[i++]);
+   }
    switch (mode)
    {
       case 'r':
       case 'R':
          num_reg = atoi(argv[i++]);
          if (argc > i)
-            poll_period = atoi(argv[i++]);
+         {
+            /* Poll period in seconds unless a unit is given */
+            if (poll_parse_period(argv[i++], 1000000, &poll_period) != 0)
+            {
+               printf("Invalid poll period: %s\n", argv[i-1]);
+               return -1;
+            }
+         }
+         if (num_reg > MODBUS_MAX_READ_REGISTERS) num_reg = MODBUS_MAX_READ_REGISTERS;
+         poll_table_init(&poll_table);
+         poll_table.gateway[0].conn = conn;
+         if (poll_table_add(&poll_table, slave_addr, (mode == 'r') ? 
+                            MODBUS_FC_READ_HOLDING_REGISTERS : MODBUS_FC_READ_INPUT_REGISTERS,
+                            start_addr, num_reg, poll_period) != 0)
+            return -1;
       break;
       
       case 'w':
@@ -83,73 +542,40 @@ int main(int argc, char* argv[])
       break;
       
       case 'W':
-         for (k=0; (k<MAX_REG) && (i<argc); k++, i++)
+         for (k=0; (k<MODBUS_MAX_WRITE_REGISTERS) && (i<argc); k++, i++)
             tab_reg[k] = (uint16_t)strtol(argv[i], NULL, 0);
          num_reg = k;
       break;
       
+      case 's':
+      case 'd':
+      break;
+      
       default:
          printf("Invalid mode: %c\n", mode);
          return -1;
    }
-   
-   if (num_reg > MAX_REG) num_reg = MAX_REG;
      
    
    /**************************************************************
     * Initialize communication port
     **************************************************************/
    
-   /* Create Modbus context*/
-   mb = modbus_new_rtu(SERIAL_PORT, baudrate, 'N', 8, 1);
-   if (mb == NULL) {
-      printf("Unable to create the libmodbus context\n");
-      return -1;
-   }
-   
-   /* Set debug mode */
-   if (DEBUG)
-      modbus_set_debug(mb, TRUE);
-   
-   /* Set slave address */
-   modbus_set_slave(mb, slave_addr);
-   
-   /* Connect to serial port */
-   if (DEBUG)
-      printf("Connecting to slave addr %d\n", slave_addr);
-   if (modbus_connect(mb) == -1)
-   {
-      printf("Connection failed: %s\n", modbus_strerror(errno));
-      modbus_free(mb);
+   /* Statistics are written by a thread of their own, which must
+      exist before the poll workers. A single transaction has no use
+      for it, its statistics are written at exit only */
+   mb_stats_init("mbm", "response", "Round trip time");
+   if (((mode == 's') || (mode == 'd') || (poll_period > 0)) && (mb_stats_start(stats_file) != 0))
       return -1;
-   }
-   
-   /* Set Modbus timeouts */
-   modbus_set_response_timeout(mb, 2, 0); // 2s
-   modbus_set_byte_timeout(mb, 0, 0);     // not used
    
-   if (strstr(SERIAL_PORT, "USB") == NULL)
+   /* Create Modbus context and connect to serial port or server,
+      the workers of mode s open their own connections */
+   mb = NULL;
+   if (mode != 's')
    {
-      /* Enable RS485 direction control via RTS line */
-      if (modbus_rtu_set_rts(mb, MODBUS_RTU_RTS_DOWN) == -1)
-      {
-         printf("Setting RTS mode failed: %s\n", modbus_strerror(errno));
-         modbus_free(mb);
+      mb = mb_connect(&conn, slave_addr);
+      if (mb == NULL)
          return -1;
-      }
-      
-      /* Set RTS control delay (before and after transmission) */
-      if (RTS_DELAY>0)
-      {
-         if (modbus_rtu_set_rts_delay(mb, RTS_DELAY) == -1)
-         {
-            printf("Setting RTS delay failed: %s\n", modbus_strerror(errno));
-            modbus_free(mb);
-            return -1;
-         }
-      }
-      if (DEBUG)
-         printf("RTS delay is %dus\n", modbus_rtu_get_rts_delay(mb));
    }
    
    
@@ -157,48 +583,36 @@ int main(int argc, char* argv[])
     * Main loop 
     **************************************************************/
    
+   /* Polled results go through the change filter if one is set */
+   output = (mode == 's') ? print_job : print_regs;
+   if (format != MB_OUT_TEXT)
+      output = mb_out_job;
+   if (deadband >= 0)
+   {
+      mb_change_init(output, (format != MB_OUT_TEXT) ? mb_out_tick : NULL, deadband, heartbeat);
+      output = mb_change_job;
+   }
+   
+   /* Buffered records are written out when polling is stopped */
+   memset(&sa, 0, sizeof(sa));
+   sa.sa_handler = stop;
+   sigaction(SIGINT, &sa, NULL);
+   sigaction(SIGTERM, &sa, NULL);
+   
+   /* Memory allocated so far is locked in, the poll workers of mode s
+      set up their own threads, otherwise this one does the bus I/O */
+   if ((rt_priority > 0) && (mb_rt_lock() != 0))
+      mode = 0;
+   else if ((mode != 's') && (mb_rt_thread(rt_priority, rt_cpu) != 0))
+      mode = 0;
+   
    switch (mode)
    {
       case 'r':
-         // Modbus function code 0x03 (read holding registers)
-         do
-         {  
-            /* Read registers starting from given address */
-            rc = modbus_read_registers(mb, start_addr, num_reg, tab_reg);
-            if (rc != num_reg) 
-            {
-               printf("Unable to read holding registers: %s\n", modbus_strerror(errno));
-               break;
-            }
-            
-            /* Print received register values */
-            for (i=0; i<num_reg; i++)
-               printf("%d: reg %d: 0x%04X (%d)\n", i, start_addr+i, tab_reg[i], tab_reg[i]);
-            
-            usleep(poll_period*1000000);
-            
-         } while (poll_period);
-      break;
-      
       case 'R':
-         // Modbus function code 0x04 (read input registers)
-         do
-         {  
-            /* Read registers starting from given address */
-            rc = modbus_read_input_registers(mb, start_addr, num_reg, tab_reg);
-            if (rc != num_reg) 
-            {
-               printf("Unable to read input registers: %s\n", modbus_strerror(errno));
-               break;
-            }
-            
-            /* Print received register values */
-            for (i=0; i<num_reg; i++)
-               printf("%d: reg %d: 0x%04X (%d)\n", i, start_addr+i, tab_reg[i], tab_reg[i]);
-            
-            usleep(poll_period*1000000);
-            
-         } while (poll_period);
+         // Modbus function code 0x03 (read holding registers) or
+         // 0x04 (read input registers), polled on absolute deadlines
+         rc = poll_run(mb, &poll_table, output);
       break;
       
       case 'w':
@@ -228,14 +642,31 @@ int main(int argc, char* argv[])
          }
       break;
       
-      default:;
+      case 's':
+         // Poll all jobs of the poll table, buses in parallel
+         rc = poll_buses(output);
+      break;
+      
+      case 'd':
+         // Serve the clients on the command socket until stopped
+         rc = mbd_run(mb, socket_path, write_latency);
+      break;
+      
+      default:
+         rc = -1;
    }
    
    /**************************************************************
     * Clean up end exit
     **************************************************************/
-   modbus_close(mb);
-   modbus_free(mb);
+   mb_out_close();
+   if (stats_file != NULL)
+      mb_stats_dump();
+   if (mb != NULL)
+   {
+      modbus_close(mb);
+      modbus_free(mb);
+   }
    
    return rc;
 }
@@ -0,0 +1,461 @@
+/*****************************************************************
+ * Record output of the Modbus master polling scheduler
+ *
+ * Writes one record per poll job result instead of one line per
+ * register. Records are formatted into a large buffer which is
+ * written when it is full, or when the oldest buffered record is
+ * older than MB_OUT_FLUSH_TIME, so a long capture costs one system
+ * call per batch.
+ *
+ * csv:   <time>,<bus>,<slave>,<fc>,<start_addr>,<num_reg>,<status>[,<reg>...]
+ * json:  {"time":<time>,"bus":<bus>,"slave":<slave>,"fc":<fc>,
+ *         "addr":<start_addr>,"regs":[<reg>,...]}  or  ...,"error":"<message>"}
+ * bin:   mb_out_rec_t, see mbout.h
+ * ring:<file>[:<num_recs>]
+ *        binary records in a preallocated ring file, see below
+ *
+ * The time is the wall clock time of the poll in seconds with 6
+ * decimals, the bus is the index of the bus or gateway line in the
+ * poll table (0 is the connection of the tool), the status is 0 or
+ * the errno of a failed poll, in which case no register values follow.
+ *
+ * Jobs of a device profile have the decoded values of their fields
+ * instead of the registers in csv and json, as "values":{"<name>":
+ * <value>,...}; a float which is not finite is empty in csv and null
+ * in json. Binary records always carry the registers.
+ *
+ * The ring file is mapped into memory and records are stored in
+ * place, so there is no write() or fsync() per record and the file
+ * never grows; the kernel writes dirty pages back in the background.
+ * The header writing counter is raised before and the head counter
+ * after each record. A reader maps the file read-only, keeps its own
+ * count of records read and takes record n from slot n % num_recs
+ * while n < head. The record is valid if writing is still at most
+ * n + num_recs after copying it, see mbout.h for the barriers. An
+ * existing ring file of the same geometry is continued, a file of
+ * another geometry is replaced by a new one, never truncated under
+ * the mappings of its readers.
+ *
+ * Author: Ondrej Wisniewski
+ *
+ * History:
+ * 14/10/2026: First release
+ * 14/10/2026: Memory mapped ring file output
+ * 14/10/2026: Bus index and poll time in every record
+ * 14/10/2026: Flush on the time of results not output
+ * 14/10/2026: Decoded values of device profile jobs
+ * 14/10/2026: Writing counter in the ring header, rings replaced by rename
+ *
+ *****************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include "mbout.h"
+
+
+/* Longest text record: header plus the names and values of all
+   fields of a profile, more than 125 registers of up to 6 chars */
+#define MAX_VALUE     24
+#define MAX_RECORD    (128 + (MB_PROFILE_NAME_LEN+4+MAX_VALUE)*MB_PROFILE_MAX_FIELDS)
+
+static const char *format_name[] = { "text", "csv", "json", "bin", "ring" };
+
+static int out_format;
+static int out_fd = -1;
+static char buf[MB_OUT_BUF_SIZE];
+static int buf_length;
+static uint64_t buf_time;          /* time of the oldest buffered record */
+
+/* Ring file mapping */
+static mb_ring_hdr_t *ring;
+static size_t ring_size;
+
+
+static int open_ring(const char *filename, int num_recs)
+{
+   char tmpname[272];
+   mb_ring_hdr_t hdr;
+   const char *name = filename;
+   int fd, rc;
+
+   ring_size = sizeof(mb_ring_hdr_t) + (size_t)num_recs*sizeof(mb_out_rec_t);
+
+   /* Continue a ring of the same geometry. Any other file may be
+      mapped by readers, it is replaced by a new file instead of
+      truncated, which would fault their mappings */
+   fd = open(filename, O_RDWR);
+   if ((fd != -1) && ((read(fd, &hdr, sizeof(hdr)) != sizeof(hdr)) || (hdr.magic != MB_RING_MAGIC) ||
+                      (hdr.version != MB_RING_VERSION) || (hdr.rec_size != sizeof(mb_out_rec_t)) ||
+                      (hdr.num_recs != (uint32_t)num_recs)))
+   {
+      close(fd);
+      fd = -1;
+      errno = ENOENT;
+   }
+   if ((fd == -1) && (errno == ENOENT))
+   {
+      snprintf(tmpname, sizeof(tmpname), "%s.new", filename);
+      name = tmpname;
+      fd = open(name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+      if (fd != -1)
+      {
+         memset(&hdr, 0, sizeof(hdr));
+         hdr.magic    = MB_RING_MAGIC;
+         hdr.version  = MB_RING_VERSION;
+         hdr.rec_size = sizeof(mb_out_rec_t);
+         hdr.num_recs = num_recs;
+         if (pwrite(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr))
+         {
+            printf("Unable to initialise ring file %s: %s\n", name, strerror(errno));
+            close(fd);
+            unlink(name);
+            return -1;
+         }
+      }
+   }
+   if (fd == -1)
+   {
+      printf("Unable to open ring file %s: %s\n", name, strerror(errno));
+      return -1;
+   }
+
+   /* Allocate all blocks now, a full disk must not fault in the mapping */
+   rc = posix_fallocate(fd, 0, ring_size);
+   if (rc != 0)
+   {
+      printf("Unable to allocate ring file %s: %s\n", name, strerror(rc));
+      close(fd);
+      if (name != filename)
+         unlink(name);
+      return -1;
+   }
+
+   ring = mmap(NULL, ring_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+   close(fd);
+   if (ring == MAP_FAILED)
+   {
+      printf("Unable to map ring file %s: %s\n", name, strerror(errno));
+      ring = NULL;
+      if (name != filename)
+         unlink(name);
+      return -1;
+   }
+
+   /* A writer may have stopped within a record */
+   ring->writing = ring->head;
+
+   if ((name != filename) && (rename(name, filename) == -1))
+   {
+      printf("Unable to replace ring file %s: %s\n", filename, strerror(errno));
+      munmap(ring, ring_size);
+      ring = NULL;
+      unlink(name);
+      return -1;
+   }
+
+   return 0;
+}
+
+
+int mb_out_open(const char *spec, int fd)
+{
+   char filename[256];
+   int num_recs = MB_RING_RECS;
+   int n, i;
+
+   for (i=0; i<(int)(sizeof(format_name)/sizeof(format_name[0])); i++)
+   {
+      n = strlen(format_name[i]);
+      if ((strncmp(spec, format_name[i], n) == 0) && 
+          ((spec[n] == '\0') || ((i == MB_OUT_RING) && (spec[n] == ':'))))
+         break;
+   }
+
+   if (i == MB_OUT_RING)
+   {
+      /* ring:<file>[:<num_recs>] */
+      if ((sscanf(spec, "ring:%255[^:]:%d", filename, &num_recs) < 1) || (num_recs < 1))
+      {
+         printf("Invalid ring file output: %s\n", spec);
+         return -1;
+      }
+      if (open_ring(filename, num_recs) != 0)
+         return -1;
+   }
+   else if (i == (int)(sizeof(format_name)/sizeof(format_name[0])))
+   {
+      printf("Invalid output format: %s\n", spec);
+      return -1;
+   }
+
+   out_format = i;
+   out_fd = fd;
+   buf_length = 0;
+
+   return out_format;
+}
+
+
+void mb_out_flush(void)
+{
+   int n, rc;
+
+   for (n=0; n<buf_length; n+=rc)
+   {
+      rc = write(out_fd, &buf[n], buf_length-n);
+      if (rc == -1)
+      {
+         if (errno == EINTR)
+         {
+            rc = 0;
+            continue;
+         }
+         fprintf(stderr, "Unable to write output: %s\n", strerror(errno));
+         break;
+      }
+   }
+
+   buf_length = 0;
+}
+
+
+static char* put_uint(char *p, unsigned long long val)
+{
+   char tmp[20];
+   int n = 0;
+
+   /* Digits are produced in reverse order */
+   do
+   {
+      tmp[n++] = '0' + val%10;
+      val /= 10;
+   } while (val);
+   while (n)
+      *p++ = tmp[--n];
+
+   return p;
+}
+
+
+static char* put_str(char *p, const char *str)
+{
+   int n = strlen(str);
+
+   memcpy(p, str, n);
+   return p + n;
+}
+
+
+static char* put_time(char *p, uint64_t t)
+{
+   int i;
+
+   p = put_uint(p, t/1000000);
+   *p++ = '.';
+   p += 6;
+   for (i=1; i<=6; i++, t/=10)
+      p[-i] = '0' + t%10;
+
+   return p;
+}
+
+
+static char* put_value(char *p, double val, const mb_field_t *field, const char *none)
+{
+   if (!isfinite(val))
+      return put_str(p, none);
+   return p + snprintf(p, MAX_VALUE, "%.*g", mb_profile_digits(field), val);
+}
+
+
+static char* put_csv(char *p, uint64_t t, const poll_job_t *job, int status)
+{
+   int i;
+
+   p = put_time(p, t);
+   *p++ = ',';
+   p = put_uint(p, job->gateway);
+   *p++ = ',';
+   p = put_uint(p, job->slave_addr);
+   *p++ = ',';
+   p = put_uint(p, job->fc);
+   *p++ = ',';
+   p = put_uint(p, job->start_addr);
+   *p++ = ',';
+   p = put_uint(p, job->num_reg);
+   *p++ = ',';
+   p = put_uint(p, status);
+   if ((status == 0) && (job->decoder != NULL))
+   {
+      double value[MB_PROFILE_MAX_FIELDS];
+
+      mb_decode(job->decoder, job->tab_reg, value);
+      for (i=0; i<job->decoder->num_steps; i++)
+      {
+         *p++ = ',';
+         p = put_value(p, value[i], job->decoder->field[i], "");
+      }
+   }
+   else if (status == 0)
+   {
+      for (i=0; i<job->num_reg; i++)
+      {
+         *p++ = ',';
+         p = put_uint(p, job->tab_reg[i]);
+      }
+   }
+   *p++ = '\n';
+
+   return p;
+}
+
+
+static char* put_json(char *p, uint64_t t, const poll_job_t *job, int status)
+{
+   int i;
+
+   p = put_str(p, "{\"time\":");
+   p = put_time(p, t);
+   p = put_str(p, ",\"bus\":");
+   p = put_uint(p, job->gateway);
+   p = put_str(p, ",\"slave\":");
+   p = put_uint(p, job->slave_addr);
+   p = put_str(p, ",\"fc\":");
+   p = put_uint(p, job->fc);
+   p = put_str(p, ",\"addr\":");
+   p = put_uint(p, job->start_addr);
+   if ((status == 0) && (job->decoder != NULL))
+   {
+      double value[MB_PROFILE_MAX_FIELDS];
+
+      /* Field names need no escaping, see mbprofile.c */
+      mb_decode(job->decoder, job->tab_reg, value);
+      p = put_str(p, ",\"values\":{");
+      for (i=0; i<job->decoder->num_steps; i++)
+      {
+         if (i > 0)
+            *p++ = ',';
+         *p++ = '"';
+         p = put_str(p, job->decoder->field[i]->name);
+         p = put_str(p, "\":");
+         p = put_value(p, value[i], job->decoder->field[i], "null");
+      }
+      *p++ = '}';
+   }
+   else if (status == 0)
+   {
+      p = put_str(p, ",\"regs\":[");
+      for (i=0; i<job->num_reg; i++)
+      {
+         if (i > 0)
+            *p++ = ',';
+         p = put_uint(p, job->tab_reg[i]);
+      }
+      *p++ = ']';
+   }
+   else
+   {
+      /* libmodbus messages need no escaping */
+      p = put_str(p, ",\"error\":\"");
+      p += snprintf(p, 64, "%.60s", modbus_strerror(status));
+      *p++ = '"';
+   }
+   p = put_str(p, "}\n");
+
+   return p;
+}
+
+
+static char* put_bin(char *p, uint64_t t, const poll_job_t *job, int status)
+{
+   mb_out_rec_t rec;
+
+   memset(&rec, 0, sizeof(rec));
+   rec.time       = t;
+   rec.status     = status;
+   rec.bus        = job->gateway;
+   rec.slave_addr = job->slave_addr;
+   rec.fc         = job->fc;
+   rec.start_addr = job->start_addr;
+   rec.num_reg    = job->num_reg;
+   if (status == 0)
+      memcpy(rec.reg, job->tab_reg, job->num_reg*sizeof(uint16_t));
+
+   /* The buffer holds records of mixed alignment */
+   memcpy(p, &rec, sizeof(rec));
+   return p + sizeof(rec);
+}
+
+
+void mb_out_job(const poll_job_t *job, int rc)
+{
+   uint64_t t = job->time;
+   int status = (rc == job->num_reg) ? 0 : errno;
+   char *p;
+
+   if (out_format == MB_OUT_RING)
+   {
+      /* Store in place, readers see the record once head has moved
+         and drop their copy of an older one if writing moved past it */
+      __atomic_store_n(&ring->writing, ring->head+1, __ATOMIC_RELAXED);
+      __atomic_thread_fence(__ATOMIC_RELEASE);
+      put_bin((char *)(ring + 1) + (ring->head % ring->num_recs)*sizeof(mb_out_rec_t), 
+              t, job, status);
+      __atomic_store_n(&ring->head, ring->head+1, __ATOMIC_RELEASE);
+      return;
+   }
+
+   if (MB_OUT_BUF_SIZE - buf_length < MAX_RECORD)
+      mb_out_flush();
+   if (buf_length == 0)
+      buf_time = t;
+
+   p = &buf[buf_length];
+   switch (out_format)
+   {
+      case MB_OUT_CSV:
+         p = put_csv(p, t, job, status);
+         break;
+
+      case MB_OUT_JSON:
+         p = put_json(p, t, job, status);
+         break;
+
+      case MB_OUT_BIN:
+         p = put_bin(p, t, job, status);
+         break;
+
+      default:;
+   }
+   buf_length = p - buf;
+
+   /* Don't hold records back for long when the poll rate is low */
+   if (t - buf_time >= MB_OUT_FLUSH_TIME)
+      mb_out_flush();
+}
+
+
+void mb_out_tick(uint64_t t)
+{
+   /* Results which are not output still move the clock on */
+   if ((buf_length > 0) && (t - buf_time >= MB_OUT_FLUSH_TIME))
+      mb_out_flush();
+}
+
+
+void mb_out_close(void)
+{
+   mb_out_flush();
+
+   if (ring != NULL)
+   {
+      munmap(ring, ring_size);
+      ring = NULL;
+   }
+}
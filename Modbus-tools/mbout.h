@@ -0,0 +1,87 @@
+/*****************************************************************
+ * Record output of the Modbus master polling scheduler
+ *
+ * Author: Ondrej Wisniewski
+ *
+ * History:
+ * 14/10/2026: First release
+ * 14/10/2026: Memory mapped ring file output
+ * 14/10/2026: Bus index in every record
+ * 14/10/2026: Flush on the time of results not output
+ * 14/10/2026: Writing counter in the ring header
+ *
+ *****************************************************************/
+
+#ifndef MBOUT_H
+#define MBOUT_H
+
+#include <stdint.h>
+#include <modbus/modbus.h>
+#include "mbpoll.h"
+
+
+/* Output formats */
+#define MB_OUT_TEXT       0     /* one line per register, printed by the tool */
+#define MB_OUT_CSV        1
+#define MB_OUT_JSON       2
+#define MB_OUT_BIN        3
+#define MB_OUT_RING       4     /* binary records in a memory mapped ring file */
+
+/* Records are collected in a buffer and written in batches */
+#define MB_OUT_BUF_SIZE   (256*1024)
+
+/* Records are not held back longer than this (us), checked on each record */
+#define MB_OUT_FLUSH_TIME 1000000
+
+/* Binary record, 272 bytes in host byte order */
+typedef struct {
+   uint64_t time;          /* us since the epoch */
+   int32_t status;         /* 0, or errno of a failed poll */
+   uint8_t slave_addr;
+   uint8_t fc;
+   uint16_t start_addr;
+   uint16_t num_reg;
+   uint16_t reg[MODBUS_MAX_READ_REGISTERS];
+   uint16_t bus;           /* bus or gateway index in the poll table */
+   uint16_t reserved;
+} mb_out_rec_t;
+
+/* Ring file, a header followed by num_recs records */
+#define MB_RING_MAGIC     0x4D42524E
+#define MB_RING_VERSION   2
+#define MB_RING_RECS      16384  /* default size, about 4.5 MB */
+
+/* The writer of record n sets writing to n+1, then a write barrier,
+   then stores the record in slot n % num_recs, then sets head to n+1
+   with release semantics. A reader of record n:
+
+     1. waits for n < head, loaded with acquire semantics
+     2. copies slot n % num_recs
+     3. issues an acquire fence, __atomic_thread_fence(__ATOMIC_ACQUIRE)
+     4. loads writing, the copy is valid if writing <= n + num_recs,
+        else the record was overwritten and the reader is behind
+
+   Without the fence in 3 the loads of the copy may be done after the
+   load of writing on weakly ordered CPUs, e.g. ARM, and a record
+   overwritten meanwhile would be taken as valid. A ring file of
+   another geometry is replaced by a new file under the same name, a
+   reader which finds another inode at the name maps it again */
+typedef struct {
+   uint32_t magic;
+   uint32_t version;
+   uint32_t rec_size;      /* sizeof(mb_out_rec_t) */
+   uint32_t num_recs;
+   uint64_t head;          /* records ever written, the next one goes to 
+                              slot head % num_recs */
+   uint64_t writing;       /* head + 1 while a record is stored, else head */
+   uint8_t reserved[32];   /* header is 64 bytes */
+} mb_ring_hdr_t;
+
+
+int mb_out_open(const char *spec, int fd);
+void mb_out_job(const poll_job_t *job, int rc);
+void mb_out_flush(void);
+void mb_out_tick(uint64_t t);
+void mb_out_close(void);
+
+#endif
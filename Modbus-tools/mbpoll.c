@@ -0,0 +1,919 @@
+/*****************************************************************
+ * Modbus master polling scheduler
+ *
+ * Runs a table of poll jobs over one Modbus context. Jobs of the
+ * same slave, function code and period which are close together
+ * are coalesced into one bus request and the result is split back
+ * to the jobs. Every request has its own deadline, the scheduler
+ * always serves the request with the earliest deadline and runs
+ * overdue requests back to back, so the bus only idles when
+ * nothing is due.
+ *
+ * Poll table file format, one job per line:
+ *
+ *   # slave  fc  start_addr  num_reg  period_ms
+ *     1      3   0           4        1000
+ *     1      3   6           4        1000
+ *     2      4   0x10        2        500
+ *
+ * fc is 3 (read holding registers) or 4 (read input registers).
+ * The period is given in ms unless it has a unit suffix (us, ms
+ * or s), a period of 0 polls the job only once.
+ *
+ * Deadlines are absolute, so the poll rate does not drift with
+ * the transaction time. On a serial bus the next request follows
+ * the end of a transaction after the t3.5 silence of the timing
+ * profile (see mbcommon.c), not earlier. A request which could not
+ * be sent before its next deadline is reported as a missed deadline.
+ * It is still sent as soon as possible if it is less than one period
+ * behind, the cycles it is further behind are skipped.
+ *
+ * Jobs are polled over the connection given to the tool unless a
+ * gateway line comes first, then they are polled over that Modbus
+ * TCP gateway:
+ *
+ *   gateway tcp:<host>[:<port>]  [<window>]
+ *
+ * Over Modbus TCP up to <window> requests (default 1) are kept in
+ * flight per gateway, so a single thread drives all gateways.
+ *
+ * A bus line does the same for a serial bus:
+ *
+ *   bus <device>:<baudrate>
+ *
+ * Every serial bus is polled by a worker of its own, so the buses
+ * are polled in parallel; see mbm.
+ *
+ * The response timeout is adapted to every slave the way TCP does
+ * it: the smoothed round trip time plus four times its variation,
+ * within POLL_MIN_TIMEOUT and POLL_MAX_TIMEOUT. On a serial bus the
+ * wire time of request and response, which grows with the number of
+ * registers, is taken off every sample and added to the timeout of
+ * each request, so the estimate is the turnaround of the slave. A
+ * timeout doubles the timeout of the slave. After POLL_OFFLINE
+ * timeouts in a row the slave is offline: its requests fail with
+ * EHOSTDOWN without using the bus, and only one request is sent as
+ * a probe now and then, at an interval doubling from POLL_PROBE_MIN
+ * up to POLL_PROBE_MAX, with the timeout before the backoff. The
+ * first response brings the slave back. A dead device thus costs a
+ * fraction of the bus time instead of a full timeout per cycle.
+ *
+ * Coalescing rules can be set per slave, or for all slaves with *:
+ *
+ *   coalesce <slave>|*  <max_gap>  <max_num>
+ *
+ * max_gap is the number of unused registers which may be read
+ * between two jobs (default 0, only adjacent or overlapping jobs
+ * are merged), max_num limits the registers read by one request
+ * (default 125). Set max_num to 0 for devices which must be
+ * polled exactly as listed.
+ *
+ * A device line adds the jobs reading all fields of a device
+ * profile (see mbprofile.c), one job per function code, whose
+ * results are output as the decoded values of the fields:
+ *
+ *   device <slave>  <profile>  <period_ms>
+ *
+ * The profile is the name of a compiled in profile, like pkth100b,
+ * or a profile file.
+ *
+ * Author: Ondrej Wisniewski
+ *
+ * History:
+ * 14/10/2026: First release
+ * 14/10/2026: Stop on request and report missed deadlines on stderr
+ * 14/10/2026: Pipelined polling of Modbus TCP gateways
+ * 14/10/2026: Serial bus lines and per-bus sub-tables
+ * 14/10/2026: Adaptive per-slave response timeouts
+ * 14/10/2026: Silent interval of t3.5 between serial transactions
+ * 14/10/2026: Transaction statistics per slave, see mbstats.c
+ * 14/10/2026: Device lines with the jobs of a device profile
+ * 14/10/2026: Response timeouts from the slave turnaround
+ * 14/10/2026: Late requests less than one period behind are still sent
+ * 14/10/2026: Gateways resolved once at startup
+ *
+ *****************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include "mbcommon.h"
+#include "mbpoll.h"
+
+
+/* Debug mode */
+#define DEBUG         0
+
+/* Maximum length of a poll table line */
+#define MAX_LINE      256
+
+/* Default coalescing rule */
+#define DEFAULT_MAX_GAP  0
+#define DEFAULT_MAX_NUM  MODBUS_MAX_READ_REGISTERS
+
+/* Set by poll_stop() to leave the scheduler loop */
+static volatile sig_atomic_t stopped;
+
+
+uint64_t poll_time_now(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
+
+
+void poll_sleep_until(uint64_t t)
+{
+   struct timespec ts;
+
+   ts.tv_sec  = t/1000000;
+   ts.tv_nsec = (t%1000000)*1000;
+
+   /* Absolute deadline, restart on signals without drifting */
+   while ((clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) && !stopped);
+}
+
+
+void poll_stop(void)
+{
+   /* May be called from a signal handler */
+   stopped = 1;
+}
+
+
+int poll_parse_period(const char *str, uint64_t unit, uint64_t *period)
+{
+   unsigned long long val;
+   char *end;
+
+   if ((*str < '0') || (*str > '9'))
+      return -1;
+
+   val = strtoull(str, &end, 10);
+
+   if (*end == '\0')
+      *period = val*unit;
+   else if (strcmp(end, "us") == 0)
+      *period = val;
+   else if (strcmp(end, "ms") == 0)
+      *period = val*1000;
+   else if (strcmp(end, "s") == 0)
+      *period = val*1000000;
+   else
+      return -1;
+
+   return 0;
+}
+
+
+void poll_table_init(poll_table_t *table)
+{
+   int i;
+
+   table->num_jobs = 0;
+   table->num_reqs = 0;
+   table->num_gateways = 1;
+   memset(&table->gateway[0], 0, sizeof(table->gateway[0]));
+   table->gateway[0].window = 1;
+
+   for (i=0; i<=POLL_MAX_SLAVE; i++)
+   {
+      table->rule[i].max_gap = DEFAULT_MAX_GAP;
+      table->rule[i].max_num = DEFAULT_MAX_NUM;
+   }
+}
+
+
+int poll_set_rule(poll_table_t *table, int slave_addr, int max_gap, int max_num)
+{
+   int i;
+
+   if ((slave_addr < 0) || (slave_addr > POLL_MAX_SLAVE) ||
+       (max_gap < 0) || (max_num < 0) || (max_num > MODBUS_MAX_READ_REGISTERS))
+   {
+      printf("Invalid coalescing rule: slave %d, max_gap %d, max_num %d\n",
+             slave_addr, max_gap, max_num);
+      return -1;
+   }
+
+   /* Slave address 0 sets the rule for all slaves */
+   for (i=(slave_addr ? slave_addr : 1); i<=(slave_addr ? slave_addr : POLL_MAX_SLAVE); i++)
+   {
+      table->rule[i].max_gap = max_gap;
+      table->rule[i].max_num = max_num;
+   }
+
+   return 0;
+}
+
+
+int poll_table_add(poll_table_t *table, int slave_addr, int fc,
+                   int start_addr, int num_reg, uint64_t period)
+{
+   poll_job_t *job;
+
+   if (table->num_jobs >= POLL_MAX_JOBS)
+   {
+      printf("Too many poll jobs (max %d)\n", POLL_MAX_JOBS);
+      return -1;
+   }
+
+   if ((slave_addr < 1) || (slave_addr > POLL_MAX_SLAVE) ||
+       ((fc != MODBUS_FC_READ_HOLDING_REGISTERS) && (fc != MODBUS_FC_READ_INPUT_REGISTERS)) ||
+       (start_addr < 0) || (num_reg < 1) || (num_reg > MODBUS_MAX_READ_REGISTERS) ||
+       (start_addr + num_reg > 0x10000))
+   {
+      printf("Invalid poll job: slave %d, fc %d, addr %d, num %d\n",
+             slave_addr, fc, start_addr, num_reg);
+      return -1;
+   }
+
+   job = &table->job[table->num_jobs];
+   memset(job, 0, sizeof(*job));
+   job->id         = table->num_jobs++;
+   job->gateway    = table->num_gateways - 1;
+   job->slave_addr = slave_addr;
+   job->fc         = fc;
+   job->start_addr = start_addr;
+   job->num_reg    = num_reg;
+   job->period     = period;
+
+   return 0;
+}
+
+
+int poll_table_load(poll_table_t *table, const char *filename)
+{
+   FILE *fp;
+   char line[MAX_LINE];
+   int line_num = 0;
+   int rc = 0;
+
+   fp = fopen(filename, "r");
+   if (fp == NULL)
+   {
+      printf("Unable to open poll table %s: %s\n", filename, strerror(errno));
+      return -1;
+   }
+
+   poll_table_init(table);
+
+   while ((rc == 0) && (fgets(line, sizeof(line), fp) != NULL))
+   {
+      long val[4];
+      char period_str[32];
+      uint64_t period;
+      char *p, *end;
+      int n;
+
+      line_num++;
+
+      /* Strip comments */
+      if ((p = strchr(line, '#')) != NULL)
+         *p = '\0';
+
+      p = line + strspn(line, " \t");
+
+      /* Coalescing rule */
+      if (strncmp(p, "coalesce", 8) == 0)
+      {
+         char slave[8];
+         int max_gap, max_num;
+
+         if ((sscanf(p+8, "%7s %i %i", slave, &max_gap, &max_num) != 3) ||
+             ((strcmp(slave, "*") != 0) && (atoi(slave) < 1)))
+         {
+            printf("%s:%d: expected coalesce <slave>|* <max_gap> <max_num>\n",
+                   filename, line_num);
+            rc = -1;
+            break;
+         }
+         rc = poll_set_rule(table, (strcmp(slave, "*") == 0) ? 0 : atoi(slave),
+                            max_gap, max_num);
+         if (rc != 0)
+            printf("%s:%d: coalescing rule rejected\n", filename, line_num);
+         continue;
+      }
+
+      /* Gateway or serial bus for the following jobs */
+      if ((strncmp(p, "gateway", 7) == 0) || (strncmp(p, "bus", 3) == 0))
+      {
+         poll_gateway_t *gw = &table->gateway[table->num_gateways];
+         int transport = (p[0] == 'g') ? MB_TRANSPORT_TCP : MB_TRANSPORT_RTU;
+         char conn_str[80];
+         int window = 1;
+
+         if (table->num_gateways == POLL_MAX_GATEWAYS)
+         {
+            printf("%s:%d: too many buses and gateways (max %d)\n", filename, line_num,
+                   POLL_MAX_GATEWAYS-1);
+            rc = -1;
+            break;
+         }
+         if ((sscanf(p + ((transport == MB_TRANSPORT_TCP) ? 7 : 3), "%79s %i", 
+                     conn_str, &window) < 1) ||
+             (mb_parse_conn(conn_str, NULL, &gw->conn) != 0) ||
+             (gw->conn.transport != transport) || 
+             (window < 1) || (window > MBTCP_MAX_WINDOW))
+         {
+            printf("%s:%d: expected gateway tcp:<host>[:<port>] [<window>] or bus <device>:<baudrate>\n",
+                   filename, line_num);
+            rc = -1;
+            break;
+         }
+         gw->window = window;
+         table->num_gateways++;
+         continue;
+      }
+
+      /* Jobs of a device profile */
+      if (strncmp(p, "device", 6) == 0)
+      {
+         const mb_profile_t *profile = NULL;
+         mb_decoder_t *decoder;
+         char name[64];
+         int slave_addr, fc;
+
+         if ((sscanf(p+6, "%i %63s %31s%n", &slave_addr, name, period_str, &n) != 3) ||
+             (strspn(p+6+n, " \t\r\n") != strlen(p+6+n)) ||
+             (poll_parse_period(period_str, 1000, &period) != 0))
+         {
+            printf("%s:%d: expected device <slave> <profile> <period_ms>\n", filename, line_num);
+            rc = -1;
+            break;
+         }
+         if ((profile = mb_profile_get(name)) == NULL)
+            rc = -1;
+         for (fc=MODBUS_FC_READ_HOLDING_REGISTERS; (rc == 0) && (fc<=MODBUS_FC_READ_INPUT_REGISTERS); fc++)
+         {
+            rc = mb_profile_decoder(profile, fc, &decoder);
+            if ((rc == 0) && (decoder != NULL))
+            {
+               rc = poll_table_add(table, slave_addr, fc, decoder->start_addr, decoder->num_reg, period);
+               if (rc == 0)
+                  table->job[table->num_jobs-1].decoder = decoder;
+               else
+                  free(decoder);
+            }
+         }
+         if (rc != 0)
+            printf("%s:%d: device rejected\n", filename, line_num);
+         continue;
+      }
+
+      /* Parse numeric fields */
+      for (n=0; n<4; n++)
+      {
+         val[n] = strtol(p, &end, 0);
+         if (end == p)
+            break;
+         p = end;
+      }
+
+      /* Skip empty lines */
+      if ((n == 0) && (strspn(p, " \t\r\n") == strlen(p)))
+         continue;
+
+      /* Period, ms by default */
+      if ((n < 4) || (sscanf(p, "%31s%n", period_str, &n) != 1) ||
+          (strspn(p+n, " \t\r\n") != strlen(p+n)) ||
+          (poll_parse_period(period_str, 1000, &period) != 0))
+      {
+         printf("%s:%d: expected <slave> <fc> <start_addr> <num_reg> <period_ms>\n",
+                filename, line_num);
+         rc = -1;
+         break;
+      }
+
+      rc = poll_table_add(table, val[0], val[1], val[2], val[3], period);
+      if (rc != 0)
+         printf("%s:%d: poll job rejected\n", filename, line_num);
+   }
+
+   fclose(fp);
+
+   if ((rc == 0) && (table->num_jobs == 0))
+   {
+      printf("%s: no poll jobs found\n", filename);
+      rc = -1;
+   }
+
+   return rc;
+}
+
+
+void poll_table_select(poll_table_t *sub, const poll_table_t *table, int gateway)
+{
+   int i;
+
+   /* Same rules and gateways, jobs keep their gateway index */
+   memcpy(sub->rule, table->rule, sizeof(sub->rule));
+   sub->num_gateways = table->num_gateways;
+   memcpy(sub->gateway, table->gateway, sizeof(sub->gateway));
+   sub->num_reqs = 0;
+   sub->num_jobs = 0;
+
+   /* Jobs of one gateway, or of all Modbus TCP gateways if gateway is -1 */
+   for (i=0; i<table->num_jobs; i++)
+   {
+      const poll_job_t *job = &table->job[i];
+
+      if ((gateway >= 0) ? (job->gateway == gateway) :
+          (table->gateway[job->gateway].conn.transport == MB_TRANSPORT_TCP))
+         sub->job[sub->num_jobs++] = *job;
+   }
+}
+
+
+static int job_before(const poll_job_t *a, const poll_job_t *b)
+{
+   if (a->gateway != b->gateway)
+      return a->gateway < b->gateway;
+   if (a->slave_addr != b->slave_addr)
+      return a->slave_addr < b->slave_addr;
+   if (a->fc != b->fc)
+      return a->fc < b->fc;
+   if (a->period != b->period)
+      return a->period < b->period;
+   return a->start_addr < b->start_addr;
+}
+
+
+static int slave_index(poll_table_t *table, int gateway, int slave_addr)
+{
+   poll_slave_t *slave;
+   int i;
+
+   for (i=0; i<table->num_slaves; i++)
+   {
+      if ((table->slave[i].gateway == gateway) && (table->slave[i].slave_addr == slave_addr))
+         return i;
+   }
+
+   slave = &table->slave[table->num_slaves];
+   memset(slave, 0, sizeof(*slave));
+   slave->gateway    = gateway;
+   slave->slave_addr = slave_addr;
+   slave->timeout    = POLL_INIT_TIMEOUT;
+   slave->stats      = mb_stats_slave(gateway, slave_addr);
+
+   return table->num_slaves++;
+}
+
+
+void poll_table_build(poll_table_t *table)
+{
+   poll_req_t *req = NULL;
+   int i, k;
+
+   /* Sort the jobs by slave, fc, period and start address */
+   for (i=0; i<table->num_jobs; i++)
+   {
+      for (k=i; (k>0) && job_before(&table->job[i], &table->job[table->member[k-1]]); k--)
+         table->member[k] = table->member[k-1];
+      table->member[k] = i;
+   }
+
+   /* Merge neighbouring jobs into requests */
+   table->num_reqs = 0;
+   table->num_slaves = 0;
+   for (i=0; i<table->num_jobs; i++)
+   {
+      poll_job_t *job = &table->job[table->member[i]];
+      const poll_rule_t *rule = &table->rule[job->slave_addr];
+      int end = job->start_addr + job->num_reg;
+
+      if ((req != NULL) && (rule->max_num > 0) &&
+          (req->gateway == job->gateway) &&
+          (req->slave_addr == job->slave_addr) && (req->fc == job->fc) &&
+          (req->period == job->period) &&
+          (job->start_addr <= req->start_addr + req->num_reg + rule->max_gap) &&
+          (end - req->start_addr <= rule->max_num))
+      {
+         /* Extend the current request over this job */
+         if (end > req->start_addr + req->num_reg)
+            req->num_reg = end - req->start_addr;
+         req->num_members++;
+      }
+      else
+      {
+         /* Start a new request */
+         req = &table->req[table->num_reqs++];
+         memset(req, 0, sizeof(*req));
+         req->gateway      = job->gateway;
+         req->slave_addr   = job->slave_addr;
+         req->fc           = job->fc;
+         req->start_addr   = job->start_addr;
+         req->num_reg      = job->num_reg;
+         req->period       = job->period;
+         req->first_member = i;
+         req->num_members  = 1;
+         req->slave        = slave_index(table, job->gateway, job->slave_addr);
+      }
+
+      /* Job results are taken straight from the request buffer */
+      job->tab_reg = &req->tab_reg[job->start_addr - req->start_addr];
+   }
+
+   if (DEBUG)
+      printf("DBG: %d poll jobs coalesced into %d requests\n",
+             table->num_jobs, table->num_reqs);
+}
+
+
+static int slave_skip(poll_slave_t *slave, uint64_t now)
+{
+   if (slave->failures < POLL_OFFLINE)
+      return 0;
+
+   /* Offline, one probe at a time when it is due */
+   if (slave->probing || (now < slave->probe_time))
+      return 1;
+   slave->probing = 1;
+
+   return 0;
+}
+
+
+static uint64_t slave_timeout(const poll_slave_t *slave)
+{
+   uint64_t timeout;
+
+   if (slave->srtt == 0)
+      return POLL_INIT_TIMEOUT;
+
+   timeout = slave->srtt + 4*slave->rttvar;
+   if (timeout < POLL_MIN_TIMEOUT)
+      timeout = POLL_MIN_TIMEOUT;
+   if (timeout > POLL_MAX_TIMEOUT)
+      timeout = POLL_MAX_TIMEOUT;
+
+   return timeout;
+}
+
+
+static void slave_update(poll_slave_t *slave, const poll_req_t *req, uint64_t rtt, int err)
+{
+   uint64_t delta;
+
+   mb_stats_record(slave->stats, rtt, err);
+   slave->probing = 0;
+
+   /* The turnaround of the slave is what does not depend on the size
+      of the request */
+   rtt = (rtt > req->wire) ? rtt - req->wire : 0;
+
+   /* No response, or none from behind the gateway */
+   if ((err == ETIMEDOUT) || (err == EMBXGTAR))
+   {
+      slave->timeout *= 2;
+      if (slave->timeout > POLL_MAX_TIMEOUT)
+         slave->timeout = POLL_MAX_TIMEOUT;
+
+      if (++slave->failures < POLL_OFFLINE)
+         return;
+
+      /* Probes wait no longer than a response used to take */
+      slave->timeout = slave_timeout(slave);
+      if (slave->failures == POLL_OFFLINE)
+      {
+         slave->probe_interval = POLL_PROBE_MIN;
+         fprintf(stderr, "slave %d: offline, probing every %llu s at least\n", slave->slave_addr,
+                 POLL_PROBE_MIN/1000000);
+      }
+      else if (slave->probe_interval < POLL_PROBE_MAX)
+      {
+         slave->probe_interval *= 2;
+         if (slave->probe_interval > POLL_PROBE_MAX)
+            slave->probe_interval = POLL_PROBE_MAX;
+      }
+      slave->probe_time = poll_time_now() + slave->probe_interval;
+      return;
+   }
+
+   /* Responses and exception responses are timed, frame errors are not */
+   if ((err != 0) && ((err <= MODBUS_ENOBASE) || (err >= MODBUS_ENOBASE + MODBUS_EXCEPTION_MAX)))
+      return;
+
+   if (slave->failures >= POLL_OFFLINE)
+      fprintf(stderr, "slave %d: back online\n", slave->slave_addr);
+   slave->failures = 0;
+
+   /* RFC 6298 with gains 1/8 and 1/4 */
+   if (slave->srtt == 0)
+   {
+      slave->srtt = rtt;
+      slave->rttvar = rtt/2;
+   }
+   else
+   {
+      delta = (rtt > slave->srtt) ? rtt - slave->srtt : slave->srtt - rtt;
+      slave->rttvar = (3*slave->rttvar + delta) / 4;
+      slave->srtt = (7*slave->srtt + rtt) / 8;
+   }
+
+   slave->timeout = slave_timeout(slave);
+
+   if (DEBUG)
+      printf("DBG: slave %d: rtt %llu us, srtt %llu us, rttvar %llu us, timeout %llu us\n",
+             slave->slave_addr, (unsigned long long)rtt, (unsigned long long)slave->srtt,
+             (unsigned long long)slave->rttvar, (unsigned long long)slave->timeout);
+}
+
+
+static int poll_req(modbus_t *mb, poll_req_t *req)
+{
+   modbus_set_slave(mb, req->slave_addr);
+
+   if (req->fc == MODBUS_FC_READ_HOLDING_REGISTERS)
+      return modbus_read_registers(mb, req->start_addr, req->num_reg, req->tab_reg);
+   else
+      return modbus_read_input_registers(mb, req->start_addr, req->num_reg, req->tab_reg);
+}
+
+
+static void poll_done(poll_table_t *table, poll_req_t *req, int rc, poll_output_t output)
+{
+   struct timespec ts;
+   uint64_t now;
+   int i;
+
+   if (DEBUG)
+      printf("DBG: polled slave %d, fc %d, addr %d, num %d: rc %d\n",
+             req->slave_addr, req->fc, req->start_addr, req->num_reg, rc);
+
+   /* Hand the result over to every job served by this request */
+   clock_gettime(CLOCK_REALTIME, &ts);
+   for (i=0; i<req->num_members; i++)
+   {
+      poll_job_t *job = &table->job[table->member[req->first_member+i]];
+
+      job->time = (uint64_t)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+      output(job, (rc == req->num_reg) ? job->num_reg : rc);
+   }
+
+   if (req->period == 0)
+   {
+      req->done = 1;
+      return;
+   }
+
+   /* Next deadline keeps the phase. A deadline which passed while
+      the bus was busy is reported, the request is sent late if it is
+      less than one period behind, whole cycles behind are skipped
+      and not queued up */
+   req->deadline += req->period;
+   now = poll_time_now();
+   if (req->deadline <= now)
+   {
+      uint64_t skipped = (now - req->deadline) / req->period;
+
+      req->deadline += skipped * req->period;
+      req->missed += skipped + 1;
+      fprintf(stderr, "slave %d: missed %llu poll deadline(s) for reg %d..%d, %llu skipped (%llu total)\n",
+              req->slave_addr, (unsigned long long)skipped + 1, req->start_addr,
+              req->start_addr + req->num_reg - 1, (unsigned long long)skipped,
+              (unsigned long long)req->missed);
+   }
+}
+
+
+static void poll_start(poll_table_t *table)
+{
+   uint64_t now;
+   int i;
+
+   poll_table_build(table);
+
+   /* All requests are due right away */
+   now = poll_time_now();
+   for (i=0; i<table->num_reqs; i++)
+   {
+      table->req[i].deadline = now;
+      table->req[i].done = 0;
+      table->req[i].busy = 0;
+   }
+}
+
+
+int poll_run(modbus_t *mb, poll_table_t *table, poll_output_t output)
+{
+   poll_req_t *req;
+   poll_slave_t *slave;
+   const mb_conn_t *conn;
+   mb_timing_t timing;
+   uint64_t silence = 0;
+   uint64_t timeout;
+   int i, rc, err;
+   int gap = 0;
+   int result = 0;
+
+   poll_start(table);
+
+   /* A serial bus stays silent for t3.5 after every transaction */
+   if (table->num_reqs > 0)
+   {
+      conn = &table->gateway[table->req[0].gateway].conn;
+      if ((conn->transport == MB_TRANSPORT_RTU) && (conn->baudrate > 0))
+      {
+         mb_rtu_timing(conn, &timing);
+         gap = timing.t35;
+
+         /* Request of 8 bytes between the RTS delays, response of
+            5 bytes and the registers */
+         for (i=0; i<table->num_reqs; i++)
+            table->req[i].wire = (uint64_t)(13 + 2*table->req[i].num_reg)*timing.char_time +
+                                 2*timing.rts_delay;
+      }
+   }
+
+   while (!stopped)
+   {
+      /* Earliest deadline first, ties go to the request built first */
+      req = NULL;
+      for (i=0; i<table->num_reqs; i++)
+      {
+         if (table->req[i].done)
+            continue;
+         if ((req == NULL) || (table->req[i].deadline < req->deadline))
+            req = &table->req[i];
+      }
+
+      /* Only one-shot requests left and all of them sent */
+      if (req == NULL)
+         break;
+
+      /* Bus stays idle until the next request is due */
+      poll_sleep_until((req->deadline > silence) ? req->deadline : silence);
+      if (stopped)
+         break;
+
+      /* Offline slaves don't take bus time until the next probe */
+      slave = &table->slave[req->slave];
+      if (slave_skip(slave, poll_time_now()))
+      {
+         errno = EHOSTDOWN;
+         result = -1;
+         poll_done(table, req, -1, output);
+         continue;
+      }
+
+      timeout = slave->timeout + req->wire;
+      modbus_set_response_timeout(mb, timeout/1000000, timeout%1000000);
+      req->sent = poll_time_now();
+      rc = poll_req(mb, req);
+      err = (rc == req->num_reg) ? 0 : errno;
+      silence = poll_time_now() + gap;
+      slave_update(slave, req, poll_time_now() - req->sent, err);
+      if (rc != req->num_reg)
+         result = -1;
+
+      errno = err;
+      poll_done(table, req, rc, output);
+   }
+
+   return result;
+}
+
+
+/* Scheduler state used by the TCP engine completion callback */
+static poll_table_t *tcp_table;
+static poll_output_t tcp_output;
+static int tcp_result;
+
+
+static void tcp_done(void *user, const uint8_t *rsp, int rsp_length, int err)
+{
+   poll_req_t *req = user;
+   int i, rc = req->num_reg;
+
+   /* Read response: function code, byte count, register values */
+   if ((err == 0) && ((rsp_length != 2 + 2*req->num_reg) || (rsp[1] != 2*req->num_reg)))
+      err = EMBBADDATA;
+
+   if (err == 0)
+   {
+      for (i=0; i<req->num_reg; i++)
+         req->tab_reg[i] = (uint16_t)rsp[2+2*i]<<8 | rsp[3+2*i];
+   }
+   else
+   {
+      rc = -1;
+      tcp_result = -1;
+   }
+
+   req->busy = 0;
+   slave_update(&tcp_table->slave[req->slave], req, poll_time_now() - req->sent, err);
+   errno = err;
+   poll_done(tcp_table, req, rc, tcp_output);
+}
+
+
+int poll_run_tcp(poll_table_t *table, poll_output_t output)
+{
+   static mbtcp_t gw[POLL_MAX_GATEWAYS];
+   poll_req_t *req;
+   poll_slave_t *slave;
+   uint8_t pdu[5];
+   uint64_t now, next;
+   int i, active;
+
+   tcp_table = table;
+   tcp_output = output;
+   tcp_result = 0;
+
+   for (i=0; i<table->num_gateways; i++)
+   {
+      if (mbtcp_init(&gw[i], table->gateway[i].conn.host, table->gateway[i].conn.port, 
+                     table->gateway[i].window) != 0)
+      {
+         printf("Unable to resolve gateway %s: %s\n", table->gateway[i].conn.host, strerror(errno));
+         while (i-- > 0)
+            mbtcp_close(&gw[i], NULL);
+         return -1;
+      }
+   }
+
+   poll_start(table);
+
+   while (!stopped)
+   {
+      /* Send due requests, earliest deadline first, while the
+         gateway of the request has room in its window */
+      do
+      {
+         now = poll_time_now();
+         req = NULL;
+         for (i=0; i<table->num_reqs; i++)
+         {
+            poll_req_t *r = &table->req[i];
+
+            if (r->done || r->busy || (r->deadline > now) || 
+                (mbtcp_free_slots(&gw[r->gateway]) == 0))
+               continue;
+            if ((req == NULL) || (r->deadline < req->deadline))
+               req = r;
+         }
+         if (req == NULL)
+            break;
+
+         /* Offline slaves get no requests until the next probe */
+         slave = &table->slave[req->slave];
+         if (slave_skip(slave, now))
+         {
+            errno = EHOSTDOWN;
+            tcp_result = -1;
+            poll_done(table, req, -1, output);
+            continue;
+         }
+
+         pdu[0] = req->fc;
+         pdu[1] = req->start_addr >> 8;
+         pdu[2] = req->start_addr & 0xFF;
+         pdu[3] = req->num_reg >> 8;
+         pdu[4] = req->num_reg & 0xFF;
+         req->busy = 1;
+         req->sent = now;
+         if (mbtcp_send(&gw[req->gateway], req->slave_addr, pdu, sizeof(pdu),
+                        slave->timeout, req) != 0)
+            tcp_done(req, NULL, 0, errno);
+      } while (!stopped);
+
+      /* Sleep until the next deadline or a response, requests 
+         waiting for room in a window are woken by a response */
+      next = UINT64_MAX;
+      active = 0;
+      for (i=0; i<table->num_reqs; i++)
+      {
+         poll_req_t *r = &table->req[i];
+
+         if (r->busy)
+            active = 1;
+         else if (!r->done && (r->deadline < next) && 
+                  (mbtcp_free_slots(&gw[r->gateway]) > 0))
+            next = r->deadline;
+      }
+
+      /* Only one-shot requests left and all of them answered */
+      if (!active && (next == UINT64_MAX))
+         break;
+
+      if (mbtcp_run(gw, table->num_gateways, next, tcp_done) == -1)
+      {
+         printf("Unable to wait for gateways: %s\n", strerror(errno));
+         tcp_result = -1;
+         break;
+      }
+   }
+
+   /* Requests still in flight are dropped */
+   for (i=0; i<table->num_gateways; i++)
+      mbtcp_close(&gw[i], NULL);
+
+   return tcp_result;
+}
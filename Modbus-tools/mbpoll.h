@@ -0,0 +1,147 @@
+/*****************************************************************
+ * Modbus master polling scheduler
+ *
+ * Author: Ondrej Wisniewski
+ *
+ * History:
+ * 14/10/2026: First release
+ * 14/10/2026: Stop on request
+ * 14/10/2026: Pipelined polling of Modbus TCP gateways
+ * 14/10/2026: Serial buses polled in parallel
+ * 14/10/2026: Adaptive per-slave response timeouts
+ * 14/10/2026: Transaction statistics per slave
+ * 14/10/2026: Device profiles
+ * 14/10/2026: Response timeouts from the slave turnaround
+ *
+ *****************************************************************/
+
+#ifndef MBPOLL_H
+#define MBPOLL_H
+
+#include <stdint.h>
+#include <modbus/modbus.h>
+#include "mbcommon.h"
+#include "mbtcp.h"
+#include "mbstats.h"
+#include "mbprofile.h"
+
+
+/* Maximum number of jobs in a poll table */
+#define POLL_MAX_JOBS   256
+
+/* Highest slave address, 255 is used by Modbus TCP gateways */
+#define POLL_MAX_SLAVE  255
+
+/* Maximum buses and gateways in a poll table, 0 is the connection of the tool */
+#define POLL_MAX_GATEWAYS  MBTCP_MAX_GATEWAYS
+
+/* Response timeout limits in us, the initial one is used until
+   the first response of a slave has been timed. They limit the
+   turnaround part, the wire time of a request comes on top */
+#define POLL_INIT_TIMEOUT  (MB_RSP_TIMEOUT*1000000ULL)
+#define POLL_MIN_TIMEOUT   20000
+#define POLL_MAX_TIMEOUT   (MB_RSP_TIMEOUT*1000000ULL)
+
+/* Consecutive timeouts after which a slave is offline, and the
+   probe interval of offline slaves in us */
+#define POLL_OFFLINE       3
+#define POLL_PROBE_MIN     1000000ULL
+#define POLL_PROBE_MAX     60000000ULL
+
+/* Poll job, one line of the poll table */
+typedef struct {
+   int id;                 /* index in the poll table as loaded, kept by
+                              poll_table_select() */
+   int gateway;            /* index into poll_table_t.gateway */
+   int slave_addr;
+   int fc;                 /* 0x03 or 0x04 */
+   int start_addr;
+   int num_reg;
+   uint64_t period;        /* poll period in us, 0 means poll once */
+   uint64_t time;          /* wall clock time of the last result in us */
+   uint16_t *tab_reg;      /* job registers inside the request buffer */
+   const mb_decoder_t *decoder;  /* of a device line, NULL if the registers are output */
+} poll_job_t;
+
+/* Bus request, serves one or more coalesced poll jobs */
+typedef struct {
+   int gateway;
+   int slave_addr;
+   int fc;
+   int start_addr;
+   int num_reg;
+   uint64_t period;
+   uint64_t deadline;      /* next due time in us (monotonic clock) */
+   int done;               /* set when a one-shot request has been sent */
+   int busy;               /* request in flight on a gateway */
+   uint64_t sent;          /* send time of the request in flight */
+   uint64_t wire;          /* us on a serial bus for request and response */
+   int slave;              /* index into poll_table_t.slave */
+   uint64_t missed;        /* number of missed deadlines */
+   int first_member;       /* jobs served, index into poll_table_t.member */
+   int num_members;
+   uint16_t tab_reg[MODBUS_MAX_READ_REGISTERS];
+} poll_req_t;
+
+/* Response timing of a slave, shared by all its requests. The
+   round trip time is taken without the wire time of the request,
+   i.e. it is the turnaround of the slave */
+typedef struct {
+   int gateway;
+   int slave_addr;
+   uint64_t srtt;          /* smoothed round trip time in us, 0 before the first sample */
+   uint64_t rttvar;        /* round trip time variation in us */
+   uint64_t timeout;       /* current response timeout in us, without the wire time */
+   int failures;           /* consecutive timeouts */
+   int probing;            /* probe of an offline slave in flight */
+   uint64_t probe_interval;
+   uint64_t probe_time;    /* next probe of an offline slave (monotonic clock) */
+   mb_stats_slave_t *stats;
+} poll_slave_t;
+
+/* Coalescing rule, applied per slave */
+typedef struct {
+   int max_gap;            /* max unpolled registers between merged jobs */
+   int max_num;            /* max registers per request, 0 disables merging */
+} poll_rule_t;
+
+/* Serial bus or Modbus TCP gateway */
+typedef struct {
+   mb_conn_t conn;
+   int window;             /* max requests in flight over TCP */
+} poll_gateway_t;
+
+/* Poll table */
+typedef struct {
+   int num_gateways;
+   poll_gateway_t gateway[POLL_MAX_GATEWAYS];
+   int num_jobs;
+   poll_job_t job[POLL_MAX_JOBS];
+   int num_reqs;
+   poll_req_t req[POLL_MAX_JOBS];
+   int member[POLL_MAX_JOBS];
+   int num_slaves;
+   poll_slave_t slave[POLL_MAX_JOBS];
+   poll_rule_t rule[POLL_MAX_SLAVE+1];
+} poll_table_t;
+
+/* Called after each poll with the result of the job */
+typedef void (*poll_output_t)(const poll_job_t *job, int rc);
+
+
+uint64_t poll_time_now(void);
+void poll_sleep_until(uint64_t t);
+void poll_stop(void);
+
+int poll_parse_period(const char *str, uint64_t unit, uint64_t *period);
+void poll_table_init(poll_table_t *table);
+int poll_table_load(poll_table_t *table, const char *filename);
+int poll_table_add(poll_table_t *table, int slave_addr, int fc,
+                   int start_addr, int num_reg, uint64_t period);
+int poll_set_rule(poll_table_t *table, int slave_addr, int max_gap, int max_num);
+void poll_table_select(poll_table_t *sub, const poll_table_t *table, int gateway);
+void poll_table_build(poll_table_t *table);
+int poll_run(modbus_t *mb, poll_table_t *table, poll_output_t output);
+int poll_run_tcp(poll_table_t *table, poll_output_t output);
+
+#endif
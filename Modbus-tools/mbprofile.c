@@ -0,0 +1,340 @@
+/*****************************************************************
+ * Device profiles of the Modbus master polling scheduler
+ *
+ * A profile describes the register layout of a device, so polled
+ * registers are output as engineering values instead of raw words.
+ * Profiles of common devices are compiled in, others are read from
+ * a profile file, one field per line:
+ *
+ *   <name> <fc> <addr> <type>[:<order>] [<scale> [<offset>]] [<unit>]
+ *
+ * The type is u16, s16, u32, s32 or f32 (IEEE 754 single), the byte
+ * order of 32 bit fields abcd (default, high word first), cdab, badc
+ * or dcba and of 16 bit fields ab (default) or ba. The value is the
+ * raw value times the scale (default 1) plus the offset (default 0).
+ * Names are letters, digits, '_', '-' and '.', they are output as
+ * given.
+ *
+ * The fields of one function code are compiled into a decoder for
+ * the block of registers from the first to the last field, one poll
+ * job. Every field is a decode step of the same computation, the
+ * type and byte order only select masks and shifts, so a block is
+ * decoded in one pass over the steps without a branch per field.
+ *
+ * Author: Ondrej Wisniewski
+ *
+ * History:
+ * 14/10/2026: First release
+ *
+ *****************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <modbus/modbus.h>
+#include "mbprofile.h"
+
+
+/* Maximum line length of a profile file */
+#define MAX_LINE      256
+
+/* Compiled in profiles */
+typedef struct {
+   const char *name;
+   int num_fields;
+   const mb_field_t *field;
+} builtin_t;
+
+/* T/H sensor PKTH100B, also sold under other names */
+static const mb_field_t pkth100b[] = {
+   { "temperature", 0x04, 0x0001, MB_FIELD_S16, MB_ORDER_ABCD, 0.1, 0, "C" },
+   { "humidity",    0x04, 0x0002, MB_FIELD_U16, MB_ORDER_ABCD, 0.1, 0, "%RH" },
+};
+
+/* Single phase energy meter Eastron SDM120 */
+static const mb_field_t sdm120[] = {
+   { "voltage",        0x04, 0x0000, MB_FIELD_F32, MB_ORDER_ABCD, 1, 0, "V" },
+   { "current",        0x04, 0x0006, MB_FIELD_F32, MB_ORDER_ABCD, 1, 0, "A" },
+   { "active_power",   0x04, 0x000C, MB_FIELD_F32, MB_ORDER_ABCD, 1, 0, "W" },
+   { "apparent_power", 0x04, 0x0012, MB_FIELD_F32, MB_ORDER_ABCD, 1, 0, "VA" },
+   { "power_factor",   0x04, 0x001E, MB_FIELD_F32, MB_ORDER_ABCD, 1, 0, "" },
+   { "frequency",      0x04, 0x0046, MB_FIELD_F32, MB_ORDER_ABCD, 1, 0, "Hz" },
+   { "import_energy",  0x04, 0x0048, MB_FIELD_F32, MB_ORDER_ABCD, 1, 0, "kWh" },
+   { "export_energy",  0x04, 0x004A, MB_FIELD_F32, MB_ORDER_ABCD, 1, 0, "kWh" },
+};
+
+static const builtin_t builtin[] = {
+   { "pkth100b", sizeof(pkth100b)/sizeof(pkth100b[0]), pkth100b },
+   { "sdm120",   sizeof(sdm120)/sizeof(sdm120[0]),     sdm120 },
+};
+
+static const char *type_name[] = { "u16", "s16", "u32", "s32", "f32" };
+static const char *order_name[] = { "abcd", "cdab", "badc", "dcba" };
+
+static mb_profile_t profile[MB_PROFILE_MAX];
+static int num_profiles;
+
+
+static int field_width(const mb_field_t *field)
+{
+   return (field->type >= MB_FIELD_U32) ? 2 : 1;
+}
+
+
+int mb_profile_digits(const mb_field_t *field)
+{
+   /* Significant digits of the raw value */
+   if (field->type == MB_FIELD_F32)
+      return 7;
+   return (field_width(field) == 2) ? 10 : 6;
+}
+
+
+static int parse_type(const char *str, mb_field_t *field)
+{
+   const char *order = strchr(str, ':');
+   int n = order ? order - str : (int)strlen(str);
+   int i;
+
+   for (i=0; i<(int)(sizeof(type_name)/sizeof(type_name[0])); i++)
+   {
+      if ((n == 3) && (strncmp(str, type_name[i], 3) == 0))
+         break;
+   }
+   if (i == (int)(sizeof(type_name)/sizeof(type_name[0])))
+      return -1;
+   field->type = i;
+   field->order = MB_ORDER_ABCD;
+   if (order == NULL)
+      return 0;
+
+   order++;
+   if (field_width(field) == 1)
+   {
+      /* Only the bytes of the word can be swapped */
+      if (strcmp(order, "ab") == 0)
+         return 0;
+      if (strcmp(order, "ba") != 0)
+         return -1;
+      field->order = MB_ORDER_BADC;
+      return 0;
+   }
+
+   for (i=0; i<(int)(sizeof(order_name)/sizeof(order_name[0])); i++)
+   {
+      if (strcmp(order, order_name[i]) == 0)
+      {
+         field->order = i;
+         return 0;
+      }
+   }
+
+   return -1;
+}
+
+
+static int parse_field(char *line, mb_field_t *field)
+{
+   char name[MB_PROFILE_NAME_LEN], type[16];
+   char *tok, *end;
+   int n, i;
+
+   memset(field, 0, sizeof(*field));
+   field->scale = 1;
+   if ((sscanf(line, "%31s %i %i %15s%n", name, &field->fc, &field->addr, type, &n) != 4) ||
+       (strspn(name, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_-.") != strlen(name)) ||
+       ((field->fc != MODBUS_FC_READ_HOLDING_REGISTERS) && (field->fc != MODBUS_FC_READ_INPUT_REGISTERS)) ||
+       (parse_type(type, field) != 0) ||
+       (field->addr < 0) || (field->addr + field_width(field) > 0x10000))
+      return -1;
+   strcpy(field->name, name);
+
+   /* Up to two numbers, then the unit */
+   for (i=0, tok=strtok(line+n, " \t\r\n"); tok != NULL; i++, tok=strtok(NULL, " \t\r\n"))
+   {
+      double val = strtod(tok, &end);
+
+      if ((i < 2) && (end > tok) && (*end == '\0') && (field->unit[0] == '\0'))
+      {
+         if (i == 0)
+            field->scale = val;
+         else
+            field->offset = val;
+      }
+      else if ((field->unit[0] == '\0') && (strlen(tok) < MB_PROFILE_UNIT_LEN))
+         strcpy(field->unit, tok);
+      else
+         return -1;
+   }
+
+   return 0;
+}
+
+
+static int load_profile(const char *filename, mb_profile_t *p)
+{
+   FILE *fp;
+   char line[MAX_LINE];
+   int line_num = 0;
+   int rc = 0;
+   char *c;
+
+   fp = fopen(filename, "r");
+   if (fp == NULL)
+   {
+      printf("Unable to open profile %s: %s\n", filename, strerror(errno));
+      return -1;
+   }
+
+   p->num_fields = 0;
+   while ((rc == 0) && (fgets(line, sizeof(line), fp) != NULL))
+   {
+      line_num++;
+
+      /* Strip comments */
+      if ((c = strchr(line, '#')) != NULL)
+         *c = '\0';
+      if (line[strspn(line, " \t\r\n")] == '\0')
+         continue;
+
+      if (p->num_fields == MB_PROFILE_MAX_FIELDS)
+      {
+         printf("%s:%d: too many fields (max %d)\n", filename, line_num, MB_PROFILE_MAX_FIELDS);
+         rc = -1;
+         break;
+      }
+      if (parse_field(line, &p->field[p->num_fields]) != 0)
+      {
+         printf("%s:%d: expected <name> <fc> <addr> u16|s16|u32|s32|f32[:<order>] [<scale> [<offset>]] [<unit>]\n",
+                filename, line_num);
+         rc = -1;
+         break;
+      }
+      p->num_fields++;
+   }
+
+   fclose(fp);
+
+   if ((rc == 0) && (p->num_fields == 0))
+   {
+      printf("%s: no fields found\n", filename);
+      rc = -1;
+   }
+
+   return rc;
+}
+
+
+const mb_profile_t* mb_profile_get(const char *name)
+{
+   mb_profile_t *p;
+   int i;
+
+   for (i=0; i<num_profiles; i++)
+   {
+      if (strcmp(profile[i].name, name) == 0)
+         return &profile[i];
+   }
+
+   if (num_profiles == MB_PROFILE_MAX)
+   {
+      printf("Too many device profiles (max %d)\n", MB_PROFILE_MAX);
+      return NULL;
+   }
+   if (strlen(name) >= sizeof(p->name))
+   {
+      printf("Profile name too long: %s\n", name);
+      return NULL;
+   }
+   p = &profile[num_profiles];
+   strcpy(p->name, name);
+
+   /* A compiled in profile, or else a profile file */
+   for (i=0; i<(int)(sizeof(builtin)/sizeof(builtin[0])); i++)
+   {
+      if (strcmp(builtin[i].name, name) == 0)
+      {
+         p->num_fields = builtin[i].num_fields;
+         memcpy(p->field, builtin[i].field, p->num_fields*sizeof(mb_field_t));
+         break;
+      }
+   }
+   if ((i == (int)(sizeof(builtin)/sizeof(builtin[0]))) && (load_profile(name, p) != 0))
+      return NULL;
+
+   num_profiles++;
+   return p;
+}
+
+
+int mb_profile_decoder(const mb_profile_t *p, int fc, mb_decoder_t **decoder)
+{
+   const mb_field_t *field;
+   mb_decoder_t *dec;
+   mb_step_t *s;
+   int first = 0x10000, last = -1;
+   int i, idx;
+
+   /* Block from the first to the last register of the fields */
+   *decoder = NULL;
+   for (i=0, field=p->field; i<p->num_fields; i++, field++)
+   {
+      if (field->fc != fc)
+         continue;
+      if (field->addr < first)
+         first = field->addr;
+      if (field->addr + field_width(field) - 1 > last)
+         last = field->addr + field_width(field) - 1;
+   }
+   if (last < 0)
+      return 0;
+   if (last - first + 1 > MODBUS_MAX_READ_REGISTERS)
+   {
+      printf("Profile %s: fields of fc %d span more than %d registers\n",
+             p->name, fc, MODBUS_MAX_READ_REGISTERS);
+      return -1;
+   }
+
+   dec = malloc(sizeof(mb_decoder_t));
+   if (dec == NULL)
+   {
+      printf("Unable to allocate decoder: %s\n", strerror(errno));
+      return -1;
+   }
+   dec->profile = p;
+   dec->start_addr = first;
+   dec->num_reg = last - first + 1;
+   dec->num_steps = 0;
+
+   for (i=0, field=p->field; i<p->num_fields; i++, field++)
+   {
+      if (field->fc != fc)
+         continue;
+
+      idx = field->addr - first;
+      s = &dec->step[dec->num_steps];
+      if (field_width(field) == 1)
+      {
+         s->hi = s->lo = idx;
+         s->hi_mask = 0;
+      }
+      else
+      {
+         /* Low word first in cdab and dcba */
+         s->hi = ((field->order == MB_ORDER_CDAB) || (field->order == MB_ORDER_DCBA)) ? idx+1 : idx;
+         s->lo = ((field->order == MB_ORDER_CDAB) || (field->order == MB_ORDER_DCBA)) ? idx : idx+1;
+         s->hi_mask = 0xFFFF;
+      }
+      s->swap = ((field->order == MB_ORDER_BADC) || (field->order == MB_ORDER_DCBA)) ? 0xFFFF : 0;
+      s->shift = (field->type == MB_FIELD_S16) ? 16 : 0;
+      s->is_signed = ((field->type == MB_FIELD_S16) || (field->type == MB_FIELD_S32)) ? -1 : 0;
+      s->is_float = (field->type == MB_FIELD_F32) ? ~0ULL : 0;
+      s->scale = field->scale;
+      s->offset = field->offset;
+      dec->field[dec->num_steps++] = field;
+   }
+
+   *decoder = dec;
+   return 0;
+}
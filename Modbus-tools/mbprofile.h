@@ -0,0 +1,128 @@
+/*****************************************************************
+ * Device profiles of the Modbus master polling scheduler
+ *
+ * Author: Ondrej Wisniewski
+ *
+ * History:
+ * 14/10/2026: First release
+ *
+ *****************************************************************/
+
+#ifndef MBPROFILE_H
+#define MBPROFILE_H
+
+#include <stdint.h>
+#include <string.h>
+
+
+/* Profiles loaded at the same time, and their size */
+#define MB_PROFILE_MAX        16
+#define MB_PROFILE_MAX_FIELDS 64
+#define MB_PROFILE_NAME_LEN   32
+#define MB_PROFILE_UNIT_LEN   16
+
+/* Field types */
+#define MB_FIELD_U16   0
+#define MB_FIELD_S16   1
+#define MB_FIELD_U32   2
+#define MB_FIELD_S32   3
+#define MB_FIELD_F32   4
+
+/* Byte order of a field, a is the most significant byte. 16 bit
+   fields are ab (default) or ba */
+#define MB_ORDER_ABCD  0       /* high word first, big endian bytes */
+#define MB_ORDER_CDAB  1       /* low word first */
+#define MB_ORDER_BADC  2       /* high word first, bytes of each word swapped */
+#define MB_ORDER_DCBA  3       /* low word first, bytes swapped */
+
+/* Field of a device profile, value = raw * scale + offset */
+typedef struct {
+   char name[MB_PROFILE_NAME_LEN];
+   int fc;                 /* 0x03 or 0x04 */
+   int addr;
+   int type;
+   int order;
+   double scale;
+   double offset;
+   char unit[MB_PROFILE_UNIT_LEN];
+} mb_field_t;
+
+typedef struct {
+   char name[64];
+   int num_fields;
+   mb_field_t field[MB_PROFILE_MAX_FIELDS];
+} mb_profile_t;
+
+/* Decode step of a field, all types take the same computation, see
+   mb_decode() */
+typedef struct {
+   uint16_t hi;            /* register index of the high and low word */
+   uint16_t lo;
+   uint16_t hi_mask;       /* 0 for 16 bit fields */
+   uint16_t swap;          /* 0xFFFF swaps the bytes of each word */
+   int32_t shift;          /* 16 sign extends a 16 bit field */
+   int32_t is_signed;      /* all bits set for signed integers */
+   uint64_t is_float;      /* all bits set for floats */
+   double scale;
+   double offset;
+} mb_step_t;
+
+/* Decoder of the fields of one function code of a profile, for the
+   block of registers of a poll job */
+typedef struct {
+   const mb_profile_t *profile;
+   int start_addr;
+   int num_reg;
+   int num_steps;
+   mb_step_t step[MB_PROFILE_MAX_FIELDS];
+   const mb_field_t *field[MB_PROFILE_MAX_FIELDS];
+} mb_decoder_t;
+
+
+const mb_profile_t* mb_profile_get(const char *name);
+int mb_profile_decoder(const mb_profile_t *profile, int fc, mb_decoder_t **decoder);
+int mb_profile_digits(const mb_field_t *field);
+
+
+static inline uint16_t mb_swap_bytes(uint16_t w, uint16_t swap)
+{
+   return w ^ ((w ^ (uint16_t)((w << 8) | (w >> 8))) & swap);
+}
+
+
+/* Decode a block of registers into the values of all fields. Types
+   and byte orders are selected by masks instead of branches, so the
+   loop runs the same way for every field */
+static inline void mb_decode(const mb_decoder_t *dec, const uint16_t *reg, double *value)
+{
+   const mb_step_t *s = dec->step;
+   uint32_t raw;
+   int64_t ival;
+   uint64_t ibits, fbits;
+   double di, df;
+   float f;
+   int i;
+
+   for (i=0; i<dec->num_steps; i++, s++)
+   {
+      raw = ((uint32_t)(mb_swap_bytes(reg[s->hi], s->swap) & s->hi_mask) << 16) |
+            mb_swap_bytes(reg[s->lo], s->swap);
+
+      /* Signed integers are sign extended from their width */
+      ival = (int64_t)raw & ~(int64_t)s->is_signed;
+      ival |= (int64_t)((int32_t)(raw << s->shift) >> s->shift) & (int64_t)s->is_signed;
+      di = (double)ival;
+
+      memcpy(&f, &raw, sizeof(f));
+      df = f;
+
+      memcpy(&ibits, &di, sizeof(ibits));
+      memcpy(&fbits, &df, sizeof(fbits));
+      ibits = (ibits & ~s->is_float) | (fbits & s->is_float);
+      memcpy(&di, &ibits, sizeof(di));
+
+      value[i] = di*s->scale + s->offset;
+   }
+}
+
+#endif
@@ -0,0 +1,100 @@
+/*****************************************************************
+ * Poll result queue between polling workers and the output
+ *
+ * Bounded lock-free queue with many producers and one consumer.
+ * Each polling worker pushes its results with mb_queue_push(),
+ * which has the signature of a poll output function, and the
+ * output thread hands them to the real output with mb_queue_pop().
+ *
+ * Every cell has a sequence number. A producer claims the cell at
+ * the enqueue position with compare-and-swap on that position when
+ * the cell's sequence equals the position, fills it and publishes
+ * it by setting the sequence to position + 1. The consumer takes
+ * the cell once its sequence is position + 1 and frees it for the
+ * next round by setting it to position + MB_QUEUE_SIZE. A full
+ * queue makes producers wait, so no result is lost.
+ *
+ * Author: Ondrej Wisniewski
+ *
+ * History:
+ * 14/10/2026: First release
+ *
+ *****************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include "mbqueue.h"
+
+
+static mb_queue_cell_t cell[MB_QUEUE_SIZE];
+static uint64_t head;              /* next enqueue position, shared by producers */
+static uint64_t tail;              /* next dequeue position, consumer only */
+
+
+void mb_queue_init(void)
+{
+   int i;
+
+   for (i=0; i<MB_QUEUE_SIZE; i++)
+      cell[i].seq = i;
+   head = 0;
+   tail = 0;
+}
+
+
+void mb_queue_push(const poll_job_t *job, int rc)
+{
+   mb_queue_cell_t *c;
+   uint64_t pos, seq;
+   int err = errno;
+
+   pos = __atomic_load_n(&head, __ATOMIC_RELAXED);
+   while (1)
+   {
+      c = &cell[pos & (MB_QUEUE_SIZE-1)];
+      seq = __atomic_load_n(&c->seq, __ATOMIC_ACQUIRE);
+      if (seq == pos)
+      {
+         /* Cell is free, claim it unless another producer was first */
+         if (__atomic_compare_exchange_n(&head, &pos, pos+1, 1,
+                                         __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            break;
+      }
+      else
+      {
+         /* Queue is full, wait for the consumer */
+         if (seq < pos)
+            sched_yield();
+         pos = __atomic_load_n(&head, __ATOMIC_RELAXED);
+      }
+   }
+
+   c->job = *job;
+   c->rc  = rc;
+   c->err = err;
+   if (rc == job->num_reg)
+      memcpy(c->reg, job->tab_reg, job->num_reg*sizeof(uint16_t));
+   __atomic_store_n(&c->seq, pos+1, __ATOMIC_RELEASE);
+}
+
+
+int mb_queue_pop(poll_output_t output)
+{
+   mb_queue_cell_t *c = &cell[tail & (MB_QUEUE_SIZE-1)];
+
+   if (__atomic_load_n(&c->seq, __ATOMIC_ACQUIRE) != tail+1)
+      return 0;
+
+   /* Results point into the cell while the output runs */
+   c->job.tab_reg = c->reg;
+   errno = c->err;
+   output(&c->job, c->rc);
+
+   __atomic_store_n(&c->seq, tail + MB_QUEUE_SIZE, __ATOMIC_RELEASE);
+   tail++;
+
+   return 1;
+}
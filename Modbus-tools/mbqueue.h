@@ -0,0 +1,36 @@
+/*****************************************************************
+ * Poll result queue between polling workers and the output
+ *
+ * Author: Ondrej Wisniewski
+ *
+ * History:
+ * 14/10/2026: First release
+ *
+ *****************************************************************/
+
+#ifndef MBQUEUE_H
+#define MBQUEUE_H
+
+#include <stdint.h>
+#include <modbus/modbus.h>
+#include "mbpoll.h"
+
+
+/* Queue size in results, a power of two */
+#define MB_QUEUE_SIZE   1024
+
+/* Queued poll result */
+typedef struct {
+   uint64_t seq;           /* cell sequence number, see mbqueue.c */
+   poll_job_t job;
+   int rc;
+   int err;                /* errno of a failed poll */
+   uint16_t reg[MODBUS_MAX_READ_REGISTERS];
+} mb_queue_cell_t;
+
+
+void mb_queue_init(void);
+void mb_queue_push(const poll_job_t *job, int rc);
+int mb_queue_pop(poll_output_t output);
+
+#endif
@@ -0,0 +1,225 @@
+/*****************************************************************
+ * Raw Modbus RTU frames of the configuration tools
+ *
+ * The configuration tools talk to devices outside of what the
+ * libmodbus API covers: the reserved address 255 of the BQTEK
+ * relay cards and the non standard extension of the "Write Single
+ * register" request of the PKTH100B T/H sensor. Requests are built
+ * into a buffer of the caller and sent with libmodbus, which adds
+ * the CRC. Responses are not copied: a frame view points into the
+ * receive buffer and every access is checked against the received
+ * length, so a short or garbled response reads as -1 instead of
+ * stale buffer contents.
+ *
+ * mb_frame_check() makes sure a response belongs to the request:
+ * same slave address and function code, the byte count of a read
+ * matching the registers asked for, a write echoing the request.
+ * Exception responses fail with errno set to the exception like
+ * libmodbus does.
+ *
+ * Author: Ondrej Wisniewski
+ *
+ * History:
+ * 14/10/2026: First release
+ *
+ *****************************************************************/
+
+#include <string.h>
+#include <errno.h>
+#include "mbraw.h"
+
+
+/* RTU frame: slave address, function code, data, CRC */
+#define RTU_CRC_LENGTH   2
+
+
+int mb_raw_read(uint8_t *req, int addr, int fc, int start_addr, int num_reg)
+{
+   req[0] = addr;
+   req[1] = fc;
+   req[2] = start_addr >> 8;
+   req[3] = start_addr & 0xFF;
+   req[4] = num_reg >> 8;
+   req[5] = num_reg & 0xFF;
+
+   return 6;
+}
+
+
+int mb_raw_write(uint8_t *req, int addr, int reg_addr, int reg_val)
+{
+   req[0] = addr;
+   req[1] = MODBUS_FC_WRITE_SINGLE_REGISTER;
+   req[2] = reg_addr >> 8;
+   req[3] = reg_addr & 0xFF;
+   req[4] = reg_val >> 8;
+   req[5] = reg_val & 0xFF;
+
+   return 6;
+}
+
+
+uint8_t mb_raw_th_baudrate(int baudrate)
+{
+   switch (baudrate)
+   {
+      case 1200:  return 3;
+      case 2400:  return 4;
+      case 4800:  return 5;
+      case 9600:  return 6;
+      case 19200: return 7;
+      default:    return 0;
+   }
+}
+
+
+int mb_raw_th_settings(uint8_t *req, int addr, int new_addr, int new_baudrate)
+{
+   uint8_t code = mb_raw_th_baudrate(new_baudrate);
+
+   if (code == 0)
+   {
+      errno = EINVAL;
+      return -1;
+   }
+
+   /* Write 1 to register 0, followed by 2 non standard data bytes */
+   mb_raw_write(req, addr, 0x0000, 0x0001);
+   req[6] = 2;
+   req[7] = new_addr;
+   req[8] = code;
+
+   return MB_RAW_TH_REQ_LEN;
+}
+
+
+int mb_raw_relay_read(uint8_t *req, int reg_addr)
+{
+   return mb_raw_read(req, MB_RAW_RELAY_ADDR, MODBUS_FC_READ_HOLDING_REGISTERS, reg_addr, 1);
+}
+
+
+int mb_raw_relay_write(uint8_t *req, int reg_addr, int reg_val)
+{
+   return mb_raw_write(req, MB_RAW_RELAY_ADDR, reg_addr, reg_val);
+}
+
+
+int mb_frame_view(mb_frame_t *frame, const uint8_t *rsp, int rsp_length)
+{
+   frame->adu = rsp;
+   frame->length = rsp_length - RTU_CRC_LENGTH;
+
+   /* At least slave address and function code */
+   if (frame->length < 2)
+   {
+      frame->length = 0;
+      if (rsp_length >= 0)
+         errno = EMBBADDATA;
+      return -1;
+   }
+
+   return 0;
+}
+
+
+int mb_frame_u8(const mb_frame_t *frame, int offset)
+{
+   if ((offset < 0) || (offset >= frame->length))
+      return -1;
+
+   return frame->adu[offset];
+}
+
+
+int mb_frame_u16(const mb_frame_t *frame, int offset)
+{
+   if ((offset < 0) || (offset+1 >= frame->length))
+      return -1;
+
+   return (int)frame->adu[offset]<<8 | frame->adu[offset+1];
+}
+
+
+int mb_frame_reg(const mb_frame_t *frame, int i)
+{
+   /* Read response: address, function code, byte count, values */
+   if ((i < 0) || (2*i+1 >= mb_frame_u8(frame, 2)))
+      return -1;
+
+   return mb_frame_u16(frame, 3 + 2*i);
+}
+
+
+int mb_frame_check(const mb_frame_t *frame, const uint8_t *req, int req_length)
+{
+   int fc = mb_frame_u8(frame, 1);
+
+   if (mb_frame_u8(frame, 0) != req[0])
+   {
+      errno = EMBBADSLAVE;
+      return -1;
+   }
+
+   if (fc == (req[1] | 0x80))
+   {
+      errno = (frame->length == 3) ? MODBUS_ENOBASE + frame->adu[2] : EMBBADDATA;
+      return -1;
+   }
+
+   if (fc != req[1])
+   {
+      errno = EMBBADDATA;
+      return -1;
+   }
+
+   switch (fc)
+   {
+      case MODBUS_FC_READ_HOLDING_REGISTERS:
+      case MODBUS_FC_READ_INPUT_REGISTERS:
+      {
+         int num_reg = (int)req[4]<<8 | req[5];
+
+         /* Byte count of the registers asked for */
+         if ((mb_frame_u8(frame, 2) != 2*num_reg) || (frame->length != 3 + 2*num_reg))
+         {
+            errno = EMBBADDATA;
+            return -1;
+         }
+         break;
+      }
+
+      case MODBUS_FC_WRITE_SINGLE_REGISTER:
+         /* Echo of address and value, also of the extended request */
+         if ((frame->length != 6) || (req_length < 6) || (memcmp(frame->adu, req, 6) != 0))
+         {
+            errno = EMBBADDATA;
+            return -1;
+         }
+         break;
+
+      default:;
+   }
+
+   return 0;
+}
+
+
+int mb_raw_transact(modbus_t *mb, const uint8_t *req, int req_length,
+                    uint8_t *rsp, mb_frame_t *frame)
+{
+   int rc;
+
+   rc = modbus_send_raw_request(mb, req, req_length);
+   if (rc == -1)
+   {
+      mb_frame_view(frame, rsp, -1);
+      return -1;
+   }
+
+   rc = modbus_receive_confirmation(mb, rsp);
+   if (mb_frame_view(frame, rsp, rc) != 0)
+      return -1;
+
+   return mb_frame_check(frame, req, req_length);
+}
@@ -0,0 +1,56 @@
+/*****************************************************************
+ * Raw Modbus RTU frames of the configuration tools
+ *
+ * Author: Ondrej Wisniewski
+ *
+ * History:
+ * 14/10/2026: First release
+ *
+ *****************************************************************/
+
+#ifndef MBRAW_H
+#define MBRAW_H
+
+#include <stdint.h>
+#include <modbus/modbus.h>
+
+
+/* Request buffer size, the longest request built here */
+#define MB_RAW_REQ_SIZE     16
+
+/* Receive buffer size required by libmodbus */
+#define MB_RAW_RSP_SIZE     MODBUS_TCP_MAX_ADU_LENGTH
+
+/* Reserved address of the BQTEK relay cards in "Settings Mode" */
+#define MB_RAW_RELAY_ADDR   0xFF
+
+/* Length of the PKTH100B settings request and of its response */
+#define MB_RAW_TH_REQ_LEN   9
+#define MB_RAW_TH_RSP_LEN   6
+
+/* Received RTU frame, a view into the receive buffer */
+typedef struct {
+   const uint8_t *adu;     /* slave address onwards */
+   int length;             /* without the CRC */
+} mb_frame_t;
+
+
+/* Request builders, return the request length without the CRC */
+int mb_raw_read(uint8_t *req, int addr, int fc, int start_addr, int num_reg);
+int mb_raw_write(uint8_t *req, int addr, int reg_addr, int reg_val);
+int mb_raw_th_settings(uint8_t *req, int addr, int new_addr, int new_baudrate);
+int mb_raw_relay_read(uint8_t *req, int reg_addr);
+int mb_raw_relay_write(uint8_t *req, int reg_addr, int reg_val);
+uint8_t mb_raw_th_baudrate(int baudrate);
+
+/* Bounds checked access, -1 beyond the end of the frame */
+int mb_frame_view(mb_frame_t *frame, const uint8_t *rsp, int rsp_length);
+int mb_frame_u8(const mb_frame_t *frame, int offset);
+int mb_frame_u16(const mb_frame_t *frame, int offset);
+int mb_frame_reg(const mb_frame_t *frame, int i);
+int mb_frame_check(const mb_frame_t *frame, const uint8_t *req, int req_length);
+
+int mb_raw_transact(modbus_t *mb, const uint8_t *req, int req_length,
+                    uint8_t *rsp, mb_frame_t *frame);
+
+#endif
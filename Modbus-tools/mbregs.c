@@ -0,0 +1,612 @@
+/*****************************************************************
+ * Sparse Modbus register store
+ *
+ * Holds coils, discrete inputs, input and holding registers of one
+ * device over the full 16-bit address space of each type. The
+ * address space is split into blocks of 256 addresses, a block is
+ * only allocated when part of it is mapped, so the memory used
+ * grows with the mapped ranges and not with the address space.
+ * Reading or writing a contiguous range is one memcpy per block.
+ *
+ * The store is a single piece of memory: a header with a directory
+ * of block indices per type followed by the block arena. It can be
+ * placed in a POSIX shared memory segment, where local producer
+ * processes attach with mb_regs_shm_open() and update values with
+ * mb_regs_put() without any system call.
+ *
+ * A store can also be a memory mapped file, which keeps the values
+ * over a restart. The file is used as it is if it holds a store of
+ * the same layout, otherwise it is initialised from the layout. The
+ * values are written back by the kernel, and by mb_regs_file_sync()
+ * for a known point of durability; writes are memory stores only.
+ *
+ * Each block has a sequence counter, which is odd while the block
+ * is written. Writers take the block by incrementing an even counter
+ * with compare-and-swap and release it by incrementing it again.
+ * Readers copy the block and retry if the counter was odd or has
+ * changed meanwhile, so a reader never blocks a writer and always
+ * sees a consistent block. Values which must be read together, e.g.
+ * 32-bit values, must not cross a 256-address block boundary.
+ *
+ * The pid of the writer is kept next to an odd counter. A reader or
+ * writer which finds a block held for longer than a few spins sleeps
+ * between its retries, checks if the writer still exists and
+ * releases the block of a dead writer, and gives up after
+ * MB_REGS_MAX_WAIT us. A store in shared memory is never
+ * reinitialised in place: a new store replaces the segment, the old
+ * one is marked retired, so producers which still have it mapped see
+ * that they must attach again.
+ *
+ * Register map file format, one address range per line:
+ *
+ *   # type     start_addr  num
+ *     holding  0           32
+ *     input    30000       16
+ *     coil     0x100       8
+ *     discrete 0           8
+ *
+ * Addresses are protocol addresses (0-65535), as sent on the bus.
+ *
+ * Author: Ondrej Wisniewski
+ *
+ * History:
+ * 14/10/2026: First release
+ * 14/10/2026: Shared memory stores with per-block sequence counters
+ * 14/10/2026: Stores in memory mapped files which survive a restart
+ * 14/10/2026: Bounded waits for blocks, recovery from dead writers
+ * 14/10/2026: Wait limit on the monotonic clock instead of a sleep count
+ * 14/10/2026: Type names of a register map must match as a whole
+ *
+ *****************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "mbcommon.h"
+#include "mbregs.h"
+
+
+#define MAX_LINE  256
+
+/* Size in bytes of one value of a register type */
+#define VAL_SIZE(type)  (((type) < MB_REGS_INPUT) ? 1 : 2)
+
+/* Pid of the writer of a block with an odd counter, see mb_block_t */
+#define SEQ_COUNT(seq)  ((uint32_t)(seq))
+#define SEQ_PID(seq)    ((pid_t)((seq) >> 32))
+
+static const char *type_name[MB_REGS_TYPES] = { "coil", "discrete", "input", "holding" };
+
+/* Pid of this process, kept so a write takes no system call */
+static pid_t own_pid;
+
+
+size_t mb_regs_size(int num_blocks)
+{
+   return sizeof(mb_regs_t) + (size_t)num_blocks * sizeof(mb_block_t);
+}
+
+
+int mb_regs_blocks(const mb_regs_range_t *range, int num_ranges)
+{
+   uint8_t used[MB_REGS_TYPES][MB_REGS_DIR_SIZE];
+   int i, b, n=0;
+
+   /* Count the distinct blocks touched by all ranges */
+   memset(used, 0, sizeof(used));
+   for (i=0; i<num_ranges; i++)
+   {
+      for (b = range[i].start_addr / MB_REGS_BLOCK;
+           b <= (range[i].start_addr + range[i].num - 1) / MB_REGS_BLOCK; b++)
+      {
+         if (!used[range[i].type][b])
+            n++;
+         used[range[i].type][b] = 1;
+      }
+   }
+
+   return n;
+}
+
+
+void mb_regs_init(mb_regs_t *regs, int num_blocks)
+{
+   own_pid = getpid();
+   memset(regs, 0, mb_regs_size(num_blocks));
+   regs->magic = MB_REGS_MAGIC;
+   regs->num_blocks = num_blocks;
+}
+
+
+static void map_ranges(mb_regs_t *regs, const mb_regs_range_t *range, int num_ranges)
+{
+   int i;
+
+   for (i=0; i<num_ranges; i++)
+      mb_regs_map(regs, range[i].type, range[i].start_addr, range[i].num);
+}
+
+
+mb_regs_t* mb_regs_new(const mb_regs_range_t *range, int num_ranges)
+{
+   mb_regs_t *regs;
+   int num_blocks = mb_regs_blocks(range, num_ranges);
+
+   regs = malloc(mb_regs_size(num_blocks));
+   if (regs == NULL)
+      return NULL;
+
+   mb_regs_init(regs, num_blocks);
+   map_ranges(regs, range, num_ranges);
+
+   return regs;
+}
+
+
+void mb_regs_free(mb_regs_t *regs)
+{
+   free(regs);
+}
+
+
+mb_regs_t* mb_regs_shm_new(const char *name, const mb_regs_range_t *range, int num_ranges)
+{
+   mb_regs_t *regs;
+   int num_blocks = mb_regs_blocks(range, num_ranges);
+   size_t size = mb_regs_size(num_blocks);
+   struct stat st;
+   mb_regs_t *old;
+   int fd;
+
+   /* A segment left over by a previous run may still be mapped by
+      producers, it is retired and replaced instead of truncated */
+   fd = shm_open(name, O_RDWR, 0);
+   if (fd != -1)
+   {
+      if ((fstat(fd, &st) == 0) && (st.st_size >= (off_t)sizeof(mb_regs_t)))
+      {
+         old = mmap(NULL, sizeof(mb_regs_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+         if (old != MAP_FAILED)
+         {
+            __atomic_store_n(&old->magic, MB_REGS_RETIRED, __ATOMIC_RELEASE);
+            munmap(old, sizeof(mb_regs_t));
+         }
+      }
+      close(fd);
+      shm_unlink(name);
+   }
+
+   fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0660);
+   if (fd == -1)
+   {
+      mb_log(LOG_ERR, "Unable to create shared memory %s: %s\n", name, strerror(errno));
+      return NULL;
+   }
+   if (ftruncate(fd, size) == -1)
+   {
+      mb_log(LOG_ERR, "Unable to size shared memory %s: %s\n", name, strerror(errno));
+      close(fd);
+      shm_unlink(name);
+      return NULL;
+   }
+
+   regs = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+   close(fd);
+   if (regs == MAP_FAILED)
+   {
+      mb_log(LOG_ERR, "Unable to map shared memory %s: %s\n", name, strerror(errno));
+      shm_unlink(name);
+      return NULL;
+   }
+
+   /* Producers check the magic number, so it is set last */
+   mb_regs_init(regs, num_blocks);
+   regs->magic = 0;
+   map_ranges(regs, range, num_ranges);
+   __atomic_store_n(&regs->magic, MB_REGS_MAGIC, __ATOMIC_RELEASE);
+
+   return regs;
+}
+
+
+mb_regs_t* mb_regs_shm_open(const char *name)
+{
+   mb_regs_t *regs;
+   struct stat st;
+   int fd;
+
+   fd = shm_open(name, O_RDWR, 0);
+   if (fd == -1)
+   {
+      mb_log(LOG_ERR, "Unable to open shared memory %s: %s\n", name, strerror(errno));
+      return NULL;
+   }
+   if ((fstat(fd, &st) == -1) || (st.st_size < (off_t)sizeof(mb_regs_t)))
+   {
+      mb_log(LOG_ERR, "Shared memory %s is not a register store\n", name);
+      close(fd);
+      return NULL;
+   }
+
+   regs = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+   close(fd);
+   if (regs == MAP_FAILED)
+   {
+      mb_log(LOG_ERR, "Unable to map shared memory %s: %s\n", name, strerror(errno));
+      return NULL;
+   }
+
+   if ((__atomic_load_n(&regs->magic, __ATOMIC_ACQUIRE) != MB_REGS_MAGIC) ||
+       (mb_regs_size(regs->num_blocks) > (size_t)st.st_size))
+   {
+      mb_log(LOG_ERR, "Shared memory %s is not a register store\n", name);
+      munmap(regs, st.st_size);
+      return NULL;
+   }
+
+   /* Also after a fork, the writer of a block is known by its pid */
+   own_pid = getpid();
+   return regs;
+}
+
+
+void mb_regs_shm_free(mb_regs_t *regs, const char *name)
+{
+   if (regs == NULL)
+      return;
+
+   /* Only the creator passes the name to remove the segment, producers
+      which still have it mapped see it retired */
+   if (name != NULL)
+   {
+      __atomic_store_n(&regs->magic, MB_REGS_RETIRED, __ATOMIC_RELEASE);
+      shm_unlink(name);
+   }
+   munmap(regs, mb_regs_size(regs->num_blocks));
+}
+
+
+static int same_layout(const mb_regs_t *regs, const mb_regs_t *layout)
+{
+   uint32_t i;
+
+   if ((regs->magic != MB_REGS_MAGIC) || (regs->num_blocks != layout->num_blocks) ||
+       (regs->used_blocks != layout->used_blocks) ||
+       (memcmp(regs->dir, layout->dir, sizeof(regs->dir)) != 0))
+      return 0;
+
+   for (i=0; i<layout->used_blocks; i++)
+   {
+      if (memcmp(regs->block[i].mapped, layout->block[i].mapped, sizeof(layout->block[i].mapped)) != 0)
+         return 0;
+   }
+
+   return 1;
+}
+
+
+mb_regs_t* mb_regs_file_new(const char *filename, const mb_regs_t *layout)
+{
+   mb_regs_t *regs;
+   size_t size = mb_regs_size(layout->num_blocks);
+   struct stat st;
+   uint32_t i;
+   int fd, rc;
+
+   fd = open(filename, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+   if ((fd == -1) || (fstat(fd, &st) == -1))
+   {
+      mb_log(LOG_ERR, "Unable to open register file %s: %s\n", filename, strerror(errno));
+      if (fd != -1)
+         close(fd);
+      return NULL;
+   }
+
+   /* Allocate all blocks now, a full disk must not fault in the mapping */
+   if ((st.st_size != (off_t)size) && (ftruncate(fd, size) == -1))
+   {
+      mb_log(LOG_ERR, "Unable to size register file %s: %s\n", filename, strerror(errno));
+      close(fd);
+      return NULL;
+   }
+   rc = posix_fallocate(fd, 0, size);
+   if (rc != 0)
+   {
+      mb_log(LOG_ERR, "Unable to allocate register file %s: %s\n", filename, strerror(rc));
+      close(fd);
+      return NULL;
+   }
+
+   regs = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+   close(fd);
+   if (regs == MAP_FAILED)
+   {
+      mb_log(LOG_ERR, "Unable to map register file %s: %s\n", filename, strerror(errno));
+      return NULL;
+   }
+   own_pid = getpid();
+
+   if ((st.st_size == (off_t)size) && same_layout(regs, layout))
+   {
+      /* A writer may have stopped within a block */
+      for (i=0; i<regs->used_blocks; i++)
+         regs->block[i].seq = 0;
+      mb_log(LOG_INFO, "Registers restored from %s\n", filename);
+   }
+   else
+   {
+      if (st.st_size > 0)
+         mb_log(LOG_NOTICE, "Register file %s has another register map, registers cleared\n", filename);
+      memcpy(regs, layout, size);
+   }
+
+   return regs;
+}
+
+
+int mb_regs_file_sync(mb_regs_t *regs)
+{
+   /* Blocks until the dirty pages are on disk, not for the writers */
+   if (msync(regs, mb_regs_size(regs->num_blocks), MS_SYNC) != 0)
+   {
+      mb_log(LOG_ERR, "Unable to write back registers: %s\n", strerror(errno));
+      return -1;
+   }
+
+   return 0;
+}
+
+
+void mb_regs_file_free(mb_regs_t *regs)
+{
+   if (regs == NULL)
+      return;
+
+   mb_regs_file_sync(regs);
+   munmap(regs, mb_regs_size(regs->num_blocks));
+}
+
+
+int mb_regs_map(mb_regs_t *regs, int type, int start_addr, int num)
+{
+   int addr;
+
+   if ((type < 0) || (type >= MB_REGS_TYPES) || (start_addr < 0) ||
+       (num < 1) || (start_addr + num > 0x10000))
+      return -1;
+
+   for (addr=start_addr; addr<start_addr+num; addr++)
+   {
+      uint16_t *idx = &regs->dir[type][addr / MB_REGS_BLOCK];
+      int i = addr % MB_REGS_BLOCK;
+
+      /* Take the next free block from the arena */
+      if (*idx == 0)
+      {
+         if (regs->used_blocks == regs->num_blocks)
+            return -1;
+         *idx = ++regs->used_blocks;
+      }
+      regs->block[*idx-1].mapped[i/8] |= 1 << (i%8);
+   }
+
+   return 0;
+}
+
+
+void mb_regs_alias(mb_regs_t *regs, int type, int to_type)
+{
+   /* Both types are served from the same blocks from now on */
+   memcpy(regs->dir[type], regs->dir[to_type], sizeof(regs->dir[type]));
+}
+
+
+int mb_regs_load(const char *filename, mb_regs_range_t *range, int max_ranges)
+{
+   FILE *fp;
+   char line[MAX_LINE];
+   int line_num = 0;
+   int num_ranges = 0;
+
+   fp = fopen(filename, "r");
+   if (fp == NULL)
+   {
+      mb_log(LOG_ERR, "Unable to open register map %s: %s\n", filename, strerror(errno));
+      return -1;
+   }
+
+   while (fgets(line, sizeof(line), fp) != NULL)
+   {
+      char type[16];
+      char *p;
+      int t, n;
+
+      line_num++;
+
+      /* Strip comments and skip empty lines */
+      if ((p = strchr(line, '#')) != NULL)
+         *p = '\0';
+      if (line[strspn(line, " \t\r\n")] == '\0')
+         continue;
+
+      if (num_ranges == max_ranges)
+      {
+         mb_log(LOG_ERR, "%s:%d: too many ranges (max %d)\n", filename, line_num, max_ranges);
+         num_ranges = -1;
+         break;
+      }
+
+      n = sscanf(line, "%15s %i %i", type, &range[num_ranges].start_addr, &range[num_ranges].num);
+      for (t=0; t<MB_REGS_TYPES; t++)
+      {
+         size_t len = strlen(type_name[t]);
+
+         /* Plural type names are accepted as well, nothing else */
+         if ((strncmp(type, type_name[t], len) == 0) &&
+             ((type[len] == '\0') || ((type[len] == 's') && (type[len+1] == '\0'))))
+            break;
+      }
+      range[num_ranges].type = t;
+      if ((n != 3) || (t == MB_REGS_TYPES) || (range[num_ranges].start_addr < 0) ||
+          (range[num_ranges].num < 1) ||
+          (range[num_ranges].start_addr + range[num_ranges].num > 0x10000))
+      {
+         mb_log(LOG_ERR, "%s:%d: expected coil|discrete|input|holding <start_addr> <num>\n",
+                filename, line_num);
+         num_ranges = -1;
+         break;
+      }
+      num_ranges++;
+   }
+
+   fclose(fp);
+
+   if (num_ranges == 0)
+   {
+      mb_log(LOG_ERR, "%s: no register ranges found\n", filename);
+      return -1;
+   }
+
+   return num_ranges;
+}
+
+
+int mb_regs_check(const mb_regs_t *regs, int type, int start_addr, int num)
+{
+   int addr;
+
+   if ((start_addr < 0) || (num < 1) || (start_addr + num > 0x10000))
+      return -1;
+
+   for (addr=start_addr; addr<start_addr+num; addr++)
+   {
+      uint16_t idx = regs->dir[type][addr / MB_REGS_BLOCK];
+      int i = addr % MB_REGS_BLOCK;
+
+      if ((idx == 0) || !(regs->block[idx-1].mapped[i/8] & (1 << (i%8))))
+         return -1;
+   }
+
+   return 0;
+}
+
+
+static uint64_t now_us(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
+
+
+/* Wait until a block is not held by a writer, or release it if its
+   writer no longer exists. Returns the even counter, or -1 with errno
+   EBUSY after MB_REGS_MAX_WAIT us */
+static int wait_block(mb_block_t *block, uint64_t *seq)
+{
+   struct timespec step = { 0, MB_REGS_WAIT_STEP*1000 };
+   uint64_t deadline = 0;
+   int n;
+
+   for (n=0; SEQ_COUNT(*seq) & 1; n++)
+   {
+      /* Sleeps take longer than asked for, the limit is on the clock */
+      if (n == 0)
+         deadline = now_us() + MB_REGS_MAX_WAIT;
+      if (n >= MB_REGS_SPIN)
+      {
+         /* The writer is stale if it has gone, its values are kept as
+            they are and the counter moves on to the next even value */
+         if ((SEQ_PID(*seq) != 0) && (kill(SEQ_PID(*seq), 0) == -1) && (errno == ESRCH))
+         {
+            if (__atomic_compare_exchange_n(&block->seq, seq, (uint64_t)(SEQ_COUNT(*seq)+1), 0,
+                                            __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+               *seq = SEQ_COUNT(*seq)+1;
+            continue;
+         }
+         if (now_us() >= deadline)
+         {
+            errno = EBUSY;
+            return -1;
+         }
+         /* Sleep, a writer of lower priority on this CPU must run */
+         nanosleep(&step, NULL);
+      }
+      *seq = __atomic_load_n(&block->seq, __ATOMIC_ACQUIRE);
+   }
+
+   return 0;
+}
+
+
+int mb_regs_get(mb_regs_t *regs, int type, int start_addr, int num, void *dest)
+{
+   int size = VAL_SIZE(type);
+   uint8_t *p = dest;
+
+   /* The range must have passed mb_regs_check() */
+   while (num > 0)
+   {
+      mb_block_t *block = &regs->block[regs->dir[type][start_addr / MB_REGS_BLOCK] - 1];
+      int i = start_addr % MB_REGS_BLOCK;
+      int n = (num < MB_REGS_BLOCK - i) ? num : MB_REGS_BLOCK - i;
+      uint64_t seq;
+
+      /* Copy again if a writer was active during the copy */
+      do
+      {
+         seq = __atomic_load_n(&block->seq, __ATOMIC_ACQUIRE);
+         if (wait_block(block, &seq) != 0)
+            return -1;
+         memcpy(p, (const uint8_t *)&block->val + i*size, n*size);
+         __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      } while (__atomic_load_n(&block->seq, __ATOMIC_RELAXED) != seq);
+      p += n*size;
+      start_addr += n;
+      num -= n;
+   }
+
+   return 0;
+}
+
+
+int mb_regs_put(mb_regs_t *regs, int type, int start_addr, int num, const void *src)
+{
+   int size = VAL_SIZE(type);
+   const uint8_t *p = src;
+
+   /* The range must have passed mb_regs_check(). A range over several
+      blocks may be written in part if a block stays held */
+   while (num > 0)
+   {
+      mb_block_t *block = &regs->block[regs->dir[type][start_addr / MB_REGS_BLOCK] - 1];
+      int i = start_addr % MB_REGS_BLOCK;
+      int n = (num < MB_REGS_BLOCK - i) ? num : MB_REGS_BLOCK - i;
+      uint64_t seq = __atomic_load_n(&block->seq, __ATOMIC_RELAXED);
+
+      /* Take the block, other writers may be in other processes */
+      do
+      {
+         if (wait_block(block, &seq) != 0)
+            return -1;
+      } while (!__atomic_compare_exchange_n(&block->seq, &seq,
+                                            (uint64_t)(SEQ_COUNT(seq)+1) | ((uint64_t)own_pid << 32), 0,
+                                            __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+      __atomic_thread_fence(__ATOMIC_RELEASE);
+      memcpy((uint8_t *)&block->val + i*size, p, n*size);
+      __atomic_store_n(&block->seq, (uint64_t)(SEQ_COUNT(seq)+2), __ATOMIC_RELEASE);
+      p += n*size;
+      start_addr += n;
+      num -= n;
+   }
+
+   return 0;
+}
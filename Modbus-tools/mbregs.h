@@ -0,0 +1,124 @@
+/*****************************************************************
+ * Sparse Modbus register store
+ *
+ * Author: Ondrej Wisniewski
+ *
+ * History:
+ * 14/10/2026: First release
+ * 14/10/2026: Shared memory stores with per-block sequence counters
+ * 14/10/2026: Stores in memory mapped files which survive a restart
+ * 14/10/2026: Bounded waits for blocks, recovery from dead writers
+ * 14/10/2026: Wait limit on the monotonic clock instead of a sleep count
+ *
+ * Producer contract for stores in shared memory:
+ *
+ * - Attach with mb_regs_shm_open() in the process which writes, a
+ *   child created by fork() must attach again. Producers must run
+ *   in the pid namespace of mbs, the writer of a block is known by
+ *   its pid.
+ * - Write only with mb_regs_put(), read with mb_regs_get(). Both
+ *   wait at most MB_REGS_MAX_WAIT us for a block held by another
+ *   writer and fail with EBUSY after that, a caller must not retry
+ *   in a tight loop.
+ * - A block held by a writer which no longer exists is released by
+ *   the next reader or writer which finds it. The values written up
+ *   to then stay, the range of the dead write may be half updated.
+ * - Check mb_regs_retired() now and then, e.g. before each batch of
+ *   writes. A retired store is no longer served by mbs, which was
+ *   restarted or stopped: unmap it and attach again.
+ *
+ *****************************************************************/
+
+#ifndef MBREGS_H
+#define MBREGS_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+
+/* Register types */
+#define MB_REGS_COILS       0
+#define MB_REGS_DISCRETE    1
+#define MB_REGS_INPUT       2
+#define MB_REGS_HOLDING     3
+#define MB_REGS_TYPES       4
+
+/* Registers per block, the address space of each type is 64K */
+#define MB_REGS_BLOCK       256
+#define MB_REGS_DIR_SIZE    (0x10000 / MB_REGS_BLOCK)
+
+/* Identifies a store in shared memory or a file, a store which was
+   replaced or removed by its creator has the retired magic */
+#define MB_REGS_MAGIC       0x4D425248
+#define MB_REGS_RETIRED     0x4D425200
+
+/* Waiting for a block held by a writer: spins first, then sleeps of
+   MB_REGS_WAIT_STEP us until MB_REGS_MAX_WAIT us after the start of
+   the wait on the monotonic clock. Sleeping lets a writer of lower
+   priority on the same CPU finish */
+#define MB_REGS_SPIN        100
+#define MB_REGS_WAIT_STEP   20
+#define MB_REGS_MAX_WAIT    10000
+
+/* Maximum ranges in a register map file */
+#define MB_REGS_MAX_RANGES  256
+
+/* Block of registers, bit types use one byte per bit like libmodbus */
+typedef struct {
+   uint64_t seq;                        /* counter in the low 32 bits, odd while the
+                                           block is written, then the pid of the
+                                           writer is in the high 32 bits */
+   union {
+      uint16_t reg[MB_REGS_BLOCK];
+      uint8_t bit[MB_REGS_BLOCK];
+   } val;
+   uint8_t mapped[MB_REGS_BLOCK/8];     /* one bit per mapped address */
+} mb_block_t;
+
+/* Register store. Blocks are referenced by index, not by pointer,
+   so the store can be placed in any memory as one piece */
+typedef struct {
+   uint32_t magic;
+   uint32_t num_blocks;                 /* blocks in the arena */
+   uint32_t used_blocks;
+   uint16_t dir[MB_REGS_TYPES][MB_REGS_DIR_SIZE];  /* block index + 1, 0 is unmapped */
+   mb_block_t block[];
+} mb_regs_t;
+
+/* Mapped address range, one line of a register map file */
+typedef struct {
+   int type;
+   int start_addr;
+   int num;
+} mb_regs_range_t;
+
+
+size_t mb_regs_size(int num_blocks);
+int mb_regs_blocks(const mb_regs_range_t *range, int num_ranges);
+void mb_regs_init(mb_regs_t *regs, int num_blocks);
+mb_regs_t* mb_regs_new(const mb_regs_range_t *range, int num_ranges);
+void mb_regs_free(mb_regs_t *regs);
+
+mb_regs_t* mb_regs_shm_new(const char *name, const mb_regs_range_t *range, int num_ranges);
+mb_regs_t* mb_regs_shm_open(const char *name);
+void mb_regs_shm_free(mb_regs_t *regs, const char *name);
+
+mb_regs_t* mb_regs_file_new(const char *filename, const mb_regs_t *layout);
+int mb_regs_file_sync(mb_regs_t *regs);
+void mb_regs_file_free(mb_regs_t *regs);
+
+int mb_regs_map(mb_regs_t *regs, int type, int start_addr, int num);
+void mb_regs_alias(mb_regs_t *regs, int type, int to_type);
+int mb_regs_load(const char *filename, mb_regs_range_t *range, int max_ranges);
+
+int mb_regs_check(const mb_regs_t *regs, int type, int start_addr, int num);
+int mb_regs_get(mb_regs_t *regs, int type, int start_addr, int num, void *dest);
+int mb_regs_put(mb_regs_t *regs, int type, int start_addr, int num, const void *src);
+
+
+static inline int mb_regs_retired(const mb_regs_t *regs)
+{
+   return __atomic_load_n(&regs->magic, __ATOMIC_ACQUIRE) != MB_REGS_MAGIC;
+}
+
+#endif
@@ -4,23 +4,56 @@
  * Author: Ondrej Wisniewski
  * 
  * Build with this command:
- * gcc mbs.c -o mbs -lmodbus
+ * gcc mbs.c mbcommon.c mbregs.c mbstats.c -o mbs -lmodbus -lrt -lpthread
  * 
  * History:
  * 28/04/2017: First release
+ * 14/10/2026: Allocate the register mapping once at startup
+ * 14/10/2026: Add register ranges and function codes 0x10 and 0x17
+ * 14/10/2026: Add Modbus TCP transport
+ * 14/10/2026: Serve many TCP masters concurrently using epoll
+ * 14/10/2026: Emulate several slave devices in one process
+ * 14/10/2026: Sparse register store over the full address space
+ * 14/10/2026: Optional register maps in shared memory for local producers
+ * 14/10/2026: Serial device given at runtime
+ * 14/10/2026: Frame timeout from the RTU timing profile
+ * 14/10/2026: Per-slave statistics, written on SIGUSR1
+ * 14/10/2026: Service time from the receive timestamp, rate limited error logs
+ * 14/10/2026: Real-time scheduling, CPU pinning and locked memory
+ * 14/10/2026: Register maps kept over a restart in memory mapped files
+ * 14/10/2026: Frame end after t1.5 instead of a fixed byte timeout
+ * 14/10/2026: Exception 0x0B for TCP requests to units not emulated
+ * 14/10/2026: Request data length without the RTU CRC, short requests refused
+ * 14/10/2026: RTU frames longer than an ADU are refused
+ * 14/10/2026: TCP masters are disconnected when a reply can't be sent
  * 
  *****************************************************************/
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 #include <syslog.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
 #include <modbus/modbus.h>
+#include "mbcommon.h"
+#include "mbregs.h"
+#include "mbstats.h"
 
 
-#define VERSION       "0.1"
+#define VERSION       "0.6"
 
 /* Debug mode */
 #define DEBUG         0
@@ -28,265 +61,1219 @@
 /* Serial port settings */
 //#define SERIAL_PORT   "/dev/ttyUSB0"
 #define SERIAL_PORT   "/dev/ttyAMA0"
-#define BAUDRATE      9600
-#define RTS_DELAY     10
 
-/* Register map settings */
+/* Default register map, holding registers also read as input registers */
 #define MAX_REG       32
 
+/* Emulated slave devices */
+#define MAX_SLAVES    247
+
+/* Modbus RTU settings */
+#define RTU_CRC_LENGTH        2
+
+/* Longest wait of the server loops in ms, they wake up to write the
+   summaries of rate limited messages */
+#define IDLE_TIMEOUT  1000
+
+/* Register files are written back this often (s) while written */
+#define STATE_SYNC    5
+
+/* Modbus TCP settings */
+#define MAX_CLIENTS   512
+#define MBAP_LENGTH   7      /* MBAP header incl. unit identifier */
+
 /* Modbus request structure */
 typedef struct {
    uint8_t slave_addr;
    uint8_t fc;
    uint8_t reg_addr_hi;
    uint8_t reg_addr_lo;
-   uint8_t reg_val_hi;
+   uint8_t reg_val_hi;     /* register value or number of registers */
    uint8_t reg_val_lo;
+   uint8_t data[];         /* request specific data (FC 0x10, 0x17) */
 } modbus_request_t;
 
+/* Size of the request fields up to the data section */
+#define REQ_HEADER_LEN    ((int)sizeof(modbus_request_t))
+
+/* Offsets into the data section of FC 0x10 and FC 0x17 requests */
+#define WR_BYTE_COUNT     0
+#define WR_VALUES         1
+#define WR_RD_ADDR        0
+#define WR_RD_NUM_REG     2
+#define WR_RD_BYTE_COUNT  4
+#define WR_RD_VALUES      5
+
+/* Modbus TCP client connection slot */
+typedef struct {
+   int fd;                                  /* -1 if the slot is free */
+   int rx_length;                           /* bytes in rx buffer */
+   uint8_t rx[MODBUS_TCP_MAX_ADU_LENGTH];   /* partially received request */
+} client_t;
+
+/* Emulated slave device */
+typedef struct {
+   int addr;
+   mb_regs_t *regs;
+   char shm_name[64];           /* shared memory segment, empty if private */
+   char file_name[256];         /* register file, empty if none */
+   int dirty;                   /* written since the last write back */
+   mb_stats_slave_t *stats;
+} slave_t;
+
 /* Flag to indicate exit from main loop */
-static int cont=1;
+static volatile sig_atomic_t cont=1;
+
+/* Own slave address, the first one if several are emulated */
+static int own_addr;
+
+/* Emulated slaves, looked up directly by address byte */
+static slave_t slave_table[MAX_SLAVES];
+static slave_t *slaves[256];
+static int num_slaves;
+
+/* Frames received on the serial bus which failed */
+static mb_stats_slave_t *bus_stats;
+
+/* Mapped address ranges, the same for all slaves */
+static mb_regs_range_t reg_range[MB_REGS_MAX_RANGES];
+static int num_ranges;
+static int alias_input;
+
+/* Shared memory name prefix, the slave address is appended */
+static const char *shm_prefix;
+
+/* Register file name prefix, the slave address is appended */
+static const char *state_prefix;
+
+/* Write back of the register files, stopped at exit */
+static pthread_t sync_thread_id;
+static pthread_mutex_t sync_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sync_cond = PTHREAD_COND_INITIALIZER;
+static int sync_stop;
+static int sync_running;
+
+/* Full address space view passed to libmodbus for each reply, only
+   the addresses of the current request are copied in and out */
+static modbus_mapping_t *view;
+
+/* Messages which can repeat for every frame on the bus or every
+   request of a master are rate limited, the reply to the next request
+   must not wait for syslog */
+static mb_log_limit_t rx_limit = { "receive failures" };
+static mb_log_limit_t request_limit = { "invalid requests" };
+static mb_log_limit_t reply_limit = { "failed replies" };
+static mb_log_limit_t connect_limit = { "failed connections" };
+
+/* Modbus TCP client slots, the free slots are kept on a stack */
+static client_t clients[MAX_CLIENTS];
+static int free_slot[MAX_CLIENTS];
+static int num_free;
+
+uint64_t time_now(void)
+{
+   struct timespec ts;
+   
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
+
+
+void flush_logs(void)
+{
+   mb_log_limit_flush(&rx_limit);
+   mb_log_limit_flush(&request_limit);
+   mb_log_limit_flush(&reply_limit);
+   mb_log_limit_flush(&connect_limit);
+}
+
+int init_reg_map(slave_t *slave)
+{
+   mb_regs_t *layout;
+   
+   if (shm_prefix != NULL)
+   {
+      snprintf(slave->shm_name, sizeof(slave->shm_name), "%s.%d", shm_prefix, slave->addr);
+      slave->regs = mb_regs_shm_new(slave->shm_name, reg_range, num_ranges);
+   }
+   else if (state_prefix != NULL)
+   {
+      /* The file keeps its values if it has the same layout */
+      layout = mb_regs_new(reg_range, num_ranges);
+      if (layout == NULL)
+         return -1;
+      if (alias_input)
+         mb_regs_alias(layout, MB_REGS_INPUT, MB_REGS_HOLDING);
+      snprintf(slave->file_name, sizeof(slave->file_name), "%s.%d", state_prefix, slave->addr);
+      slave->regs = mb_regs_file_new(slave->file_name, layout);
+      mb_regs_free(layout);
+   }
+   else
+      slave->regs = mb_regs_new(reg_range, num_ranges);
+   if (slave->regs == NULL)
+      return -1;
+   
+   /* Without a register map file input registers read the holding registers */
+   if (alias_input)
+      mb_regs_alias(slave->regs, MB_REGS_INPUT, MB_REGS_HOLDING);
+   
+   return 0;
+}
+
+
+void free_reg_map(slave_t *slave)
+{
+   if (slave->shm_name[0] != '\0')
+      mb_regs_shm_free(slave->regs, slave->shm_name);
+   else if (slave->file_name[0] != '\0')
+      mb_regs_file_free(slave->regs);
+   else
+      mb_regs_free(slave->regs);
+   slave->regs = NULL;
+}
+
+
+void* sync_thread(void *arg)
+{
+   struct timespec ts;
+   int i;
+   
+   (void)arg;
+   
+   /* The I/O of the write back is done here, the serving thread only
+      marks a slave as dirty */
+   pthread_mutex_lock(&sync_lock);
+   while (!sync_stop)
+   {
+      clock_gettime(CLOCK_REALTIME, &ts);
+      ts.tv_sec += STATE_SYNC;
+      if ((pthread_cond_timedwait(&sync_cond, &sync_lock, &ts) == 0) || sync_stop)
+         continue;
+      
+      pthread_mutex_unlock(&sync_lock);
+      for (i=0; i<num_slaves; i++)
+      {
+         if (__atomic_exchange_n(&slave_table[i].dirty, 0, __ATOMIC_RELAXED))
+            mb_regs_file_sync(slave_table[i].regs);
+      }
+      pthread_mutex_lock(&sync_lock);
+   }
+   pthread_mutex_unlock(&sync_lock);
+   
+   return NULL;
+}
+
+
+int start_sync(void)
+{
+   sigset_t set, old;
+   int rc;
+   
+   /* Termination signals go to the serving thread */
+   sigemptyset(&set);
+   sigaddset(&set, SIGINT);
+   sigaddset(&set, SIGTERM);
+   pthread_sigmask(SIG_BLOCK, &set, &old);
+   rc = pthread_create(&sync_thread_id, NULL, sync_thread, NULL);
+   pthread_sigmask(SIG_SETMASK, &old, NULL);
+   if (rc != 0)
+   {
+      syslog(LOG_DAEMON | LOG_ERR, "Unable to start the register file thread");
+      return -1;
+   }
+   sync_running = 1;
+   
+   return 0;
+}
+
+
+void stop_sync(void)
+{
+   /* The register files are written back when they are unmapped */
+   if (!sync_running)
+      return;
+   pthread_mutex_lock(&sync_lock);
+   sync_stop = 1;
+   pthread_cond_signal(&sync_cond);
+   pthread_mutex_unlock(&sync_lock);
+   pthread_join(sync_thread_id, NULL);
+}
+
+
+int init_view(void)
+{
+   /* Input and holding registers share one buffer, they are never 
+      used by the same request */
+   view = modbus_mapping_new(0x10000, 0x10000, 0x10000, 0);
+   if (view == NULL)
+      return -1;
+   
+   view->nb_input_registers  = 0x10000;
+   view->tab_input_registers = view->tab_registers;
+   
+   return 0;
+}
 
-/* Device register map */
-uint16_t reg_map[MAX_REG];
+
+void free_view(void)
+{
+   if (view == NULL)
+      return;
+   
+   /* Drop the input register alias, libmodbus would free it twice */
+   view->nb_input_registers  = 0;
+   view->tab_input_registers = NULL;
+   modbus_mapping_free(view);
+   view = NULL;
+}
 
 
-int read_reg(int reg_addr, uint16_t* reg_val)
+int read_bits(slave_t *slave, int type, int addr, int num)
 {
-   *reg_val = reg_map[reg_addr];
+   if ((num < 1) || (num > MODBUS_MAX_READ_BITS))
+      return MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE;
+   
+   if (mb_regs_check(slave->regs, type, addr, num) != 0)
+      return MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS;
+   
+   /* A block held by a producer for too long answers busy */
+   if (mb_regs_get(slave->regs, type, addr, num,
+                   &((type == MB_REGS_COILS) ? view->tab_bits : view->tab_input_bits)[addr]) != 0)
+      return MODBUS_EXCEPTION_SLAVE_OR_SERVER_BUSY;
    
    if (DEBUG)
-      printf("DBG: Read val %d from addr %d\n", *reg_val, reg_addr);
-  
-  return 0;
+      printf("DBG: Slave %d: Read %d bits from addr %d\n", slave->addr, num, addr);
+   
+   return 0;
 }
 
 
-int write_reg(int reg_addr, uint16_t reg_val)
+int write_bits(slave_t *slave, int addr, int num, const uint8_t* values, int byte_count)
 {
-   reg_map[reg_addr] = reg_val;
+   uint8_t bits[MODBUS_MAX_WRITE_BITS];
+   int i, rc;
+   
+   if ((num < 1) || (num > MODBUS_MAX_WRITE_BITS) || (byte_count != (num+7)/8))
+      return MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE;
+   
+   if (mb_regs_check(slave->regs, MB_REGS_COILS, addr, num) != 0)
+      return MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS;
+   
+   /* Unpack the request bits, least significant bit first */
+   for (i=0; i<num; i++)
+      bits[i] = (values[i/8] >> (i%8)) & 1;
+   rc = mb_regs_put(slave->regs, MB_REGS_COILS, addr, num, bits);
+   __atomic_store_n(&slave->dirty, 1, __ATOMIC_RELAXED);
+   if (rc != 0)
+      return MODBUS_EXCEPTION_SLAVE_OR_SERVER_BUSY;
    
    if (DEBUG)
-      printf("DBG: Wrote val %d to addr %d\n", reg_val, reg_addr);
-  
-  return 0;
+      printf("DBG: Slave %d: Wrote %d bits to addr %d\n", slave->addr, num, addr);
+   
+   return 0;
 }
 
 
-int main(int argc, char* argv[])
+int read_regs(slave_t *slave, int type, int addr, int num, int max_reg)
 {
-   modbus_t *mb;
-   int header_length;
-   int i, k, rc=0;
-   int baudrate=BAUDRATE;
-   int slave_addr, own_addr;
+   if ((num < 1) || (num > max_reg))
+      return MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE;
+   
+   if (mb_regs_check(slave->regs, type, addr, num) != 0)
+      return MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS;
+   
+   /* Input registers are read through the same view buffer */
+   if (mb_regs_get(slave->regs, type, addr, num, &view->tab_registers[addr]) != 0)
+      return MODBUS_EXCEPTION_SLAVE_OR_SERVER_BUSY;
+   
+   if (DEBUG)
+      printf("DBG: Slave %d: Read %d registers from addr %d\n", slave->addr, num, addr);
+   
+   return 0;
+}
+
+
+int write_regs(slave_t *slave, int addr, int num, const uint8_t* values, int byte_count, int max_reg)
+{
+   uint16_t regs[MODBUS_MAX_WRITE_REGISTERS];
+   int i, rc;
+   
+   if ((num < 1) || (num > max_reg) || (byte_count != 2*num))
+      return MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE;
+   
+   if (mb_regs_check(slave->regs, MB_REGS_HOLDING, addr, num) != 0)
+      return MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS;
+   
+   for (i=0; i<num; i++)
+      regs[i] = (uint16_t)(values[2*i]<<8 | values[2*i+1]);
+   rc = mb_regs_put(slave->regs, MB_REGS_HOLDING, addr, num, regs);
+   __atomic_store_n(&slave->dirty, 1, __ATOMIC_RELAXED);
+   if (rc != 0)
+      return MODBUS_EXCEPTION_SLAVE_OR_SERVER_BUSY;
    
+   if (DEBUG)
+      printf("DBG: Slave %d: Wrote %d registers to addr %d\n", slave->addr, num, addr);
    
-   if (argc < 3)
+   return 0;
+}
+
+
+int parse_slaves(const char *str)
+{
+   const char *p = str;
+   char *end;
+   int first, last, addr;
+   
+   /* Comma separated list of addresses and address ranges */
+   while (*p)
    {
-      printf("Modbus RTU slave, ver %s (using libmodbus %s)\n", VERSION, LIBMODBUS_VERSION_STRING);
-      printf("usage: mbs <baudrate> <slave_addr>\n\n");
-      return 0;
+      first = strtol(p, &end, 0);
+      if (end == p)
+         return -1;
+      last = first;
+      p = end;
+      if (*p == '-')
+      {
+         last = strtol(++p, &end, 0);
+         if (end == p)
+            return -1;
+         p = end;
+      }
+      if (*p == ',')
+         p++;
+      else if (*p != '\0')
+         return -1;
+      
+      if ((first < 1) || (last > MAX_SLAVES) || (first > last))
+         return -1;
+      
+      for (addr=first; addr<=last; addr++)
+      {
+         if (slaves[addr] != NULL)
+            continue;
+         slave_table[num_slaves].addr = addr;
+         slaves[addr] = &slave_table[num_slaves++];
+      }
    }
+   
+   return (num_slaves > 0) ? 0 : -1;
+}
 
-   openlog("modbus server", LOG_PID|LOG_CONS, LOG_USER);
 
-   /**************************************************************
-    * Parse input parameters
-    **************************************************************/
+int handle_request(modbus_t *mb, uint8_t *query, int query_length, int tcp, uint64_t rx_time)
+{
+   /* Get information from request buffer */
+   modbus_request_t *modbus_request;
+   slave_t *slave;
+   const uint8_t *data;
+   int data_length;
+   int pdu_length;
+   int header_length;
+   int slave_addr;
+   int operation;
+   int reg_addr;
+   uint16_t reg_val;
+   uint8_t coil;
+   uint16_t exception_code;
+   int rc, err;
    
-   i = 1;
-   baudrate   = atoi(argv[i++]);
-   own_addr = atoi(argv[i++]);
-     
+   header_length = modbus_get_header_length(mb);
+   modbus_request = (modbus_request_t *)&query[header_length-1];
    
-   /**************************************************************
-    * Initialize communication port
-    **************************************************************/
+   /* The PDU follows the MBAP header or the slave address, a frame
+      of Modbus RTU ends with the CRC. Without a function code there
+      is nothing to answer */
+   pdu_length = query_length - header_length - (tcp ? 0 : RTU_CRC_LENGTH);
+   if (pdu_length < 1)
+      return 0;
    
-   /* Create Modbus context*/
-   mb = modbus_new_rtu(SERIAL_PORT, baudrate, 'N', 8, 1);
-   if (mb == NULL) {
-      syslog(LOG_DAEMON | LOG_ERR, "Unable to create the libmodbus context\n");
-      return -1;
+   slave_addr = modbus_request->slave_addr;
+   operation  = modbus_request->fc;
+   reg_addr   = 0;
+   reg_val    = 0;
+   if (pdu_length >= REQ_HEADER_LEN - 1)
+   {
+      reg_addr = (int)modbus_request->reg_addr_hi<<8 | (int)modbus_request->reg_addr_lo;
+      reg_val  = (int)modbus_request->reg_val_hi<<8 | (int)modbus_request->reg_val_lo;
    }
+   data        = modbus_request->data;
+   data_length = pdu_length - (REQ_HEADER_LEN - 1);
    
-   header_length = modbus_get_header_length(mb);
+   exception_code = 0;
    
-   /* Set debug mode */
    if (DEBUG)
-      modbus_set_debug(mb, TRUE);
+      printf("DBG: received request for slave %d, op %d, addr %d, reg_val %d\n", 
+                                      slave_addr, operation, reg_addr, reg_val);
+   
+   /* Look up the addressed slave, Modbus TCP masters may also use 
+      the "unit not used" value for the first slave. On a serial bus
+      another device may have the address, over TCP we are the
+      gateway to the unit and tell the master it is not there */
+   slave = slaves[slave_addr];
+   if (tcp && (slave_addr == MODBUS_TCP_SLAVE))
+      slave = &slave_table[0];
+   if (slave == NULL)
+   { 
+      if (!tcp)
+         return 0;
+      rc = modbus_reply_exception(mb, query, MODBUS_EXCEPTION_GATEWAY_TARGET);
+      if (rc == -1)
+         mb_log_limited(&reply_limit, LOG_ERR, "Unit #%d: Failed to send exception reply to the client: %s",
+                                                  slave_addr, modbus_strerror(errno));
+      return rc;
+   }
    
-   /* Set slave address */
-   modbus_set_slave(mb, own_addr);
+   /* Every function code served has an address and a value or a
+      count, frames too short for them are answered as malformed */
+   if ((data_length < 0) && (((operation >= 0x01) && (operation <= 0x06)) || 
+                             (operation == 0x0F) || (operation == 0x10) || (operation == 0x17)))
+      operation = -1;
    
-   /* Connect to serial port */
-   if (DEBUG)
-      printf("Connecting to slave addr %d\n", own_addr);
-   if (modbus_connect(mb) == -1)
+   /* Perform requested operation */
+   switch (operation)
    {
-      syslog(LOG_DAEMON | LOG_ERR, "Connection failed: %s\n", modbus_strerror(errno));
-      modbus_free(mb);
-      return -1;
+      case -1:    /* Request too short for its function code */
+         exception_code = MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE;
+         break;
+
+      case 0x01:  /* FC Read Coils */
+         exception_code = read_bits(slave, MB_REGS_COILS, reg_addr, reg_val);
+         break;
+   
+      case 0x02:  /* FC Read Discrete Inputs */
+         exception_code = read_bits(slave, MB_REGS_DISCRETE, reg_addr, reg_val);
+         break;
+   
+      case 0x03:  /* FC Read Holding Registers */
+         /* reg_val holds the number of registers to read */
+         exception_code = read_regs(slave, MB_REGS_HOLDING, reg_addr, reg_val, 
+                                    MODBUS_MAX_READ_REGISTERS);
+         break;	
+   
+      case 0x04:  /* FC Read Input Registers */
+         exception_code = read_regs(slave, MB_REGS_INPUT, reg_addr, reg_val, 
+                                    MODBUS_MAX_READ_REGISTERS);
+         break;	
+   
+      case 0x05:  /* FC Write single coil */
+         if ((reg_val != 0xFF00) && (reg_val != 0x0000))
+         {  /* Only ON and OFF are valid coil values */
+            exception_code = MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE;
+            break;
+         }
+         coil = (reg_val == 0xFF00);
+         exception_code = write_bits(slave, reg_addr, 1, &coil, 1);
+         break;
+   
+      case 0x06:  /* FC Write single register */
+         exception_code = write_regs(slave, reg_addr, 1, &modbus_request->reg_val_hi, 2, 1);
+         break;
+
+      case 0x0F:  /* FC Write multiple coils */
+         if ((data_length < WR_VALUES) || 
+             (data_length < WR_VALUES + data[WR_BYTE_COUNT]))
+         {  /* Request frame too short for the announced data */
+            exception_code = MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE;
+            break;
+         }
+         exception_code = write_bits(slave, reg_addr, reg_val,
+                                     &data[WR_VALUES], data[WR_BYTE_COUNT]);
+         break;
+
+      case 0x10:  /* FC Write multiple registers */
+         if ((data_length < WR_VALUES) || 
+             (data_length < WR_VALUES + data[WR_BYTE_COUNT]))
+         {  /* Request frame too short for the announced data */
+            exception_code = MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE;
+            break;
+         }
+         exception_code = write_regs(slave, reg_addr, reg_val,
+                                     &data[WR_VALUES], data[WR_BYTE_COUNT],
+                                     MODBUS_MAX_WRITE_REGISTERS);
+         break;
+
+      case 0x17:  /* FC Read/Write multiple registers */
+         if ((data_length < WR_RD_VALUES) || 
+             (data_length < WR_RD_VALUES + data[WR_RD_BYTE_COUNT]))
+         {  /* Request frame too short for the announced data */
+            exception_code = MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE;
+            break;
+         }
+         
+         /* Check the read range before writing anything */
+         if ((reg_val < 1) || (reg_val > MODBUS_MAX_WR_READ_REGISTERS))
+            exception_code = MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE;
+         else if (mb_regs_check(slave->regs, MB_REGS_HOLDING, reg_addr, reg_val) != 0)
+            exception_code = MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS;
+         
+         /* The write operation is performed before the read */
+         if (exception_code == 0)
+            exception_code = write_regs(slave, (int)data[WR_RD_ADDR]<<8 | (int)data[WR_RD_ADDR+1],
+                                               (int)data[WR_RD_NUM_REG]<<8 | (int)data[WR_RD_NUM_REG+1],
+                                               &data[WR_RD_VALUES], data[WR_RD_BYTE_COUNT],
+                                               MODBUS_MAX_WR_WRITE_REGISTERS);
+         if (exception_code == 0)
+            exception_code = read_regs(slave, MB_REGS_HOLDING, reg_addr, reg_val, 
+                                       MODBUS_MAX_WR_READ_REGISTERS);
+         break;
+
+      default:
+         mb_log_limited(&request_limit, LOG_ERR, "Invalid operation %d\n", operation);
+         exception_code = MODBUS_EXCEPTION_ILLEGAL_FUNCTION;
+         
+   } //end switch statement
+
+   /* Send reply to client */
+   if (exception_code == 0)
+   {
+      rc = modbus_reply(mb, query, query_length, view);
+      if (rc == -1) 
+      {
+         mb_log_limited(&reply_limit, LOG_ERR, "Slave #%d: Failed to send reply to the client: %s", 
+                                                  slave->addr, modbus_strerror(errno));
+      }
+   }
+   else
+   {
+      rc = modbus_reply_exception(mb, query, exception_code);
+      if (rc == -1) 
+      {
+         mb_log_limited(&reply_limit, LOG_ERR, "Slave #%d: Failed to send exception reply to the client: %s", 
+                                                  slave->addr, modbus_strerror(errno));
+      }
    }
    
-   /* Set Modbus timeouts */
-   modbus_set_response_timeout(mb, 2, 0); // 2s
-   modbus_set_byte_timeout(mb, 0, 0);     // not used
+   /* Service time from the end of the request on the wire to the reply
+      being sent, which the master sees as our turnaround */
+   err = (rc == -1) ? errno : ((exception_code != 0) ? MODBUS_ENOBASE + exception_code : 0);
+   mb_stats_record(slave->stats, time_now() - rx_time, err);
    
-   if (strstr(SERIAL_PORT, "USB") == NULL)
+   return rc;
+}
+
+
+int rtu_read(int fd, uint8_t *buf, int length, int timeout)
+{
+   struct pollfd pfd = { fd, POLLIN, 0 };
+   struct timespec ts = { timeout/1000000, (timeout%1000000)*1000 };
+   int n, rc;
+   
+   /* Timeout in us, the gaps of a frame are shorter than a ms */
+   for (n=0; n<length; n+=rc)
    {
-      /* Enable RS485 direction control via RTS line */
-      if (modbus_rtu_set_rts(mb, MODBUS_RTU_RTS_DOWN) == -1)
+      rc = ppoll(&pfd, 1, &ts, NULL);
+      if (rc == 0)
+      {
+         errno = ETIMEDOUT;
+         return -1;
+      }
+      if (rc == -1)
       {
-         syslog(LOG_DAEMON | LOG_ERR, "Setting RTS mode failed: %s\n", modbus_strerror(errno));
-         modbus_free(mb);
+         if ((errno == EINTR) && cont)
+         {
+            rc = 0;
+            continue;
+         }
          return -1;
       }
       
-      /* Set RTS control delay (before and after transmission) */
-      if (RTS_DELAY>0)
+      rc = read(fd, &buf[n], length-n);
+      if (rc == -1)
       {
-         if (modbus_rtu_set_rts_delay(mb, RTS_DELAY) == -1)
+         if ((errno == EAGAIN) || (errno == EINTR))
          {
-            syslog(LOG_DAEMON | LOG_ERR, "Setting RTS delay failed: %s\n", modbus_strerror(errno));
-            modbus_free(mb);
-            return -1;
+            rc = 0;
+            continue;
          }
+         return -1;
       }
-      if (DEBUG)
-         printf("RTS delay is %dus\n", modbus_rtu_get_rts_delay(mb));
    }
    
+   return n;
+}
+
+
+int rtu_meta_length(const uint8_t *frame, int request)
+{
+   int fc = frame[1];
    
-   /**************************************************************
-    * Main loop 
-    **************************************************************/
-   while (cont)
+   /* Bytes following the function code up to the data section */
+   if (fc & 0x80)
+      return request ? 0 : 1;
+   
+   switch (fc)
+   {
+      case 0x01: case 0x02: case 0x03: case 0x04:
+         return request ? 4 : 1;
+      case 0x05: case 0x06:
+         return 4;
+      case 0x0F: case 0x10:
+         return request ? 5 : 4;
+      case 0x16:
+         return 6;
+      case 0x17:
+         return request ? 9 : 1;
+      case 0x07: case 0x0B: case 0x0C: case 0x11:
+         return request ? 0 : 1;
+      default:
+         return 0;
+   }
+}
+
+
+int rtu_data_length(const uint8_t *frame, int meta_length, int request)
+{
+   int fc = frame[1];
+   
+   /* The last byte of the meta section is the byte count, if any */
+   if (fc & 0x80)
+      return 0;
+   if (request)
+      return ((fc == 0x0F) || (fc == 0x10) || (fc == 0x17)) ? frame[1+meta_length] : 0;
+   else
+      return ((meta_length == 1) && (fc != 0x07)) ? frame[2] : 0;
+}
+
+
+int rtu_receive(int fd, uint8_t *frame, const mb_timing_t *timing, int *response_from, uint64_t *rx_time)
+{
+   int request = 1;
+   int length = 0, meta_length = 0, rc;
+   
+   /* Wait for the start of a frame, then read the frame by its 
+      function code, the same way libmodbus does, but without 
+      filtering on a single slave address. A frame is the response
+      of another slave only if it carries the address just polled.
+      An idle bus returns without a frame after IDLE_TIMEOUT */
+   rc = rtu_read(fd, frame, 1, IDLE_TIMEOUT*1000);
+   if ((rc == -1) && (errno == ETIMEDOUT))
+   {
+      *response_from = -1;
+      return 0;
+   }
+   if (rc == 1)
+   {
+      request = (frame[0] != *response_from);
+      rc = rtu_read(fd, &frame[1], 1, timing->byte_timeout);
+   }
+   if (rc == 1)
+   {
+      meta_length = rtu_meta_length(frame, request);
+      rc = rtu_read(fd, &frame[2], meta_length, timing->byte_timeout);
+   }
+   if (rc >= 0)
+   {
+      int data_length = rtu_data_length(frame, meta_length, request);
+      
+      /* The byte count comes from the wire, a frame which would not 
+         fit in an RTU ADU is noise or a broken master */
+      length = 2 + meta_length;
+      if (length + data_length + RTU_CRC_LENGTH > MODBUS_RTU_MAX_ADU_LENGTH)
+      {
+         errno = EMBBADDATA;
+         rc = -1;
+      }
+      else
+      {
+         rc = rtu_read(fd, &frame[length], data_length + RTU_CRC_LENGTH, timing->byte_timeout);
+         length += rc;
+      }
+   }
+   
+   /* A tty has no receive timestamps like SO_TIMESTAMP, the end of
+      the frame is the wakeup from the poll() which returned its CRC */
+   *rx_time = time_now();
+   *response_from = -1;
+   
+   if ((rc >= 0) && (mb_crc16(frame, length-RTU_CRC_LENGTH) != 
+                     ((uint16_t)frame[length-1]<<8 | frame[length-2])))
+   {
+      errno = EMBBADCRC;
+      rc = -1;
+   }
+   
+   if (rc == -1)
+   {
+      int err = errno;
+      uint8_t dummy[64];
+      
+      /* Resynchronise on the next t3.5 silence of the bus */
+      while (rtu_read(fd, dummy, sizeof(dummy), timing->t35 + MB_OS_LATENCY) != -1);
+      errno = err;
+      return -1;
+   }
+   
+   if (!request)
+      return 0;
+   
+   /* A request for a device we don't emulate is followed by its response */
+   if ((slaves[frame[0]] == NULL) && (frame[0] != MODBUS_BROADCAST_ADDRESS))
    {
-      uint8_t query[MODBUS_TCP_MAX_ADU_LENGTH];
-      int rc;
+      *response_from = frame[0];
+      return 0;
+   }
    
+   return length;
+}
+
+
+int serve_rtu(modbus_t *mb, const mb_conn_t *conn)
+{
+   uint8_t query[MODBUS_RTU_MAX_ADU_LENGTH];
+   mb_timing_t timing;
+   int response_from = -1;
+   uint64_t rx_time;
+   int fd;
+   int rc=0;
+   
+   /* A gap of t1.5 ends a frame, see mb_rtu_timing() */
+   mb_rtu_timing(conn, &timing);
+   
+   fd = modbus_get_socket(mb);
+   
+   while (cont)
+   {
       /* Receive data from client */    
-      rc = modbus_receive(mb, query);      /* rc is the query size */
-      if (rc == -1) 
+      rc = rtu_receive(fd, query, &timing, &response_from, &rx_time);   /* rc is the query size */
+      if ((rc == -1) && cont) 
       { 
-         syslog(LOG_DAEMON | LOG_ERR, "Slave #%d: modbus_receive() failed: %s", 
-                                       own_addr, modbus_strerror(errno));
+         mb_stats_record(bus_stats, 0, errno);
+         mb_log_limited(&rx_limit, LOG_ERR, "Slave #%d: receive failed: %s", 
+                                             own_addr, modbus_strerror(errno));
       }
-      else 
+      else if (rc > 0)
       { 
-         /* Get information from request buffer */
-         modbus_request_t *modbus_request;
-         int operation;
-         int reg_addr;
-         uint16_t reg_val;
-         uint16_t exception_code;
-         modbus_mapping_t *mb_mapping;
-         
-         modbus_request = (modbus_request_t *)&query[header_length-1];
-         
-         slave_addr = modbus_request->slave_addr;
-         operation  = modbus_request->fc;
-         reg_addr   = (int)modbus_request->reg_addr_hi<<8 | (int)modbus_request->reg_addr_lo;
-         reg_val    = (int)modbus_request->reg_val_hi<<8 | (int)modbus_request->reg_val_lo;
-         
-         exception_code = 0;
-         
-         if (DEBUG)
-            printf("DBG: received request for slave %d, op %d, addr %d, reg_val %d\n", 
-                                            slave_addr, operation, reg_addr, reg_val);
+         rc = handle_request(mb, query, rc, 0, rx_time);
+      }
+      
+      /* After the reply, a summary is due once per interval at most */
+      flush_logs();
+   }
+   
+   return rc;
+}
+
+
+void close_client(int epfd, int slot)
+{
+   epoll_ctl(epfd, EPOLL_CTL_DEL, clients[slot].fd, NULL);
+   close(clients[slot].fd);
+   clients[slot].fd = -1;
+   free_slot[num_free++] = slot;
+}
+
+
+void accept_clients(int epfd, int server_socket)
+{
+   struct epoll_event ev;
+   int keepalive = 1;
+   int fd, slot;
+   
+   /* Accept all pending connections */
+   while ((fd = accept4(server_socket, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1)
+   {
+      if (num_free == 0)
+      {
+         mb_log_limited(&connect_limit, LOG_ERR, "Slave #%d: too many clients (max %d), connection refused", 
+                                                  own_addr, MAX_CLIENTS);
+         close(fd);
+         continue;
+      }
+      
+      slot = free_slot[--num_free];
+      clients[slot].fd = fd;
+      clients[slot].rx_length = 0;
+      
+      /* Detect masters which disappear without closing the connection */
+      setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &keepalive, sizeof(keepalive));
+      
+      /* Replies to pipelined requests must not wait for delayed acknowledges */
+      setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &keepalive, sizeof(keepalive));
+      
+      /* Kernel receive time of the requests, for the service time */
+      setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPNS, &keepalive, sizeof(keepalive));
+      
+      ev.events = EPOLLIN;
+      ev.data.u32 = slot;
+      if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == -1)
+      {
+         syslog(LOG_DAEMON | LOG_ERR, "Slave #%d: epoll_ctl() failed: %s", 
+                                       own_addr, strerror(errno));
+         close(fd);
+         clients[slot].fd = -1;
+         free_slot[num_free++] = slot;
+         continue;
+      }
+      
+      if (DEBUG)
+         printf("DBG: client connected in slot %d\n", slot);
+   }
+   
+   if ((errno != EAGAIN) && (errno != EWOULDBLOCK))
+      mb_log_limited(&connect_limit, LOG_ERR, "Slave #%d: accept() failed: %s", 
+                                               own_addr, strerror(errno));
+}
+
+
+uint64_t rx_timestamp(struct msghdr *msg)
+{
+   struct cmsghdr *cmsg;
+   struct timespec ts, now;
+   int64_t age;
+   
+   /* The kernel timestamp is wall clock time, take its age to get
+      back to the monotonic clock of the statistics. The time the
+      request waited in the socket buffer is part of the service time */
+   for (cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL; cmsg = CMSG_NXTHDR(msg, cmsg))
+   {
+      if ((cmsg->cmsg_level == SOL_SOCKET) && (cmsg->cmsg_type == SCM_TIMESTAMPNS))
+      {
+         memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+         clock_gettime(CLOCK_REALTIME, &now);
+         age = (int64_t)(now.tv_sec - ts.tv_sec)*1000000 + (now.tv_nsec - ts.tv_nsec)/1000;
          
-         /* Check if slave address matches with our own address */
-         if (slave_addr != own_addr)
-         { 
+         /* Not across a step of the wall clock */
+         if ((age < 0) || (age > 1000000))
+            break;
+         return time_now() - age;
+      }
+   }
+   
+   return time_now();
+}
+
+
+void read_client(modbus_t *mb, int epfd, int slot)
+{
+   client_t *client = &clients[slot];
+   union {
+      char buf[CMSG_SPACE(sizeof(struct timespec))];
+      struct cmsghdr align;
+   } control;
+   struct iovec iov;
+   struct msghdr msg;
+   uint64_t rx_time;
+   int n, length;
+   
+   /* Read what is available, never wait for the rest of a request */
+   iov.iov_base = &client->rx[client->rx_length];
+   iov.iov_len = sizeof(client->rx) - client->rx_length;
+   memset(&msg, 0, sizeof(msg));
+   msg.msg_iov = &iov;
+   msg.msg_iovlen = 1;
+   msg.msg_control = control.buf;
+   msg.msg_controllen = sizeof(control.buf);
+   
+   n = recvmsg(client->fd, &msg, 0);
+   if (n <= 0)
+   {
+      if ((n == -1) && ((errno == EAGAIN) || (errno == EINTR)))
+         return;
+      if ((n == -1) && (errno != ECONNRESET))
+         mb_log_limited(&rx_limit, LOG_ERR, "Slave #%d: read() failed: %s", 
+                                             own_addr, strerror(errno));
+      close_client(epfd, slot);
+      return;
+   }
+   client->rx_length += n;
+   rx_time = rx_timestamp(&msg);
+   
+   /* Serve all complete requests in the buffer */
+   while (client->rx_length >= MBAP_LENGTH)
+   {
+      /* MBAP length field counts the unit identifier and the PDU */
+      length = 6 + ((int)client->rx[4]<<8 | (int)client->rx[5]);
+      if ((client->rx[2] != 0) || (client->rx[3] != 0) || 
+          (length < MBAP_LENGTH+1) || (length > MODBUS_TCP_MAX_ADU_LENGTH))
+      {
+         /* Not Modbus or out of sync, drop the connection */
+         mb_log_limited(&rx_limit, LOG_ERR, "Slave #%d: invalid MBAP header, closing connection", 
+                                             own_addr);
+         close_client(epfd, slot);
+         return;
+      }
+      
+      if (client->rx_length < length)
+         break;
+      
+      /* A master which doesn't read its replies fills the send buffer,
+         a reply cut short would leave the stream out of sync */
+      modbus_set_socket(mb, client->fd);
+      if (handle_request(mb, client->rx, length, 1, rx_time) == -1)
+      {
+         close_client(epfd, slot);
+         return;
+      }
+      
+      client->rx_length -= length;
+      memmove(client->rx, &client->rx[length], client->rx_length);
+   }
+}
+
+
+int serve_tcp(modbus_t *mb, int server_socket)
+{
+   struct epoll_event ev, events[64];
+   struct rlimit rl;
+   int epfd;
+   int i, n;
+   
+   /* One file descriptor per client plus a few for ourselves */
+   if ((getrlimit(RLIMIT_NOFILE, &rl) == 0) && (rl.rlim_cur < MAX_CLIENTS+16))
+   {
+      rl.rlim_cur = (rl.rlim_max < MAX_CLIENTS+16) ? rl.rlim_max : MAX_CLIENTS+16;
+      setrlimit(RLIMIT_NOFILE, &rl);
+   }
+   
+   for (i=0; i<MAX_CLIENTS; i++)
+   {
+      clients[i].fd = -1;
+      free_slot[i] = MAX_CLIENTS-1-i;
+   }
+   num_free = MAX_CLIENTS;
+   
+   epfd = epoll_create1(EPOLL_CLOEXEC);
+   if (epfd == -1)
+   {
+      syslog(LOG_DAEMON | LOG_ERR, "Slave #%d: epoll_create1() failed: %s", 
+                                    own_addr, strerror(errno));
+      return -1;
+   }
+   
+   /* The listening socket is marked with slot number MAX_CLIENTS */
+   fcntl(server_socket, F_SETFL, fcntl(server_socket, F_GETFL) | O_NONBLOCK);
+   ev.events = EPOLLIN;
+   ev.data.u32 = MAX_CLIENTS;
+   if (epoll_ctl(epfd, EPOLL_CTL_ADD, server_socket, &ev) == -1)
+   {
+      syslog(LOG_DAEMON | LOG_ERR, "Slave #%d: epoll_ctl() failed: %s", 
+                                    own_addr, strerror(errno));
+      close(epfd);
+      return -1;
+   }
+   
+   while (cont)
+   {
+      n = epoll_wait(epfd, events, sizeof(events)/sizeof(events[0]), IDLE_TIMEOUT);
+      if (n == -1)
+      {
+         if (errno == EINTR)
             continue;
-         }
-         
-         
-         /* Initialise new response data structure */
-         mb_mapping = modbus_mapping_new(0,0,MAX_REG,0);
-         if (mb_mapping == NULL) 
-         {
-            syslog(LOG_DAEMON | LOG_ERR, "Slave #%d: Failed to allocate the mapping: %s", 
-                                                 own_addr, modbus_strerror(errno));
-            modbus_free(mb);
-            return -1;
-         }
-         
-         /* Perform requested operation */
-         switch (operation)
-         {
-            case 0x03:  /* FC Read Holding Registers */
-            case 0x04:  /* FC Read Input Registers */
-               if (reg_addr < MAX_REG) 
-               {
-                  /* Call the "Read register" handler function */ 
-                  if (read_reg(reg_addr, &reg_val) != 0)
-                  {  /* Error during register read occured */
-                     exception_code = MODBUS_EXCEPTION_SLAVE_OR_SERVER_FAILURE;
-                  }
-                  else
-                  {  /* Copy read value into response buffer */
-                     mb_mapping->tab_registers[reg_addr] = reg_val;
-                  }
-               }
-               else
-               {  /* Register address out of range */
-                  exception_code = MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS;
-               }
-               break;	
+         syslog(LOG_DAEMON | LOG_ERR, "Slave #%d: epoll_wait() failed: %s", 
+                                       own_addr, strerror(errno));
+         break;
+      }
+      
+      for (i=0; i<n; i++)
+      {
+         int slot = events[i].data.u32;
          
-            case 0x06:  /* FC Write single register */
-               if (reg_addr < MAX_REG) 
-               {
-                  /* Call the "Write register" handler function */
-                  if (write_reg(reg_addr, reg_val) != 0)
-                  {  
-                     /* Error during register write occured */
-                     exception_code = MODBUS_EXCEPTION_SLAVE_OR_SERVER_FAILURE;
-                  }
-               }
-               else
-               {  /* Register address out of range */
-                  exception_code = MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS;
-               }
-               break;
+         if (slot == MAX_CLIENTS)
+            accept_clients(epfd, server_socket);
+         else if (clients[slot].fd != -1)
+            read_client(mb, epfd, slot);
+      }
       
-            default:
-               syslog(LOG_DAEMON | LOG_ERR, "Invalid operation %d\n", operation);
-               exception_code = MODBUS_EXCEPTION_ILLEGAL_FUNCTION;
-               
-         } //end switch statement
+      flush_logs();
+   }
    
-         /* Send reply to client */
-         if (exception_code == 0)
-         {
-            rc = modbus_reply(mb, query, rc, mb_mapping);
-            if (rc == -1) 
-            {
-               syslog(LOG_DAEMON | LOG_ERR, "Slave #%d: Failed to send reply to the client: %s", 
-                                                        own_addr, modbus_strerror(errno));
-            }
-         }
-         else
-         {
-            rc = modbus_reply_exception(mb, query, exception_code);
-            if (rc == -1) 
-            {
-               syslog(LOG_DAEMON | LOG_ERR, "Slave #%d: Failed to send exception reply to the client: %s", 
-                                                        own_addr, modbus_strerror(errno));
-            }
-         }
-         modbus_mapping_free(mb_mapping); 
+   /* Close all client connections */
+   for (i=0; i<MAX_CLIENTS; i++)
+   {
+      if (clients[i].fd != -1)
+         close_client(epfd, i);
+   }
+   close(epfd);
+   
+   /* Client sockets are already closed */
+   modbus_set_socket(mb, -1);
+   
+   return 0;
+}
+
+
+void stop(int sig)
+{
+   (void)sig;
+   cont = 0;
+}
+
+
+int main(int argc, char* argv[])
+{
+   modbus_t *mb;
+   int i, rc=0;
+   mb_conn_t conn;
+   int server_socket;
+   const char *stats_file=NULL;
+   int rt_priority=0;
+   int rt_cpu=-1;
+   struct sigaction sa;
+   
+   
+   /* Options come before the positional parameters */
+   while ((i = getopt(argc, argv, "a:f:m:r:s:")) != -1)
+   {
+      if (i == 'a')
+      {
+         rt_cpu = atoi(optarg);
+         if (rt_cpu < 0)
+            argc = 0;
       }
-   } // end of main server loop
+      else if (i == 'f')
+         state_prefix = optarg;
+      else if (i == 'm')
+         stats_file = optarg;
+      else if (i == 'r')
+      {
+         rt_priority = atoi(optarg);
+         if ((rt_priority < 1) || (rt_priority > MB_RT_MAX_PRIORITY))
+            argc = 0;
+      }
+      else if (i == 's')
+         shm_prefix = optarg;
+      else
+         argc = 0;
+   }
+   
+   if ((argc - optind < 2) || ((shm_prefix != NULL) && (state_prefix != NULL)))
+   {
+      printf("Modbus RTU/TCP slave, ver %s (using libmodbus %s)\n", VERSION, LIBMODBUS_VERSION_STRING);
+      printf("usage: mbs [-a <cpu>] [-f <state_file>] [-m <stats_file>] [-r <rt_prio>] [-s <shm_name>] <conn> <slave_addr>[-<slave_addr>][,...] [<reg_map>]\n\n");
+      printf("conn:  [<device>:]<baudrate>   - Modbus RTU on <device> (default %s)\n", SERIAL_PORT);
+      printf("       tcp:[<host>][:<port>]   - Modbus TCP, listen on <host> (default all),\n");
+      printf("                                 an IPv6 <host> in brackets, e.g. tcp:[::1]:502\n\n");
+      printf("Each slave address, e.g. 1,5,10-20, emulates a device with its own register map\n");
+      printf("reg_map: file with the mapped address ranges, one range per line:\n");
+      printf("         coil|discrete|input|holding <start_addr> <num>\n");
+      printf("         default is %d holding registers, also read as input registers\n", MAX_REG);
+      printf("-s:      place the register map of each slave in POSIX shared memory\n");
+      printf("         <shm_name>.<slave_addr>, e.g. /mbs.1, for local producers\n");
+      printf("-f:      keep the register map of each slave in the memory mapped file\n");
+      printf("         <state_file>.<slave_addr>, restored at startup and written back\n");
+      printf("         every %d s while written, not together with -s\n", STATE_SYNC);
+      printf("-m:      on SIGUSR1 and at exit write the request counts and service times,\n");
+      printf("         from the end of a request to its reply, of every slave in\n");
+      printf("         Prometheus text format to <stats_file>,\n");
+      printf("         default is stderr on SIGUSR1 only\n");
+      printf("-r:      serve under SCHED_FIFO with priority <rt_prio> (1-%d), with all\n", MB_RT_MAX_PRIORITY);
+      printf("         memory locked, so replies do not wait for page faults or other\n");
+      printf("         processes\n");
+      printf("-a:      serve on CPU <cpu> only\n\n");
+      return 0;
+   }
+
+   openlog("modbus server", LOG_PID|LOG_CONS, LOG_USER);
+   mb_log_syslog(1);
+
+   /**************************************************************
+    * Parse input parameters
+    **************************************************************/
+   
+   i = optind;
+   if (mb_parse_conn(argv[i++], SERIAL_PORT, &conn) != 0)
+   {
+      syslog(LOG_DAEMON | LOG_ERR, "Invalid connection: %s\n", argv[i-1]);
+      return -1;
+   }
+   conn.debug = DEBUG;
+   if (parse_slaves(argv[i++]) != 0)
+   {
+      syslog(LOG_DAEMON | LOG_ERR, "Invalid slave address list: %s\n", argv[i-1]);
+      return -1;
+   }
+   own_addr = slave_table[0].addr;
+   if (argc > i)
+   {
+      num_ranges = mb_regs_load(argv[i++], reg_range, MB_REGS_MAX_RANGES);
+      if (num_ranges < 0)
+         return -1;
+   }
+   else
+   {
+      reg_range[0].type = MB_REGS_HOLDING;
+      reg_range[0].start_addr = 0;
+      reg_range[0].num = MAX_REG;
+      num_ranges = 1;
+      alias_input = 1;
+   }
+   
+   /* Statistics of every emulated slave, and of the bus for frames
+      which are not addressed reliably */
+   mb_stats_init("mbs", "service", "Service time");
+   for (i=0; i<num_slaves; i++)
+      slave_table[i].stats = mb_stats_slave(0, slave_table[i].addr);
+   if (conn.transport == MB_TRANSPORT_RTU)
+      bus_stats = mb_stats_slave(0, MB_STATS_NO_SLAVE);
+   if (mb_stats_start(stats_file) != 0)
+      return -1;
+     
+   
+   /**************************************************************
+    * Initialize communication port
+    **************************************************************/
+   
+   /* Create Modbus context, open the serial port or listen for masters */
+   mb = mb_listen(&conn, own_addr, &server_socket);
+   if (mb == NULL)
+      return -1;
+   
+   
+   /* Initialise the register maps used for all responses */
+   for (i=0; i<num_slaves; i++)
+   {
+      if (init_reg_map(&slave_table[i]) != 0)
+         break;
+   }
+   if ((i < num_slaves) || (init_view() != 0))
+   {
+      syslog(LOG_DAEMON | LOG_ERR, "Slave #%d: Failed to allocate the mapping: %s", 
+                      slave_table[(i < num_slaves) ? i : 0].addr, modbus_strerror(errno));
+      for (i=0; i<num_slaves; i++)
+         free_reg_map(&slave_table[i]);
+      modbus_close(mb);
+      modbus_free(mb);
+      if (server_socket != -1)
+         close(server_socket);
+      return -1;
+   }
+   
+   
+   /**************************************************************
+    * Main loop 
+    **************************************************************/
+   
+   /* Leave the main loop on termination, shared memory is removed */
+   memset(&sa, 0, sizeof(sa));
+   sa.sa_handler = stop;
+   sigaction(SIGINT, &sa, NULL);
+   sigaction(SIGTERM, &sa, NULL);
+   
+   /* The register maps and buffers are allocated, lock them in before
+      this thread turns real-time, register files are written back by
+      a thread of its own */
+   if ((state_prefix != NULL) && (start_sync() != 0))
+      rc = -1;
+   else if (((rt_priority > 0) && (mb_rt_lock() != 0)) || (mb_rt_thread(rt_priority, rt_cpu) != 0))
+      rc = -1;
+   else if (server_socket == -1)
+      rc = serve_rtu(mb, &conn);
+   else
+      rc = serve_tcp(mb, server_socket);
       
    /**************************************************************
     * Clean up end exit
     **************************************************************/
+   stop_sync();
+   for (i=0; i<num_slaves; i++)
+      free_reg_map(&slave_table[i]);
+   free_view();
+   if (server_socket != -1)
+      close(server_socket);
    modbus_close(mb);
    modbus_free(mb);
+   if (stats_file != NULL)
+      mb_stats_dump();
    
    return rc;
 }
@@ -0,0 +1,382 @@
+/*****************************************************************
+ * Modbus RTU bus scan tool
+ *
+ * This tool is used to find the devices on a serial bus when
+ * their slave address and baudrate are not known, e.g. before
+ * they are configured with relconf or thconf. Every address is
+ * probed at every baudrate with a read of register 0, first as
+ * holding and, if the device answers, also as input register.
+ * The BQTEK relay cards in "Settings Mode" answer on the reserved
+ * address 255, which is probed too.
+ *
+ * The probe timeout is the time of the request and response
+ * frames at the baudrate plus a short response turnaround
+ * (default SCAN_TURNAROUND), so an empty address costs a few ms
+ * instead of the 2 s response timeout. Silence means no device.
+ * A frame which arrives late or garbled is noise, in which case
+ * the address and the one before are probed again with the full
+ * response timeout, so slow devices are not missed. An address
+ * found at one baudrate is not probed at the others.
+ *
+ * Author: Ondrej Wisniewski
+ *
+ * Build with this command:
+ * gcc mbscan.c mbcommon.c mbraw.c -o mbscan -lmodbus
+ *
+ * History:
+ * 14/10/2026 - initial release
+ * 14/10/2026 - raw frames of the reserved address with mbraw
+ *
+ * Copyright 2026
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Telegea.  If not, see http://www.gnu.org/licenses/.
+ *
+ *****************************************************************/
+
+// Probe Request:
+// --------------
+// AA      Slave addr (1 ... 247, 255)
+// 03/04   Function Code (Read holding/input registers)
+// 00 00   Register Address
+// 00 01   Number of registers
+//
+// Probe results:
+// --------------
+// value      device answered with register 0
+// exception  device answered with an exception code
+// silence    no answer within the probe timeout
+// noise      late, garbled or foreign frame
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <modbus/modbus.h>
+#include "mbcommon.h"
+#include "mbraw.h"
+
+
+#define VERSION       "0.1"
+
+/* Debug mode */
+#define DEBUG         0
+
+#define SERIAL_PORT     "/dev/ttyAMA0"
+#define BAUDRATES       "9600,19200,38400,4800,2400,1200"
+#define MAX_BAUDRATES   8
+#define MAX_SLAVE_ADDR  247
+#define SETTINGS_ADDR   MB_RAW_RELAY_ADDR
+
+/* Response turnaround allowed on top of the frame times in ms */
+#define SCAN_TURNAROUND 10
+
+/* Request and response frame of a probe in characters */
+#define PROBE_CHARS     (8 + 7)
+
+/* Probe results besides 0 (value) and the exception code */
+#define PROBE_SILENCE   -1
+#define PROBE_NOISE     -2
+
+/* Device found */
+typedef struct {
+    int baudrate;
+    int fc3;          /* probe results */
+    int fc4;
+    uint16_t reg3;
+    uint16_t reg4;
+    int time;         /* response time in us */
+} device_t;
+
+static device_t device[SETTINGS_ADDR+1];
+
+/* Silence after an answer before the next request (t3.5) in us */
+static int frame_gap;
+
+
+uint64_t now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
+
+
+int probe(modbus_t *mb, int addr, int fc, uint16_t *val)
+{
+    uint8_t req[MB_RAW_REQ_SIZE];
+    uint8_t rsp[MB_RAW_RSP_SIZE];
+    mb_frame_t frame;
+    int rc;
+
+    /* The reserved address is beyond the libmodbus slave range */
+    if (addr == SETTINGS_ADDR)
+    {
+        rc = mb_raw_transact(mb, req, mb_raw_read(req, addr, fc, 0, 1), rsp, &frame);
+        if (rc == 0)
+            *val = mb_frame_reg(&frame, 0);
+    }
+    else
+    {
+        modbus_set_slave(mb, addr);
+        if (fc == MODBUS_FC_READ_HOLDING_REGISTERS)
+            rc = modbus_read_registers(mb, 0, 1, val);
+        else
+            rc = modbus_read_input_registers(mb, 0, 1, val);
+        rc = (rc == 1) ? 0 : -1;
+    }
+
+    if (rc == 0)
+        return 0;
+    if ((errno > MODBUS_ENOBASE) && (errno < MODBUS_ENOBASE + MODBUS_EXCEPTION_MAX))
+        return errno - MODBUS_ENOBASE;
+
+    if (errno == ETIMEDOUT)
+        return PROBE_SILENCE;
+
+    /* Drop the rest of the frame */
+    modbus_flush(mb);
+    return PROBE_NOISE;
+}
+
+
+int probe_device(modbus_t *mb, int addr, int baudrate, int timeout)
+{
+    device_t *dev = &device[addr];
+    uint64_t start;
+    int rc;
+
+    modbus_set_response_timeout(mb, timeout/1000000, timeout%1000000);
+    start = now_us();
+    rc = probe(mb, addr, MODBUS_FC_READ_HOLDING_REGISTERS, &dev->reg3);
+    if (rc < 0)
+        return rc;
+
+    /* The device is there, see how it answers */
+    dev->baudrate = baudrate;
+    dev->fc3 = rc;
+    dev->time = now_us() - start;
+    usleep(frame_gap);
+    modbus_set_response_timeout(mb, MB_RSP_TIMEOUT, 0);
+    dev->fc4 = probe(mb, addr, MODBUS_FC_READ_INPUT_REGISTERS, &dev->reg4);
+    usleep(frame_gap);
+
+    return 0;
+}
+
+
+const char* result_str(int rc, uint16_t val)
+{
+    static char str[2][32];
+    static int n;
+
+    n ^= 1;
+    if (rc == 0)
+        snprintf(str[n], sizeof(str[n]), "0x%04X (%d)", val, val);
+    else if (rc == PROBE_SILENCE)
+        snprintf(str[n], sizeof(str[n]), "no answer");
+    else if (rc == PROBE_NOISE)
+        snprintf(str[n], sizeof(str[n]), "bad frame");
+    else
+        snprintf(str[n], sizeof(str[n]), "exception %d", rc);
+
+    return str[n];
+}
+
+
+void report(int addr, int timeout)
+{
+    device_t *dev = &device[addr];
+
+    printf("   slave %d: holding reg 0: %s, input reg 0: %s, response %d.%d ms%s\n", addr,
+           result_str(dev->fc3, dev->reg3), result_str(dev->fc4, dev->reg4),
+           dev->time/1000, (dev->time%1000)/100,
+           (dev->time > timeout) ? ", slower than the probe timeout" : "");
+}
+
+
+int scan_addr(modbus_t *mb, int addr, int prev, int baudrate, int timeout, int *noise)
+{
+    int found = 0;
+    int rc;
+
+    if (device[addr].baudrate != 0)
+        return 0;
+
+    rc = probe_device(mb, addr, baudrate, timeout);
+
+    /* A slow device may have answered the previous probe after the 
+       timeout, probe both again with the full response timeout */
+    if (rc == PROBE_NOISE)
+    {
+        (*noise)++;
+        usleep(frame_gap);
+        modbus_flush(mb);
+        if ((prev > 0) && (device[prev].baudrate == 0) &&
+            (probe_device(mb, prev, baudrate, MB_RSP_TIMEOUT*1000000) == 0))
+        {
+            report(prev, timeout);
+            found++;
+        }
+        rc = probe_device(mb, addr, baudrate, MB_RSP_TIMEOUT*1000000);
+    }
+
+    if (rc == 0)
+    {
+        report(addr, timeout);
+        found++;
+    }
+
+    return found;
+}
+
+
+int main(int argc, char* argv[])
+{
+    modbus_t *mb;
+    mb_conn_t conn;
+    mb_timing_t timing;
+    const char *device_name = SERIAL_PORT;
+    char baudrates[64] = BAUDRATES;
+    int baudrate[MAX_BAUDRATES];
+    int num_baudrates = 0;
+    int first_addr = 1;
+    int last_addr = MAX_SLAVE_ADDR;
+    int turnaround = SCAN_TURNAROUND;
+    int timeout;
+    int found = 0;
+    int noise;
+    uint64_t start;
+    char *p;
+    int opt, i, b, addr;
+
+
+    /**************************************************************
+     * Parse input parameters
+     **************************************************************/
+
+    while ((opt = getopt(argc, argv, "d:b:a:t:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'd':
+                device_name = optarg;
+                break;
+            case 'b':
+                snprintf(baudrates, sizeof(baudrates), "%s", optarg);
+                break;
+            case 'a':
+                if (sscanf(optarg, "%d-%d", &first_addr, &last_addr) == 1)
+                    last_addr = first_addr;
+                break;
+            case 't':
+                turnaround = atoi(optarg);
+                break;
+            default:
+                argc = 0;
+        }
+    }
+
+    for (p=strtok(baudrates, ","); (p != NULL) && (num_baudrates < MAX_BAUDRATES); p=strtok(NULL, ","))
+        baudrate[num_baudrates++] = atoi(p);
+
+    if ((argc == 0) || (optind < argc))
+    {
+        printf("Modbus RTU bus scan tool, ver %s (using libmodbus %s)\n\n", VERSION, LIBMODBUS_VERSION_STRING);
+        printf("usage: mbscan [-d <device>] [-b <baudrate>[,<baudrate>...]] [-a <first_addr>[-<last_addr>]] [-t <turnaround_ms>]\n");
+        printf("   device:      serial port, default %s\n", SERIAL_PORT);
+        printf("   baudrate:    baudrates to scan, default %s\n", BAUDRATES);
+        printf("   first_addr, last_addr: slave addresses to scan, default 1-%d,\n", MAX_SLAVE_ADDR);
+        printf("                the reserved address %d of relay cards in settings mode\n", SETTINGS_ADDR);
+        printf("                is always scanned\n");
+        printf("   turnaround:  response time allowed beyond the frame times, default %d ms\n", SCAN_TURNAROUND);
+        return 0;
+    }
+
+    for (b=0; b<num_baudrates; b++)
+    {
+        if (baudrate[b] <= 0)
+        {
+            printf("Invalid baudrate %d\n", baudrate[b]);
+            return -1;
+        }
+    }
+
+    if ((first_addr < 1) || (last_addr > MAX_SLAVE_ADDR) || (first_addr > last_addr))
+    {
+        printf("Invalid slave address range %d-%d\n", first_addr, last_addr);
+        return -1;
+    }
+
+    if (turnaround < 1)
+    {
+        printf("Invalid turnaround %d\n", turnaround);
+        return -1;
+    }
+
+
+    /**************************************************************
+     * Scan all baudrates
+     **************************************************************/
+
+    start = now_us();
+    for (b=0; b<num_baudrates; b++)
+    {
+        mb_init_rtu(&conn, device_name, baudrate[b]);
+        conn.debug = DEBUG;
+        mb_rtu_timing(&conn, &timing);
+        timeout = PROBE_CHARS*timing.char_time + timing.t35 + turnaround*1000;
+        frame_gap = timing.t35;
+
+        printf("Scanning %s at %d baud, probe timeout %d.%d ms, about %d s\n", device_name, 
+               baudrate[b], timeout/1000, (timeout%1000)/100, 
+               (last_addr-first_addr+2)*timeout/1000000 + 1);
+
+        mb = mb_connect(&conn, SETTINGS_ADDR);
+        if (mb == NULL)
+            return -1;
+
+        /* The reserved address first, the slave address is still unset */
+        noise = 0;
+        found += scan_addr(mb, SETTINGS_ADDR, 0, baudrate[b], timeout, &noise);
+        for (addr=first_addr; addr<=last_addr; addr++)
+            found += scan_addr(mb, addr, (addr > first_addr) ? addr-1 : 0, 
+                               baudrate[b], timeout, &noise);
+
+        if (noise > 0)
+            printf("   %d bad frames, devices with another baudrate or frame format?\n", noise);
+
+        modbus_close(mb);
+        modbus_free(mb);
+    }
+
+
+    /**************************************************************
+     * Report devices found
+     **************************************************************/
+
+    printf("\nFound %d device(s) in %.1f s\n", found, (now_us() - start)/1e6);
+    for (i=1; i<=SETTINGS_ADDR; i++)
+    {
+        if (device[i].baudrate == 0)
+            continue;
+        printf("   slave %3d at %5d baud%s\n", i, device[i].baudrate,
+               (i == SETTINGS_ADDR) ? " (relay card in settings mode)" : "");
+    }
+
+    return 0;
+}
@@ -0,0 +1,356 @@
+/*****************************************************************
+ * Modbus RTU bus simulator
+ *
+ * Connects the Modbus tools through pseudo terminals instead of a
+ * real RS485 bus, e.g. mbm and mbs for a benchmark (see mbbench).
+ * Every port is a pty whose slave side is linked as <prefix><n>,
+ * the tools open these links as their serial device. Like on a
+ * two wire bus, a byte sent on one port is received on all others.
+ *
+ * The line time of the baudrate is simulated: the bus carries one
+ * character at a time, a byte is delivered one character time
+ * (start, data, parity and stop bits, see mb_rtu_timing()) after
+ * the previous one has left the bus, or after it was sent if the
+ * bus was idle. Delivery times are absolute, so the simulated line
+ * rate does not drift with the wakeup latency of this process.
+ * Bytes sent while another port is still on the bus are delivered
+ * after it and counted as collisions, a real bus would garble them.
+ *
+ * Statistics of the bus are printed on exit (SIGINT, SIGTERM).
+ *
+ * Author: Ondrej Wisniewski
+ *
+ * Build with this command:
+ * gcc mbsim.c mbcommon.c -o mbsim -lmodbus
+ *
+ * History:
+ * 14/10/2026: First release
+ *
+ *****************************************************************/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <termios.h>
+#include <modbus/modbus.h>
+#include "mbcommon.h"
+
+
+#define VERSION       "0.1"
+
+/* Debug mode */
+#define DEBUG         0
+
+#define LINK_PREFIX   "/tmp/mbsim"
+#define MAX_PORTS     8
+
+/* Bytes on their way over the bus, a power of two */
+#define BUS_SIZE      4096
+
+/* Simulated bus port */
+typedef struct {
+   int master;             /* pty master, read and written here */
+   int slave;              /* kept open, so the master never hangs up */
+   char link[64];
+} port_t;
+
+/* Byte on the bus */
+typedef struct {
+   uint8_t byte;
+   uint8_t src;            /* port which sent it */
+   uint64_t due;           /* delivery time (monotonic clock, ns) */
+} bus_byte_t;
+
+static port_t port[MAX_PORTS];
+static int num_ports;
+
+static bus_byte_t bus[BUS_SIZE];
+static unsigned int head;          /* next byte to deliver */
+static unsigned int tail;          /* next free slot */
+static uint64_t last_due;          /* delivery time of the last byte queued */
+static int last_src = -1;
+
+/* Bus statistics */
+static uint64_t start_time;
+static uint64_t busy_time;
+static uint64_t num_bytes;
+static uint64_t num_frames;
+static uint64_t collisions;
+static uint64_t dropped;
+
+static volatile sig_atomic_t cont=1;
+
+
+uint64_t time_now(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
+
+int open_port(port_t *p, const char *link)
+{
+   struct termios tio;
+   const char *name;
+
+   p->master = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+   if ((p->master == -1) || (grantpt(p->master) != 0) || (unlockpt(p->master) != 0) ||
+       ((name = ptsname(p->master)) == NULL))
+   {
+      printf("Unable to create pty: %s\n", strerror(errno));
+      return -1;
+   }
+
+   /* Raw line, the tools set their own attributes when they open it */
+   p->slave = open(name, O_RDWR | O_NOCTTY);
+   if ((p->slave == -1) || (tcgetattr(p->slave, &tio) != 0))
+   {
+      printf("Unable to open %s: %s\n", name, strerror(errno));
+      return -1;
+   }
+   cfmakeraw(&tio);
+   tcsetattr(p->slave, TCSANOW, &tio);
+
+   snprintf(p->link, sizeof(p->link), "%s", link);
+   unlink(p->link);
+   if (symlink(name, p->link) != 0)
+   {
+      printf("Unable to link %s to %s: %s\n", p->link, name, strerror(errno));
+      p->link[0] = '\0';
+      return -1;
+   }
+
+   printf("port %d: %s -> %s\n", (int)(p - port), p->link, name);
+   return 0;
+}
+
+
+void close_port(port_t *p)
+{
+   if (p->link[0] != '\0')
+      unlink(p->link);
+   if (p->slave != -1)
+      close(p->slave);
+   if (p->master != -1)
+      close(p->master);
+}
+
+
+void send_bytes(int src, const uint8_t *buf, int length, int char_time, int t35)
+{
+   uint64_t now = time_now();
+   int i;
+
+   /* A silence of t3.5 before the byte starts a new frame */
+   if (now >= last_due + (uint64_t)t35*1000)
+      num_frames++;
+   else if ((src != last_src) && (now < last_due))
+      collisions++;
+
+   if (last_due < now)
+      last_due = now;
+
+   for (i=0; i<length; i++)
+   {
+      if (tail - head == BUS_SIZE)
+      {
+         dropped += length - i;
+         break;
+      }
+      last_due += (uint64_t)char_time*1000;
+      busy_time += (uint64_t)char_time*1000;
+      bus[tail % BUS_SIZE].byte = buf[i];
+      bus[tail % BUS_SIZE].src = src;
+      bus[tail % BUS_SIZE].due = last_due;
+      tail++;
+   }
+   num_bytes += i;
+   last_src = src;
+}
+
+
+void deliver_bytes(void)
+{
+   uint8_t buf[BUS_SIZE];
+   uint64_t now = time_now();
+   int src, n, i;
+
+   /* Runs of bytes from one port which are due, written at once */
+   while ((head != tail) && (bus[head % BUS_SIZE].due <= now))
+   {
+      src = bus[head % BUS_SIZE].src;
+      for (n=0; (head != tail) && (bus[head % BUS_SIZE].due <= now) &&
+                (bus[head % BUS_SIZE].src == src); n++, head++)
+         buf[n] = bus[head % BUS_SIZE].byte;
+
+      for (i=0; i<num_ports; i++)
+      {
+         /* A port nobody reads from must not stop the bus */
+         if ((i != src) && (write(port[i].master, buf, n) != n))
+            dropped += n;
+      }
+
+      if (DEBUG)
+         printf("DBG: %d byte(s) from port %d delivered\n", n, src);
+   }
+}
+
+
+void stop(int sig)
+{
+   (void)sig;
+   cont = 0;
+}
+
+
+int main(int argc, char* argv[])
+{
+   struct pollfd pfd[MAX_PORTS];
+   struct timespec ts, *timeout;
+   const char *prefix = LINK_PREFIX;
+   char link[64];
+   uint8_t buf[256];
+   mb_conn_t conn;
+   mb_timing_t timing;
+   struct sigaction sa;
+   uint64_t now, elapsed;
+   int baudrate;
+   int i, n, rc=0;
+
+
+   /* Options come before the positional parameters */
+   while ((i = getopt(argc, argv, "l:")) != -1)
+   {
+      if (i == 'l')
+         prefix = optarg;
+      else
+         argc = 0;
+   }
+
+   if (argc - optind < 1)
+   {
+      printf("Modbus RTU bus simulator, ver %s\n", VERSION);
+      printf("usage: mbsim [-l <link_prefix>] <baudrate> [<num_ports>]\n\n");
+      printf("Creates <num_ports> (default 2, max %d) ports of a simulated RS485 bus,\n", MAX_PORTS);
+      printf("linked as <link_prefix><n> (default %s<n>), and carries the bytes\n", LINK_PREFIX);
+      printf("between them at the line rate of <baudrate>, 8N1\n");
+      return 0;
+   }
+
+   i = optind;
+   baudrate = atoi(argv[i++]);
+   num_ports = (argc > i) ? atoi(argv[i++]) : 2;
+   if ((baudrate <= 0) || (num_ports < 2) || (num_ports > MAX_PORTS))
+   {
+      printf("Invalid baudrate or number of ports\n");
+      return -1;
+   }
+
+   /* Same frame format and timing profile as the tools */
+   mb_init_rtu(&conn, "", baudrate);
+   mb_rtu_timing(&conn, &timing);
+
+
+   /**************************************************************
+    * Create the bus ports
+    **************************************************************/
+
+   for (i=0; i<num_ports; i++)
+   {
+      port[i].master = port[i].slave = -1;
+      port[i].link[0] = '\0';
+   }
+   for (i=0; i<num_ports; i++)
+   {
+      snprintf(link, sizeof(link), "%s%d", prefix, i);
+      if (open_port(&port[i], link) != 0)
+         break;
+      pfd[i].fd = port[i].master;
+      pfd[i].events = POLLIN;
+   }
+   if (i < num_ports)
+   {
+      for (i=0; i<num_ports; i++)
+         close_port(&port[i]);
+      return -1;
+   }
+
+   /* The ports can be opened now */
+   printf("ready at %d baud, character %dus, t3.5 %dus\n", baudrate, timing.char_time, timing.t35);
+   fflush(stdout);
+
+
+   /**************************************************************
+    * Main loop
+    **************************************************************/
+
+   memset(&sa, 0, sizeof(sa));
+   sa.sa_handler = stop;
+   sigaction(SIGINT, &sa, NULL);
+   sigaction(SIGTERM, &sa, NULL);
+
+   start_time = time_now();
+   while (cont)
+   {
+      /* Wake up for new bytes, or when the next byte is due */
+      timeout = NULL;
+      if (head != tail)
+      {
+         now = time_now();
+         elapsed = (bus[head % BUS_SIZE].due > now) ? bus[head % BUS_SIZE].due - now : 0;
+         ts.tv_sec = elapsed/1000000000;
+         ts.tv_nsec = elapsed%1000000000;
+         timeout = &ts;
+      }
+
+      n = ppoll(pfd, num_ports, timeout, NULL);
+      if (n == -1)
+      {
+         if (errno == EINTR)
+            continue;
+         printf("ppoll() failed: %s\n", strerror(errno));
+         rc = -1;
+         break;
+      }
+
+      for (i=0; (i<num_ports) && (n>0); i++)
+      {
+         if (!(pfd[i].revents & POLLIN))
+            continue;
+
+         /* EIO while the tool of this port has the pty closed */
+         rc = read(port[i].master, buf, sizeof(buf));
+         if (rc > 0)
+            send_bytes(i, buf, rc, timing.char_time, timing.t35);
+         rc = 0;
+      }
+
+      deliver_bytes();
+   }
+
+
+   /**************************************************************
+    * Clean up end exit
+    **************************************************************/
+
+   elapsed = time_now() - start_time;
+   printf("%llu bytes in %llu frames in %.1f s, bus busy %.1f%%, %llu collisions, %llu bytes dropped\n",
+          (unsigned long long)num_bytes, (unsigned long long)num_frames, elapsed/1e9,
+          elapsed ? 100.0*busy_time/elapsed : 0.0,
+          (unsigned long long)collisions, (unsigned long long)dropped);
+
+   for (i=0; i<num_ports; i++)
+      close_port(&port[i]);
+
+   return rc;
+}
@@ -0,0 +1,299 @@
+/*****************************************************************
+ * Transaction statistics of the Modbus tools
+ *
+ * Counts the transactions of every slave by outcome and keeps a
+ * histogram of their times: the round trip time of a request in
+ * mbm, the service time of a request in mbs. The histogram is
+ * log-linear like HdrHistogram, each power of two of microseconds
+ * is split into 2^MB_STATS_SUB_BITS buckets, so the memory is fixed
+ * and a sample costs a bit scan and an increment. The whole table
+ * is static, slots are taken when a slave is first seen.
+ *
+ * Each slot is written by the one thread which talks to the slave,
+ * without locks. A dump taken meanwhile may be off by the
+ * transactions in progress.
+ *
+ * mb_stats_start() writes all statistics in the Prometheus text
+ * format on every SIGUSR1, to a file (replaced atomically, e.g. for
+ * the textfile collector of the node exporter) or to stderr:
+ *
+ *   <prefix>_requests_total{bus="0",slave="1"} 1200
+ *   <prefix>_exceptions_total, _timeouts_total, _crc_errors_total,
+ *   <prefix>_errors_total
+ *   <prefix>_<time>_seconds_bucket{bus="0",slave="1",le="0.001024"} 1187
+ *   <prefix>_<time>_seconds_sum, _count
+ *   <prefix>_<time>_quantile_seconds{bus="0",slave="1",quantile="0.99"}
+ *
+ * Histogram buckets are exported at powers of two of microseconds,
+ * which are bucket boundaries, so the cumulative counts are exact.
+ * Statistics of a bus which are not of a single slave, e.g. frames
+ * with a bad CRC received by mbs, come without the slave label.
+ *
+ * Author: Ondrej Wisniewski
+ *
+ * History:
+ * 14/10/2026: First release
+ *
+ *****************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <syslog.h>
+#include <pthread.h>
+#include "mbcommon.h"
+#include "mbstats.h"
+
+
+/* Exported histogram buckets, 2^n us */
+#define PROM_FIRST_BUCKET   6
+#define PROM_LAST_BUCKET    (MB_STATS_MAX_MSB+1)
+
+static const double quantile[] = { 0.5, 0.9, 0.99, 0.999 };
+
+static mb_stats_slave_t slot[MB_STATS_MAX_SLAVES];
+static int num_slots;
+
+static const char *metric_prefix = "mb";
+static const char *metric_time = "response";
+static const char *metric_help = "Response time";
+static const char *dump_file;
+
+
+void mb_stats_init(const char *prefix, const char *time_name, const char *time_help)
+{
+   metric_prefix = prefix;
+   metric_time = time_name;
+   metric_help = time_help;
+}
+
+
+mb_stats_slave_t* mb_stats_slave(int bus, int slave_addr)
+{
+   mb_stats_slave_t *s;
+   int i, n;
+
+   n = __atomic_load_n(&num_slots, __ATOMIC_ACQUIRE);
+   for (i=0; (i<n) && (i<MB_STATS_MAX_SLAVES); i++)
+   {
+      if (__atomic_load_n(&slot[i].valid, __ATOMIC_ACQUIRE) &&
+          (slot[i].bus == bus) && (slot[i].slave_addr == slave_addr))
+         return &slot[i];
+   }
+
+   /* Workers of different buses may take slots at the same time */
+   i = __atomic_fetch_add(&num_slots, 1, __ATOMIC_ACQ_REL);
+   if (i >= MB_STATS_MAX_SLAVES)
+      return NULL;
+
+   s = &slot[i];
+   s->bus = bus;
+   s->slave_addr = slave_addr;
+   __atomic_store_n(&s->valid, 1, __ATOMIC_RELEASE);
+
+   return s;
+}
+
+
+uint64_t mb_stats_bucket_value(int bucket)
+{
+   int shift;
+
+   /* Highest time counted in the bucket */
+   if (bucket < (2 << MB_STATS_SUB_BITS))
+      return bucket;
+
+   shift = (bucket >> MB_STATS_SUB_BITS) - 1;
+   return (((uint64_t)(bucket & ((1 << MB_STATS_SUB_BITS) - 1)) + (1 << MB_STATS_SUB_BITS) + 1) << shift) - 1;
+}
+
+
+static void put_labels(FILE *f, const mb_stats_slave_t *s)
+{
+   fprintf(f, "{bus=\"%d\"", s->bus);
+   if (s->slave_addr != MB_STATS_NO_SLAVE)
+      fprintf(f, ",slave=\"%d\"", s->slave_addr);
+}
+
+
+static void put_counter(FILE *f, const char *name, const char *help, size_t offset, int n)
+{
+   int i;
+
+   fprintf(f, "# HELP %s_%s %s\n", metric_prefix, name, help);
+   fprintf(f, "# TYPE %s_%s counter\n", metric_prefix, name);
+   for (i=0; i<n; i++)
+   {
+      if (!slot[i].valid)
+         continue;
+      fprintf(f, "%s_%s", metric_prefix, name);
+      put_labels(f, &slot[i]);
+      fprintf(f, "} %llu\n", (unsigned long long)*(const uint64_t *)((const char *)&slot[i] + offset));
+   }
+}
+
+
+static void put_histogram(FILE *f, const mb_stats_slave_t *s)
+{
+   uint64_t count = 0;
+   int b = 0;
+   int k;
+
+   for (k=PROM_FIRST_BUCKET; k<=PROM_LAST_BUCKET; k++)
+   {
+      /* All buckets below 2^k us */
+      for (; (b < MB_STATS_BUCKETS) && (mb_stats_bucket_value(b) < (1ULL << k)); b++)
+         count += s->hist[b];
+      fprintf(f, "%s_%s_seconds_bucket", metric_prefix, metric_time);
+      put_labels(f, s);
+      fprintf(f, ",le=\"%.6f\"} %llu\n", (double)(1ULL << k)/1e6, (unsigned long long)count);
+   }
+   for (; b < MB_STATS_BUCKETS; b++)
+      count += s->hist[b];
+
+   fprintf(f, "%s_%s_seconds_bucket", metric_prefix, metric_time);
+   put_labels(f, s);
+   fprintf(f, ",le=\"+Inf\"} %llu\n", (unsigned long long)count);
+   fprintf(f, "%s_%s_seconds_sum", metric_prefix, metric_time);
+   put_labels(f, s);
+   fprintf(f, "} %.6f\n", s->time_sum/1e6);
+   fprintf(f, "%s_%s_seconds_count", metric_prefix, metric_time);
+   put_labels(f, s);
+   fprintf(f, "} %llu\n", (unsigned long long)count);
+}
+
+
+static void put_quantiles(FILE *f, const mb_stats_slave_t *s)
+{
+   uint64_t total = 0, count, rank;
+   int b, q;
+
+   for (b=0; b<MB_STATS_BUCKETS; b++)
+      total += s->hist[b];
+   if (total == 0)
+      return;
+
+   /* Upper bound of the bucket holding the sample of that rank */
+   for (q=0; q<(int)(sizeof(quantile)/sizeof(quantile[0])); q++)
+   {
+      rank = (uint64_t)(quantile[q]*total + 0.5);
+      if (rank < 1)
+         rank = 1;
+      for (b=0, count=0; (b < MB_STATS_BUCKETS-1) && (count + s->hist[b] < rank); b++)
+         count += s->hist[b];
+
+      fprintf(f, "%s_%s_quantile_seconds", metric_prefix, metric_time);
+      put_labels(f, s);
+      fprintf(f, ",quantile=\"%g\"} %.6f\n", quantile[q], mb_stats_bucket_value(b)/1e6);
+   }
+}
+
+
+static void put_stats(FILE *f)
+{
+   int i, n;
+
+   n = __atomic_load_n(&num_slots, __ATOMIC_ACQUIRE);
+   if (n > MB_STATS_MAX_SLAVES)
+      n = MB_STATS_MAX_SLAVES;
+
+   put_counter(f, "requests_total", "Transactions",
+               offsetof(mb_stats_slave_t, requests), n);
+   put_counter(f, "exceptions_total", "Exception responses",
+               offsetof(mb_stats_slave_t, exceptions), n);
+   put_counter(f, "timeouts_total", "Transactions without a response",
+               offsetof(mb_stats_slave_t, timeouts), n);
+   put_counter(f, "crc_errors_total", "Frames with a bad CRC",
+               offsetof(mb_stats_slave_t, crc_errors), n);
+   put_counter(f, "errors_total", "Transactions failed otherwise",
+               offsetof(mb_stats_slave_t, errors), n);
+
+   fprintf(f, "# HELP %s_%s_seconds %s of responses and exception responses\n",
+           metric_prefix, metric_time, metric_help);
+   fprintf(f, "# TYPE %s_%s_seconds histogram\n", metric_prefix, metric_time);
+   for (i=0; i<n; i++)
+   {
+      if (slot[i].valid)
+         put_histogram(f, &slot[i]);
+   }
+
+   fprintf(f, "# HELP %s_%s_quantile_seconds %s quantiles, upper bound of the histogram bucket\n",
+           metric_prefix, metric_time, metric_help);
+   fprintf(f, "# TYPE %s_%s_quantile_seconds gauge\n", metric_prefix, metric_time);
+   for (i=0; i<n; i++)
+   {
+      if (slot[i].valid)
+         put_quantiles(f, &slot[i]);
+   }
+}
+
+
+int mb_stats_dump(void)
+{
+   char tmp[256];
+   FILE *f;
+
+   if ((dump_file == NULL) || (strcmp(dump_file, "-") == 0))
+   {
+      put_stats(stderr);
+      fflush(stderr);
+      return 0;
+   }
+
+   /* Readers never see a partly written file */
+   snprintf(tmp, sizeof(tmp), "%s.tmp", dump_file);
+   f = fopen(tmp, "w");
+   if (f == NULL)
+   {
+      mb_log(LOG_ERR, "Unable to write statistics to %s: %s\n", tmp, strerror(errno));
+      return -1;
+   }
+   put_stats(f);
+   if ((fclose(f) != 0) || (rename(tmp, dump_file) != 0))
+   {
+      mb_log(LOG_ERR, "Unable to write statistics to %s: %s\n", dump_file, strerror(errno));
+      unlink(tmp);
+      return -1;
+   }
+
+   return 0;
+}
+
+
+static void* dump_thread(void *arg)
+{
+   sigset_t *set = arg;
+   int sig;
+
+   while (sigwait(set, &sig) == 0)
+      mb_stats_dump();
+
+   return NULL;
+}
+
+
+int mb_stats_start(const char *filename)
+{
+   static sigset_t set;
+   pthread_t thread;
+
+   dump_file = filename;
+
+   /* Blocked in this and all threads created later, only the
+      dump thread takes the signal and the I/O is done there */
+   sigemptyset(&set);
+   sigaddset(&set, SIGUSR1);
+   pthread_sigmask(SIG_BLOCK, &set, NULL);
+   if (pthread_create(&thread, NULL, dump_thread, &set) != 0)
+   {
+      mb_log(LOG_ERR, "Unable to start the statistics thread\n");
+      return -1;
+   }
+   pthread_detach(thread);
+
+   return 0;
+}
@@ -0,0 +1,90 @@
+/*****************************************************************
+ * Transaction statistics of the Modbus tools
+ *
+ * Author: Ondrej Wisniewski
+ *
+ * History:
+ * 14/10/2026: First release
+ *
+ *****************************************************************/
+
+#ifndef MBSTATS_H
+#define MBSTATS_H
+
+#include <stdint.h>
+#include <errno.h>
+#include <modbus/modbus.h>
+
+
+/* Slaves with statistics, the table has a fixed size */
+#define MB_STATS_MAX_SLAVES   256
+
+/* Statistics of a bus which are not of a single slave */
+#define MB_STATS_NO_SLAVE     -1
+
+/* Time histogram in us: exact below 2^(SUB_BITS+1), then 2^SUB_BITS
+   buckets per power of two (12.5% resolution) up to 2^(MAX_MSB+1) */
+#define MB_STATS_SUB_BITS     3
+#define MB_STATS_MAX_MSB      24
+#define MB_STATS_MAX_TIME     ((1ULL << (MB_STATS_MAX_MSB+1)) - 1)
+#define MB_STATS_BUCKETS      ((MB_STATS_MAX_MSB - MB_STATS_SUB_BITS + 2) << MB_STATS_SUB_BITS)
+
+/* Statistics of one slave, written by one thread only */
+typedef struct {
+   int bus;                /* serial bus or gateway index */
+   int slave_addr;         /* or MB_STATS_NO_SLAVE */
+   int valid;              /* set once the slot is filled in */
+   uint64_t requests;
+   uint64_t exceptions;
+   uint64_t timeouts;
+   uint64_t crc_errors;
+   uint64_t errors;        /* any other failure */
+   uint64_t time_sum;      /* of the timed transactions in us */
+   uint32_t hist[MB_STATS_BUCKETS];
+} mb_stats_slave_t;
+
+
+void mb_stats_init(const char *prefix, const char *time_name, const char *time_help);
+mb_stats_slave_t* mb_stats_slave(int bus, int slave_addr);
+uint64_t mb_stats_bucket_value(int bucket);
+int mb_stats_dump(void);
+int mb_stats_start(const char *filename);
+
+
+static inline int mb_stats_bucket(uint64_t time)
+{
+   int msb;
+
+   if (time < (2 << MB_STATS_SUB_BITS))
+      return time;
+   if (time > MB_STATS_MAX_TIME)
+      time = MB_STATS_MAX_TIME;
+
+   msb = 63 - __builtin_clzll(time);
+   return ((msb - MB_STATS_SUB_BITS) << MB_STATS_SUB_BITS) + (int)(time >> (msb - MB_STATS_SUB_BITS));
+}
+
+
+/* Count a transaction, responses and exception responses are timed */
+static inline void mb_stats_record(mb_stats_slave_t *s, uint64_t time, int err)
+{
+   if (s == NULL)
+      return;
+
+   s->requests++;
+   if ((err == 0) || ((err > MODBUS_ENOBASE) && (err < MODBUS_ENOBASE + MODBUS_EXCEPTION_MAX)))
+   {
+      if (err != 0)
+         s->exceptions++;
+      s->hist[mb_stats_bucket(time)]++;
+      s->time_sum += time;
+   }
+   else if ((err == ETIMEDOUT) || (err == EMBXGTAR))
+      s->timeouts++;
+   else if (err == EMBBADCRC)
+      s->crc_errors++;
+   else
+      s->errors++;
+}
+
+#endif
@@ -0,0 +1,440 @@
+/*****************************************************************
+ * Non-blocking Modbus TCP master engine
+ *
+ * Keeps a window of requests in flight on each gateway connection
+ * instead of waiting a full round trip per transaction. Responses
+ * are matched to their request by the MBAP transaction identifier,
+ * so they may arrive in any order, and every request has its own
+ * response timeout. A response arriving after its timeout is
+ * dropped. One thread drives all gateways with a single poll().
+ *
+ * The gateway is resolved once at startup. The connection is
+ * opened by the first request and reopened by the next request
+ * after an error, trying every address of the gateway in turn;
+ * requests in flight when the connection fails are completed with
+ * the error. A request which times out before it was sent is
+ * removed from the transmit buffer, one which was sent in part
+ * fails the connection, as the stream can't be resynchronised.
+ *
+ * Author: Ondrej Wisniewski
+ *
+ * History:
+ * 14/10/2026: First release
+ * 14/10/2026: Resolve the gateway once, try all its addresses,
+ *             bounded transmit buffer and connect timeout
+ *
+ *****************************************************************/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "mbtcp.h"
+
+
+/* Debug mode */
+#define DEBUG         0
+
+/* MBAP header incl. unit identifier */
+#define MBAP_LENGTH   7
+
+
+static uint64_t now_us(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
+
+
+int mbtcp_init(mbtcp_t *gw, const char *host, int port, int window)
+{
+   struct addrinfo hints;
+   char service[8];
+   int rc;
+
+   memset(gw, 0, sizeof(*gw));
+   gw->fd = -1;
+   snprintf(gw->host, sizeof(gw->host), "%s", host);
+   gw->port = port;
+   gw->window = (window < 1) ? 1 : (window > MBTCP_MAX_WINDOW) ? MBTCP_MAX_WINDOW : window;
+
+   /* Resolve here, a blocking lookup in mbtcp_run() would stall all gateways */
+   memset(&hints, 0, sizeof(hints));
+   hints.ai_family = AF_UNSPEC;
+   hints.ai_socktype = SOCK_STREAM;
+   snprintf(service, sizeof(service), "%d", port);
+
+   rc = getaddrinfo(host, service, &hints, &gw->addr);
+   if (rc != 0)
+   {
+      gw->addr = NULL;
+      errno = (rc == EAI_SYSTEM) ? errno : EHOSTUNREACH;
+      return -1;
+   }
+
+   return 0;
+}
+
+
+int mbtcp_free_slots(const mbtcp_t *gw)
+{
+   return gw->window - gw->in_flight;
+}
+
+
+static int gw_connect(mbtcp_t *gw, struct addrinfo *ai)
+{
+   int one = 1;
+   int rc, err = EHOSTUNREACH;
+
+   /* Start a connect to the first address from ai which doesn't fail at once */
+   for (; ai != NULL; ai = ai->ai_next)
+   {
+      gw->fd = socket(ai->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+      if (gw->fd == -1)
+      {
+         err = errno;
+         continue;
+      }
+
+      /* Pipelined requests must not wait for the acknowledge of the previous one */
+      setsockopt(gw->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+      rc = connect(gw->fd, ai->ai_addr, ai->ai_addrlen);
+      if ((rc == -1) && (errno != EINPROGRESS))
+      {
+         err = errno;
+         close(gw->fd);
+         gw->fd = -1;
+         continue;
+      }
+
+      gw->cur = ai;
+      gw->connecting = (rc == -1);
+      gw->connect_deadline = now_us() + MBTCP_CONNECT_TIMEOUT;
+
+      if (DEBUG)
+         printf("DBG: connecting to gateway %s:%d\n", gw->host, gw->port);
+
+      return 0;
+   }
+
+   gw->cur = NULL;
+   errno = err;
+   return -1;
+}
+
+
+static int gw_fail(mbtcp_t *gw, int err, mbtcp_done_t done)
+{
+   int i, n=0;
+
+   if (DEBUG)
+      printf("DBG: gateway %s:%d failed: %s\n", gw->host, gw->port, modbus_strerror(err));
+
+   if (gw->fd != -1)
+      close(gw->fd);
+   gw->fd = -1;
+   gw->cur = NULL;
+   gw->connecting = 0;
+   gw->rx_length = 0;
+   gw->tx_length = 0;
+   gw->tx_sent = 0;
+
+   /* Complete all requests in flight with the error */
+   for (i=0; i<MBTCP_MAX_WINDOW; i++)
+   {
+      if (!gw->slot[i].used)
+         continue;
+      gw->slot[i].used = 0;
+      gw->in_flight--;
+      n++;
+      if (done != NULL)
+         done(gw->slot[i].user, NULL, 0, err);
+   }
+
+   return n;
+}
+
+
+static int flush_tx(mbtcp_t *gw)
+{
+   int n;
+
+   while (gw->tx_length > 0)
+   {
+      n = send(gw->fd, gw->tx, gw->tx_length, MSG_NOSIGNAL);
+      if (n == -1)
+      {
+         if ((errno == EAGAIN) || (errno == EINTR))
+            return 0;
+         return -1;
+      }
+      gw->tx_length -= n;
+      gw->tx_sent += n;
+      memmove(gw->tx, &gw->tx[n], gw->tx_length);
+   }
+
+   return 0;
+}
+
+
+/* A connect which failed or timed out goes on with the next address,
+   nothing was sent yet, so the requests in tx stay queued */
+static int gw_retry(mbtcp_t *gw, int err, mbtcp_done_t done)
+{
+   struct addrinfo *next = gw->cur->ai_next;
+
+   close(gw->fd);
+   gw->fd = -1;
+   gw->connecting = 0;
+   if (gw_connect(gw, next) != 0)
+      return gw_fail(gw, err, done);
+
+   return 0;
+}
+
+
+/* Remove a request which timed out from tx, if any of it is still there */
+static int drop_tx(mbtcp_t *gw, mbtcp_slot_t *slot, mbtcp_done_t done)
+{
+   int i, offset;
+
+   if (slot->tx_pos + slot->tx_size <= gw->tx_sent)
+      return 0;
+
+   /* Part of the request is on the wire, the rest can't be dropped */
+   if (slot->tx_pos < gw->tx_sent)
+      return gw_fail(gw, ETIMEDOUT, done);
+
+   offset = slot->tx_pos - gw->tx_sent;
+   gw->tx_length -= slot->tx_size;
+   memmove(&gw->tx[offset], &gw->tx[offset + slot->tx_size], gw->tx_length - offset);
+   for (i=0; i<MBTCP_MAX_WINDOW; i++)
+   {
+      if (gw->slot[i].used && (gw->slot[i].tx_pos > slot->tx_pos))
+         gw->slot[i].tx_pos -= slot->tx_size;
+   }
+
+   return 0;
+}
+
+
+int mbtcp_send(mbtcp_t *gw, int unit, const uint8_t *pdu, int pdu_length,
+               uint64_t timeout, void *user)
+{
+   mbtcp_slot_t *slot;
+   uint8_t *adu;
+   int i;
+
+   if ((gw->in_flight >= gw->window) || (pdu_length < 1) ||
+       (MBAP_LENGTH + pdu_length > MODBUS_TCP_MAX_ADU_LENGTH))
+   {
+      errno = EINVAL;
+      return -1;
+   }
+
+   if (gw->tx_length + MBAP_LENGTH + pdu_length > (int)sizeof(gw->tx))
+   {
+      errno = ENOBUFS;
+      return -1;
+   }
+
+   if ((gw->fd == -1) && (gw_connect(gw, gw->addr) != 0))
+      return -1;
+
+   for (i=0; gw->slot[i].used; i++);
+   slot = &gw->slot[i];
+   slot->used     = 1;
+   slot->tid      = gw->next_tid++;
+   slot->unit     = unit;
+   slot->fc       = pdu[0];
+   slot->deadline = now_us() + timeout;
+   slot->tx_pos   = gw->tx_sent + gw->tx_length;
+   slot->tx_size  = MBAP_LENGTH + pdu_length;
+   slot->user     = user;
+   gw->in_flight++;
+
+   /* MBAP header: transaction id, protocol id 0, length, unit id */
+   adu = &gw->tx[gw->tx_length];
+   adu[0] = slot->tid >> 8;
+   adu[1] = slot->tid & 0xFF;
+   adu[2] = 0;
+   adu[3] = 0;
+   adu[4] = (pdu_length+1) >> 8;
+   adu[5] = (pdu_length+1) & 0xFF;
+   adu[6] = unit;
+   memcpy(&adu[MBAP_LENGTH], pdu, pdu_length);
+   gw->tx_length += MBAP_LENGTH + pdu_length;
+
+   /* Write errors show up as a poll event in mbtcp_run() */
+   if (!gw->connecting)
+      flush_tx(gw);
+
+   return 0;
+}
+
+
+static int read_rx(mbtcp_t *gw, mbtcp_done_t done)
+{
+   int n, i, length, err;
+   int completed = 0;
+
+   n = read(gw->fd, &gw->rx[gw->rx_length], sizeof(gw->rx) - gw->rx_length);
+   if (n == 0)
+      return gw_fail(gw, ECONNRESET, done);
+   if (n == -1)
+      return ((errno == EAGAIN) || (errno == EINTR)) ? 0 : gw_fail(gw, errno, done);
+   gw->rx_length += n;
+
+   /* Complete every request with a full response in the buffer */
+   while (gw->rx_length >= MBAP_LENGTH)
+   {
+      length = 6 + ((int)gw->rx[4]<<8 | (int)gw->rx[5]);
+      if ((gw->rx[2] != 0) || (gw->rx[3] != 0) ||
+          (length < MBAP_LENGTH+1) || (length > MODBUS_TCP_MAX_ADU_LENGTH))
+         return completed + gw_fail(gw, EMBBADDATA, done);
+      if (gw->rx_length < length)
+         break;
+
+      for (i=0; i<MBTCP_MAX_WINDOW; i++)
+      {
+         if (gw->slot[i].used && (gw->slot[i].tid == ((int)gw->rx[0]<<8 | gw->rx[1])))
+            break;
+      }
+
+      /* Responses to timed out requests are dropped */
+      if (i < MBTCP_MAX_WINDOW)
+      {
+         mbtcp_slot_t *slot = &gw->slot[i];
+
+         err = 0;
+         if ((gw->rx[6] != slot->unit) || ((gw->rx[7] & 0x7F) != slot->fc))
+            err = EMBBADDATA;
+         else if (gw->rx[7] & 0x80)
+            err = (length > MBAP_LENGTH+1) ? MODBUS_ENOBASE + gw->rx[8] : EMBBADEXC;
+
+         slot->used = 0;
+         gw->in_flight--;
+         completed++;
+         done(slot->user, err ? NULL : &gw->rx[MBAP_LENGTH], length - MBAP_LENGTH, err);
+      }
+      else if (DEBUG)
+         printf("DBG: dropped late response, tid %d\n", (int)gw->rx[0]<<8 | gw->rx[1]);
+
+      gw->rx_length -= length;
+      memmove(gw->rx, &gw->rx[length], gw->rx_length);
+   }
+
+   return completed;
+}
+
+
+int mbtcp_run(mbtcp_t *gw, int num_gw, uint64_t until, mbtcp_done_t done)
+{
+   struct pollfd pfd[MBTCP_MAX_GATEWAYS];
+   int idx[MBTCP_MAX_GATEWAYS];
+   uint64_t now, wake = until;
+   int i, k, n=0, timeout;
+   int completed = 0;
+
+   /* Wake up for the next response timeout at the latest */
+   for (i=0; i<num_gw; i++)
+   {
+      for (k=0; k<MBTCP_MAX_WINDOW; k++)
+      {
+         if (gw[i].slot[k].used && (gw[i].slot[k].deadline < wake))
+            wake = gw[i].slot[k].deadline;
+      }
+      if (gw[i].fd == -1)
+         continue;
+      if (gw[i].connecting && (gw[i].connect_deadline < wake))
+         wake = gw[i].connect_deadline;
+      pfd[n].fd = gw[i].fd;
+      pfd[n].events = POLLIN | ((gw[i].connecting || gw[i].tx_length) ? POLLOUT : 0);
+      idx[n++] = i;
+   }
+
+   now = now_us();
+   timeout = (wake <= now) ? 0 : (wake - now + 999) / 1000;
+   if (wake == UINT64_MAX)
+      timeout = -1;
+
+   if (poll(pfd, n, timeout) == -1)
+      return (errno == EINTR) ? 0 : -1;
+
+   for (k=0; k<n; k++)
+   {
+      mbtcp_t *g = &gw[idx[k]];
+
+      if (pfd[k].revents == 0)
+         continue;
+
+      if (g->connecting)
+      {
+         int err = 0;
+         socklen_t len = sizeof(err);
+
+         getsockopt(g->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+         if (err != 0)
+         {
+            completed += gw_retry(g, err, done);
+            continue;
+         }
+         g->connecting = 0;
+      }
+
+      if ((pfd[k].revents & POLLOUT) && (flush_tx(g) != 0))
+      {
+         completed += gw_fail(g, errno, done);
+         continue;
+      }
+
+      if (pfd[k].revents & (POLLIN | POLLERR | POLLHUP))
+         completed += read_rx(g, done);
+   }
+
+   /* Retry connects which timed out, complete all requests whose 
+      response timeout has passed */
+   now = now_us();
+   for (i=0; i<num_gw; i++)
+   {
+      if (gw[i].connecting && (gw[i].connect_deadline <= now))
+         completed += gw_retry(&gw[i], ETIMEDOUT, done);
+
+      for (k=0; k<MBTCP_MAX_WINDOW; k++)
+      {
+         mbtcp_slot_t *slot = &gw[i].slot[k];
+
+         if (!slot->used || (slot->deadline > now))
+            continue;
+         slot->used = 0;
+         gw[i].in_flight--;
+         completed++;
+         done(slot->user, NULL, 0, ETIMEDOUT);
+         completed += drop_tx(&gw[i], slot, done);
+      }
+   }
+
+   return completed;
+}
+
+
+void mbtcp_close(mbtcp_t *gw, mbtcp_done_t done)
+{
+   gw_fail(gw, ECANCELED, done);
+   if (gw->addr != NULL)
+      freeaddrinfo(gw->addr);
+   gw->addr = NULL;
+}
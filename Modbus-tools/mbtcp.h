@@ -0,0 +1,74 @@
+/*****************************************************************
+ * Non-blocking Modbus TCP master engine
+ *
+ * Author: Ondrej Wisniewski
+ *
+ * History:
+ * 14/10/2026: First release
+ * 14/10/2026: Resolve the gateway once, try all its addresses,
+ *             bounded transmit buffer and connect timeout
+ *
+ *****************************************************************/
+
+#ifndef MBTCP_H
+#define MBTCP_H
+
+#include <stdint.h>
+#include <netdb.h>
+#include <modbus/modbus.h>
+
+
+/* Maximum requests in flight per gateway */
+#define MBTCP_MAX_WINDOW    16
+
+/* Maximum gateways driven by one engine */
+#define MBTCP_MAX_GATEWAYS  32
+
+/* Timeout of a connect to one address of a gateway in us */
+#define MBTCP_CONNECT_TIMEOUT  3000000
+
+/* Called once per request with the response PDU (function code
+   onwards), or with rsp NULL and err set to an errno value */
+typedef void (*mbtcp_done_t)(void *user, const uint8_t *rsp, int rsp_length, int err);
+
+/* Request in flight */
+typedef struct {
+   int used;
+   uint16_t tid;           /* transaction identifier */
+   uint8_t unit;
+   uint8_t fc;
+   uint64_t deadline;      /* response timeout in us (monotonic clock) */
+   uint64_t tx_pos;        /* stream position of the request in tx */
+   int tx_size;            /* size of the request in tx */
+   void *user;
+} mbtcp_slot_t;
+
+/* Gateway connection */
+typedef struct {
+   int fd;                 /* -1 while not connected */
+   int connecting;         /* non-blocking connect in progress */
+   uint64_t connect_deadline;
+   char host[64];
+   int port;
+   struct addrinfo *addr;  /* addresses of the gateway */
+   struct addrinfo *cur;   /* address connected or being connected */
+   int window;             /* max requests in flight */
+   int in_flight;
+   uint16_t next_tid;
+   mbtcp_slot_t slot[MBTCP_MAX_WINDOW];
+   int rx_length;
+   uint8_t rx[MODBUS_TCP_MAX_ADU_LENGTH];
+   int tx_length;
+   uint64_t tx_sent;       /* stream position of tx[0] */
+   uint8_t tx[MBTCP_MAX_WINDOW*MODBUS_TCP_MAX_ADU_LENGTH];
+} mbtcp_t;
+
+
+int mbtcp_init(mbtcp_t *gw, const char *host, int port, int window);
+int mbtcp_free_slots(const mbtcp_t *gw);
+int mbtcp_send(mbtcp_t *gw, int unit, const uint8_t *pdu, int pdu_length,
+               uint64_t timeout, void *user);
+int mbtcp_run(mbtcp_t *gw, int num_gw, uint64_t until, mbtcp_done_t done);
+void mbtcp_close(mbtcp_t *gw, mbtcp_done_t done);
+
+#endif
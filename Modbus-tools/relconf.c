@@ -9,10 +9,13 @@
  * Author: Ondrej Wisniewski
  * 
  * Build with this command:
- * gcc relconf.c -o relconf -lmodbus
+ * gcc relconf.c mbcommon.c mbraw.c -o relconf -lmodbus
  * 
  * History:
  * 06/06/2018 - initial release
+ * 14/10/2026 - serial device selectable with -d
+ * 14/10/2026 - baudrate selectable with -b
+ * 14/10/2026 - check the response against the request
  * 
  * Copyright 2018
  * 
@@ -74,6 +77,8 @@
 #include <errno.h>
 #include <unistd.h>
 #include <modbus/modbus.h>
+#include "mbcommon.h"
+#include "mbraw.h"
 
 
 #define VERSION       "0.1"
@@ -83,8 +88,6 @@
 
 #define SERIAL_PORT    "/dev/ttyAMA0"
 #define BAUDRATE       9600
-#define RTS_DELAY      10
-#define REQ_FRAME_LEN  6
 #define DATA_OFFSET_RD 3
 #define DATA_OFFSET_WR 4
 
@@ -92,124 +95,91 @@
 int main(int argc, char* argv[])
 {
     modbus_t *mb;
+    mb_conn_t conn;
+    const char *device = SERIAL_PORT;
+    int baudrate = BAUDRATE;
+    int opt;
     
     int fc;
     int reg_addr;
     int reg_val=1;
     int req_length;
-    int rsp_length;
-    uint8_t rsp[MODBUS_TCP_MAX_ADU_LENGTH];
+    uint8_t req[MB_RAW_REQ_SIZE];
+    uint8_t rsp[MB_RAW_RSP_SIZE];
+    mb_frame_t frame;
     
     
     /**************************************************************
      * Parse input parameters
      **************************************************************/
     
-    if (argc < 2)
+    while ((opt = getopt(argc, argv, "d:b:")) != -1)
+    {
+        if (opt == 'd')
+            device = optarg;
+        else if (opt == 'b')
+            baudrate = atoi(optarg);
+        else
+            argc = 0;
+    }
+    
+    if (argc - optind < 1)
     {
         printf("Relay sensor configuration tool, ver %s (using libmodbus %s)\n\n", VERSION, LIBMODBUS_VERSION_STRING);
-        printf("usage: relconf <reg_addr> [<reg_val>]\n");
+        printf("usage: relconf [-d <device>] [-b <baudrate>] <reg_addr> [<reg_val>]\n");
+        printf("   device:   serial port, default %s\n", SERIAL_PORT);
+        printf("   baudrate: 2400,4800,9600,19200,38400, default %d\n", BAUDRATE);
         return 0;
     }
     
-    int i = 1;
+    if ((baudrate != 2400) && (baudrate != 4800) && (baudrate != 9600) && 
+        (baudrate != 19200) && (baudrate != 38400))
+    {
+        printf("Invalid baudrate %d\n", baudrate);
+        return -1;
+    }
+    
+    int i = optind;
     reg_addr = atoi(argv[i++]);
-    if (argc > 2)
+    if (argc > i)
     {
         reg_val  = atoi(argv[i++]);
         fc = MODBUS_FC_WRITE_SINGLE_REGISTER;
+        req_length = mb_raw_relay_write(req, reg_addr, reg_val);
     }
     else
     {
         fc = MODBUS_FC_READ_HOLDING_REGISTERS;
+        req_length = mb_raw_relay_read(req, reg_addr);
     }
-
-    uint8_t raw_req[] = { 0xFF, fc, 0x00, reg_addr, reg_val>>8, reg_val };
     
     
     /**************************************************************
      * Initialize communication port
      **************************************************************/
     
-    /* Create Modbus context */
-    mb = modbus_new_rtu(SERIAL_PORT, BAUDRATE, 'N', 8, 1);
-    if (mb == NULL) {
-        printf("Unable to create the libmodbus context\n");
-        return -1;
-    }
-    
-    /* Set debug mode */
-    if (DEBUG)
-        modbus_set_debug(mb, TRUE);
-    
-    /* Set slave address */
-    modbus_set_slave(mb, 0xFF);
-    
-    /* Connect to serial port */
-    if (DEBUG)
-        printf("Connecting to slave addr %d\n", 0xFF);
-    if (modbus_connect(mb) == -1)
-    {
-        printf("Connection failed: %s\n", modbus_strerror(errno));
-        modbus_free(mb);
+    /* Create Modbus context and connect to serial port */
+    mb_init_rtu(&conn, device, baudrate);
+    conn.debug = DEBUG;
+    mb = mb_connect(&conn, MB_RAW_RELAY_ADDR);
+    if (mb == NULL)
         return -1;
-    }
-    
-    /* Set Modbus timeouts */
-    modbus_set_response_timeout(mb, 2, 0); // 2s
-    modbus_set_byte_timeout(mb, 0, 0);     // not used
-    
-    if (strstr(SERIAL_PORT, "USB") == NULL)
-    {
-        /* Enable RS485 direction control via RTS line */
-        if (modbus_rtu_set_rts(mb, MODBUS_RTU_RTS_DOWN) == -1)
-        {
-            printf("Setting RTS mode failed: %s\n", modbus_strerror(errno));
-            modbus_free(mb);
-            return -1;
-        }
-        
-        /* Set RTS control delay (before and after transmission) */
-        if (RTS_DELAY>0)
-        {
-            if (modbus_rtu_set_rts_delay(mb, RTS_DELAY) == -1)
-            {
-                printf("Setting RTS delay failed: %s\n", modbus_strerror(errno));
-                modbus_free(mb);
-                return -1;
-            }
-        }
-        if (DEBUG)
-            printf("RTS delay is %dus\n", modbus_rtu_get_rts_delay(mb));
-    }
     
     
     /**************************************************************
      * Perform request
      **************************************************************/
     
-    req_length = modbus_send_raw_request(mb, raw_req, REQ_FRAME_LEN * sizeof(uint8_t));
-    rsp_length = modbus_receive_confirmation(mb, rsp);
-
-    if (fc == MODBUS_FC_READ_HOLDING_REGISTERS)
-    {
-        reg_val = rsp[DATA_OFFSET_RD]<<8;
-        reg_val |= rsp[DATA_OFFSET_RD+1];
-    }
-    else
-    {
-        reg_val = rsp[DATA_OFFSET_WR]<<8;
-        reg_val |= rsp[DATA_OFFSET_WR+1];
-    }
-    
-    //printf("req_length:%d, rsp_length:%d\n", req_length, rsp_length);
-    if (rsp_length != -1)
+    /* The response is checked against the request before it is used */
+    if (mb_raw_transact(mb, req, req_length, rsp, &frame) == 0)
     {
+        reg_val = mb_frame_u16(&frame, (fc == MODBUS_FC_READ_HOLDING_REGISTERS) ? 
+                               DATA_OFFSET_RD : DATA_OFFSET_WR);
         printf("reg %d: 0x%04X (%d)\n", reg_addr, reg_val, reg_val);
     }
     else
     {
-        printf("ERROR performing Modbus request\n");
+        printf("ERROR performing Modbus request: %s\n", modbus_strerror(errno));
     }
     
     
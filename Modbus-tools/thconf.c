@@ -15,10 +15,12 @@
  * Author: Ondrej Wisniewski
  * 
  * Build with this command:
- * gcc thconf.c -o thconf -lmodbus
+ * gcc thconf.c mbcommon.c mbraw.c -o thconf -lmodbus
  * 
  * History:
  * 27/06/2017 - initial release
+ * 14/10/2026 - serial device selectable with -d
+ * 14/10/2026 - check the response against the request
  * 
  * Copyright 2017
  * 
@@ -75,6 +77,8 @@
 #include <errno.h>
 #include <unistd.h>
 #include <modbus/modbus.h>
+#include "mbcommon.h"
+#include "mbraw.h"
 
 
 #define VERSION       "0.1"
@@ -84,76 +88,60 @@
 
 #define SERIAL_PORT   "/dev/ttyAMA0"
 #define BAUDRATE      9600
-#define RTS_DELAY     10
-#define REQ_FRAME_LEN 9
-#define RSP_FRAME_LEN 6
 
-uint8_t check_baudrate(int baudrate)
-{
-    uint8_t br;
-    
-    switch (baudrate)
-    {
-        case 1200:
-            br=3;
-            break;
-        case 2400:
-            br=4;
-            break;
-        case 4800:
-            br=5;
-            break;
-        case 9600:
-            br=6;
-            break;
-        case 19200:
-            br=7;
-            break;
-        default:
-            br=0;
-    }
-    return br;
-}
 
 int main(int argc, char* argv[])
 {
     modbus_t *mb;
+    mb_conn_t conn;
+    const char *device = SERIAL_PORT;
+    int opt;
     
     int baudrate;
     int new_baudrate;
     int slave_addr;   
     int new_slave_addr;   
     int req_length;
-    uint8_t rsp[MODBUS_TCP_MAX_ADU_LENGTH];
-    uint8_t br_code;
+    uint8_t req[MB_RAW_REQ_SIZE];
+    uint8_t rsp[MB_RAW_RSP_SIZE];
+    mb_frame_t frame;
     
     
     /**************************************************************
      * Parse input parameters
      **************************************************************/
     
-    if (argc < 5)
+    while ((opt = getopt(argc, argv, "d:")) != -1)
+    {
+        if (opt == 'd')
+            device = optarg;
+        else
+            argc = 0;
+    }
+    
+    if (argc - optind < 4)
     {
         printf("TH sensor configuration tool, ver %s (using libmodbus %s)\n\n", VERSION, LIBMODBUS_VERSION_STRING);
-        printf("usage: thconf <baudrate> <slave_addr> <new_baudrate> <new_slave_addr>\n");
+        printf("usage: thconf [-d <device>] <baudrate> <slave_addr> <new_baudrate> <new_slave_addr>\n");
+        printf("   device:                     serial port, default %s\n", SERIAL_PORT);
         printf("   baudrate, new_baudrate:     1200,2400,4800,9600,19200\n");
         printf("   slave_addr, new_slave_addr: 1..247\n");
         return 0;
     }
     
-    int i = 1;
+    int i = optind;
     baudrate       = atoi(argv[i++]);
     slave_addr     = atoi(argv[i++]);
     new_baudrate   = atoi(argv[i++]);
     new_slave_addr = atoi(argv[i++]);
     
-    if (check_baudrate(baudrate) == 0)
+    if (mb_raw_th_baudrate(baudrate) == 0)
     {
         printf("Invalid baudrate %d\n", baudrate);
         return -1;
     }
     
-    if ((br_code=check_baudrate(new_baudrate)) == 0)
+    if (mb_raw_th_baudrate(new_baudrate) == 0)
     {
         printf("Invalid new baudrate %d\n", new_baudrate);
         return -1;
@@ -171,74 +159,27 @@ int main(int argc, char* argv[])
         return -1;
     }
     
-    uint8_t raw_req[] = { slave_addr, MODBUS_FC_WRITE_SINGLE_REGISTER, 0x00, 0x00, 0x00, 0x01, 0x02, new_slave_addr, br_code };
+    req_length = mb_raw_th_settings(req, slave_addr, new_slave_addr, new_baudrate);
     
     
     /**************************************************************
      * Initialize communication port
      **************************************************************/
     
-    /* Create Modbus context*/
-    mb = modbus_new_rtu(SERIAL_PORT, baudrate, 'N', 8, 1);
-    if (mb == NULL) {
-        printf("Unable to create the libmodbus context\n");
-        return -1;
-    }
-    
-    /* Set debug mode */
-    if (DEBUG)
-        modbus_set_debug(mb, TRUE);
-    
-    /* Set slave address */
-    modbus_set_slave(mb, slave_addr);
-    
-    /* Connect to serial port */
-    if (DEBUG)
-        printf("Connecting to slave addr %d\n", slave_addr);
-    if (modbus_connect(mb) == -1)
-    {
-        printf("Connection failed: %s\n", modbus_strerror(errno));
-        modbus_free(mb);
+    /* Create Modbus context and connect to serial port */
+    mb_init_rtu(&conn, device, baudrate);
+    conn.debug = DEBUG;
+    mb = mb_connect(&conn, slave_addr);
+    if (mb == NULL)
         return -1;
-    }
-    
-    /* Set Modbus timeouts */
-    modbus_set_response_timeout(mb, 2, 0); // 2s
-    modbus_set_byte_timeout(mb, 0, 0);     // not used
-    
-    if (strstr(SERIAL_PORT, "USB") == NULL)
-    {
-        /* Enable RS485 direction control via RTS line */
-        if (modbus_rtu_set_rts(mb, MODBUS_RTU_RTS_DOWN) == -1)
-        {
-            printf("Setting RTS mode failed: %s\n", modbus_strerror(errno));
-            modbus_free(mb);
-            return -1;
-        }
-        
-        /* Set RTS control delay (before and after transmission) */
-        if (RTS_DELAY>0)
-        {
-            if (modbus_rtu_set_rts_delay(mb, RTS_DELAY) == -1)
-            {
-                printf("Setting RTS delay failed: %s\n", modbus_strerror(errno));
-                modbus_free(mb);
-                return -1;
-            }
-        }
-        if (DEBUG)
-            printf("RTS delay is %dus\n", modbus_rtu_get_rts_delay(mb));
-    }
     
     
     /**************************************************************
      * Perform request
      **************************************************************/
     
-    req_length = modbus_send_raw_request(mb, raw_req, REQ_FRAME_LEN * sizeof(uint8_t));
-    modbus_receive_confirmation(mb, rsp);
-    
-    if (memcmp(raw_req, rsp, RSP_FRAME_LEN) == 0)
+    /* The sensor echoes the standard part of the request */
+    if (mb_raw_transact(mb, req, req_length, rsp, &frame) == 0)
     {
         printf("Successfully changed sensor configuration\n");
         if (baudrate != new_baudrate)
@@ -248,7 +189,7 @@ int main(int argc, char* argv[])
     }
     else
     {
-        printf("ERROR changing sensor configuration, check parameters\n");
+        printf("ERROR changing sensor configuration, check parameters: %s\n", modbus_strerror(errno));
     }
     
     